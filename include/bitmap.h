@@ -1,152 +1,285 @@
-#ifndef BITMAP_H__
-#define BITMAP_H__
-
-#ifdef __cplusplus
-	extern "C" {
-#endif
-
-#include <stdint.h>
-#include <stdlib.h>
-#include <stddef.h>
-#include <stdbool.h>
-
-typedef struct bitmap bitmap_t;
-
-// WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
-// This was originally a high performance C++ library, so the C translation assumes you're using it right.
-
-// But is there really such a thing as a high-performance shared library?
-
-///
-/// Sets requested bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to set
-///
-void bitmap_set(bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Clears requested bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to clear
-///
-void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Returns bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to query
-/// \return State of requested bit
-///
-bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Flips bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to flip
-///
-void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Flips all bits in the bitmap
-/// \param bitmap The bitmap to invert
-///
-void bitmap_invert(bitmap_t *const bitmap);
-
-///
-/// Find first set
-/// \param bitmap The bitmap
-/// \return The first one bit address, SIZE_MAX on error/not found
-///
-size_t bitmap_ffs(const bitmap_t *const bitmap);
-
-///
-/// Find first zero
-/// \param bitmap The bitmap
-/// \return The first zero bit address, SIZE_MAX on error/not found
-///
-size_t bitmap_ffz(const bitmap_t *const bitmap);
-
-///
-/// Count all bits set
-/// \param bitmap the bitmap
-/// \return the total number of bits that are set in the bitmap
-///
-size_t bitmap_total_set(const bitmap_t *const bitmap);
-///
-/// For each loop for all set bits
-///  (Arguments passed to func are saved across calls)
-/// \param bitmap The bitmap
-/// \param func The function to apply (first parameter will be size_t with the bit number)
-/// \param args A generic pointer to pass to the called function
-///
-void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
-
-///
-/// Resets bitmap contents to the desired pattern
-/// (pattern not guarenteed accurate for final bits
-/// 		if bit_count is not a multiple of 8)
-/// \param bitmap The bitmap
-/// \param pattern The pattern to apply to all bytes
-///
-void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern);
-
-///
-/// Gets total number of bits in bitmap
-/// \param bitmap The bitmap
-/// \return The number of bits in the bitmap
-///
-size_t bitmap_get_bits(const bitmap_t *const bitmap);
-
-///
-/// Gets total number of bytes in bitmap
-/// \param bitmap The bitmap
-/// \return number of bytes used by bitmap storage array
-///
-size_t bitmap_get_bytes(const bitmap_t *const bitmap);
-
-///
-/// Creates a bitmap to contain n bits (zero initialized)
-/// \param n_bits
-/// \return New bitmap pointer, NULL on error
-///
-bitmap_t *bitmap_create(const size_t n_bits);
-
-///
-/// Gets pointer to the internal data for exporting
-/// Be sure to query the bit and byte size if it's unknown
-/// \param bitmap The bitmap
-/// \return Pointer for writing
-///
-const uint8_t *bitmap_export(const bitmap_t *const bitmap);
-
-///
-/// Creates a new bitmap with the provided data
-/// Note: This does not use the buffer but copies the data
-///  to an internal buffer
-/// \param n_bits The number of bits in the bitmap
-/// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
-///
-bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
-
-///
-/// Creates a new bitmap using the provided data
-/// Note: This uses the given block of memory
-///  and does not free this pointer on destruction
-/// \param n_bits The number of bits in the bitmap
-/// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
-///
-bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
-
-///
-/// Destructs and destroys bitmap object
-/// \param bitmap The bitmap
-///
-void bitmap_destroy(bitmap_t *bitmap);
-
-#ifdef __cplusplus
-}
-#endif
-
-#endif
+#ifndef BITMAP_H__
+#define BITMAP_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct bitmap bitmap_t;
+
+// WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
+// This was originally a high performance C++ library, so the C translation assumes you're using it right.
+
+// But is there really such a thing as a high-performance shared library?
+
+// bitmap_set, bitmap_reset and bitmap_flip are plain read-modify-writes of the bit's byte, for bitmaps only one thread
+// changes at a time. Shared bitmaps go through the atomic calls: test_and_set/reset, the claims, and the range ops
+
+///
+/// Sets requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+///
+void bitmap_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Clears requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+///
+void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Returns bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically sets requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return The state of the bit before the call, false means this call is the one that set it
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return The state of the bit before the call, true means this call is the one that cleared it
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Flips bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to flip
+///
+void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Flips all bits in the bitmap
+/// \param bitmap The bitmap to invert
+///
+void bitmap_invert(bitmap_t *const bitmap);
+
+///
+/// Find first set
+/// \param bitmap The bitmap
+/// \return The first one bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_ffs(const bitmap_t *const bitmap);
+
+///
+/// Find first zero
+/// \param bitmap The bitmap
+/// \return The first zero bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz(const bitmap_t *const bitmap);
+
+///
+/// Finds the first set bit at or after from, a word at a time
+/// \param bitmap The bitmap
+/// \param from The bit to start looking at
+/// \return The bit's index, SIZE_MAX if there isn't one (or on error)
+///
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Finds the first clear bit at or after from, a word at a time
+/// \param bitmap The bitmap
+/// \param from The bit to start looking at
+/// \return The bit's index, SIZE_MAX if there isn't one (or on error)
+///
+size_t bitmap_next_clear(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Find a run of consecutive zeros
+/// \param bitmap The bitmap
+/// \param from The first bit the run may start at
+/// \param count The length of the run
+/// \return The first bit of the first long enough run, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t from, const size_t count);
+
+///
+/// Sets up to count zero bits in a single pass, lowest first
+///  Safe to call from several threads at once, no bit is ever handed to two callers
+/// \param bitmap The bitmap
+/// \param count The number of bits wanted
+/// \param bits Array of at least count entries that receives the addresses of the bits set
+/// \return The number of bits set, fewer than count if the bitmap ran out
+///
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t count, size_t *const bits);
+
+///
+/// bitmap_claim_zeros, but only looking at the given range of bits
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param length The length of the range, anything past the end of the bitmap is ignored
+/// \param count The number of bits wanted
+/// \param bits Array of at least count entries that receives the addresses of the bits set
+/// \param scanned Receives the number of bits in the words the search loaded (a summary lets it skip the rest), may be NULL
+/// \return The number of bits set, fewer than count if the range ran out
+///
+size_t bitmap_claim_zeros_range(bitmap_t *const bitmap, const size_t start, const size_t length, const size_t count, size_t *const bits, size_t *const scanned);
+
+///
+/// Atomically clears every bit in the list, one operation per word instead of one per bit
+///  (bits outside the bitmap are skipped)
+/// \param bitmap The bitmap
+/// \param bits The addresses of the bits to clear, sorted lists clear the fastest
+/// \param count The number of entries in bits
+/// \param cleared Receives the addresses of the bits this call cleared (room for count of them), may be NULL
+/// \return The number of bits that were set before the call
+///
+size_t bitmap_reset_many(bitmap_t *const bitmap, const size_t *const bits, const size_t count, size_t *const cleared);
+
+///
+/// Atomically sets every bit of a range, but only if all of them were clear
+///  If another thread holds any of them, nothing is changed
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param count The length of the range
+/// \return true if this call set the whole range, false on error/conflict
+///
+bool bitmap_claim_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Atomically sets every bit of a range, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param count The length of the range
+/// \return The number of bits that were clear before the call, 0 on error
+///
+size_t bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Atomically clears every bit of a range, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param count The length of the range
+/// \return The number of bits that were set before the call, 0 on error
+///
+size_t bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Checks whether every bit of a range is set
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param count The length of the range
+/// \return true if they all are, false if any isn't or on error
+///
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Counts the bits set in a range
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param count The length of the range
+/// \return The number of bits set, 0 on error
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Count all bits set
+/// \param bitmap the bitmap
+/// \return the total number of bits that are set in the bitmap
+///
+size_t bitmap_total_set(const bitmap_t *const bitmap);
+///
+/// For each loop for all set bits
+///  (Arguments passed to func are saved across calls)
+/// \param bitmap The bitmap
+/// \param func The function to apply (first parameter will be size_t with the bit number)
+/// \param args A generic pointer to pass to the called function
+///
+void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
+
+///
+/// Resets bitmap contents to the desired pattern
+/// (pattern not guarenteed accurate for final bits
+/// 		if bit_count is not a multiple of 8)
+/// \param bitmap The bitmap
+/// \param pattern The pattern to apply to all bytes
+///
+void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern);
+
+///
+/// Attaches an out-of-band summary so ffs/ffz only read a few words no matter how full
+///  the bitmap is. set/reset/flip keep it up to date, but it is built from the current
+///  contents, so call this again after changing the underlying data directly (e.g. through
+///  an overlay). The summary is never part of the exported data.
+/// \param bitmap The bitmap
+/// \return true on success, false on error
+///
+bool bitmap_summarize(bitmap_t *const bitmap);
+
+///
+/// Gets total number of bits in bitmap
+/// \param bitmap The bitmap
+/// \return The number of bits in the bitmap
+///
+size_t bitmap_get_bits(const bitmap_t *const bitmap);
+
+///
+/// Gets total number of bytes in bitmap
+/// \param bitmap The bitmap
+/// \return number of bytes used by bitmap storage array
+///
+size_t bitmap_get_bytes(const bitmap_t *const bitmap);
+
+///
+/// Creates a bitmap to contain n bits (zero initialized)
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create(const size_t n_bits);
+
+///
+/// Gets pointer to the internal data for exporting
+/// Be sure to query the bit and byte size if it's unknown
+/// \param bitmap The bitmap
+/// \return Pointer for writing
+///
+const uint8_t *bitmap_export(const bitmap_t *const bitmap);
+
+///
+/// Creates a new bitmap with the provided data
+/// Note: This does not use the buffer but copies the data
+///  to an internal buffer
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to import
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
+
+///
+/// Creates a new bitmap using the provided data
+/// Note: This uses the given block of memory
+///  and does not free this pointer on destruction
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to import
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
+
+///
+/// Destructs and destroys bitmap object
+/// \param bitmap The bitmap
+///
+void bitmap_destroy(bitmap_t *bitmap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
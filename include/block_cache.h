@@ -0,0 +1,73 @@
+#ifndef BLOCK_CACHE_H__
+#define BLOCK_CACHE_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A fixed number of block-sized frames in front of a file, with CLOCK replacement
+// Writes stay in their frame (write-back) until it's evicted or the cache is flushed
+// All calls are thread safe, one lock covers the whole cache
+typedef struct block_cache block_cache_t;
+
+///
+/// Creates a cache in front of an open file, the file stays the caller's to close
+/// \param fd The file, opened for reading and writing
+/// \param block_size Number of bytes per block, block n is at offset n * block_size
+/// \param frames Number of blocks the cache holds at most
+/// \return Pointer to the new cache, NULL on error
+///
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t frames);
+
+///
+/// Writes back any dirty frames (without syncing them) and frees the cache
+/// \param cache The cache
+///
+void block_cache_destroy(block_cache_t *const cache);
+
+///
+/// Reads a block, from its frame if it has one, from the file otherwise
+/// \param cache The cache
+/// \param block The block to read
+/// \param buffer Receives the block's bytes
+/// \return true on success, false on error
+///
+bool block_cache_read(block_cache_t *const cache, const size_t block, void *const buffer);
+
+///
+/// Writes a whole block into its frame, it only reaches the file once the frame is evicted or flushed
+/// \param cache The cache
+/// \param block The block to write
+/// \param buffer The block's new bytes
+/// \return true on success, false on error
+///
+bool block_cache_write(block_cache_t *const cache, const size_t block, const void *const buffer);
+
+///
+/// Writes back every dirty frame, the frames stay cached
+/// \param cache The cache
+/// \return true on success, false on error
+///
+bool block_cache_flush(block_cache_t *const cache);
+
+///
+/// Counts of what the cache has done since it was created
+/// \param cache The cache
+/// \param hits Receives the number of reads and writes that found their block cached
+/// \param misses Receives the number of reads and writes that didn't
+/// \param evictions Receives the number of blocks pushed out to make room
+/// \param writebacks Receives the number of dirty frames written to the file
+/// \return true on success, false on error
+///
+bool block_cache_stats(const block_cache_t *const cache, uint64_t *const hits, uint64_t *const misses, uint64_t *const evictions, uint64_t *const writebacks);
+
+#ifdef __cplusplus
+	}
+#endif
+
+#endif
@@ -8,6 +8,8 @@ extern "C"
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 	// Constants
 #define BLOCK_STORE_NUM_BLOCKS 512        // 2^9 data block
@@ -17,6 +19,8 @@ extern "C"
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
 #define BITMAP_START_BLOCK 127
 #define BITMAP_NUM_BLOCKS (BITMAP_SIZE_BYTES / BLOCK_SIZE_BYTES)
+#define BLOCK_STORE_MAGAZINE_MAX 64        // Most free block ids a per-thread magazine can hold
+#define BLOCK_STORE_LATENCY_BUCKETS 40        // Buckets per latency histogram, the last one starts at 2^39 ns (about 9 minutes)
 
 	// Declaring the struct but not implementing in the header allows us to prevent users
 	//  from using the object directly and monkeying with the contents
@@ -24,12 +28,33 @@ extern "C"
 	// This enforces a black box device, but it can be restricting
 	typedef struct block_store block_store_t;
 
+	// A read-only view of a BS device as it was at some point, see block_store_snapshot
+	// (the tag isn't block_store_snapshot so it doesn't clash with the function in C++)
+	typedef struct block_store_snap block_store_snapshot_t;
+
+	// A serialize running in the background, see block_store_checkpoint_start
+	typedef struct block_store_checkpoint block_store_checkpoint_t;
+
+	// Allocation is thread safe: allocate, allocate_many, request, release, release_many and the extent
+	//  calls can be used from any number of threads at once, no block is ever handed out twice
+	// Reads and writes can also come from any number of threads: readers never take a lock, and never
+	//  see part of one write and part of another (pointers from the pin calls are on their own, though)
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// This creates a new BS device with the requested geometry
+	///  The in-band bitmap lives at BITMAP_START_BLOCK, or as close to it as the device allows
+	/// \param num_blocks Total number of blocks in the device, including the bitmap's own blocks
+	/// \param block_size Number of bytes per block
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
@@ -44,6 +69,16 @@ extern "C"
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Searches for up to count free blocks in a single pass, marks them as in use,
+	///  and stores their ids
+	/// \param bs BS device
+	/// \param count Number of blocks wanted
+	/// \param block_ids Array of at least count entries to receive the allocated ids
+	/// \return Number of blocks allocated, which is less than count if the device filled up
+	///
+	size_t block_store_allocate_many(block_store_t *const bs, const size_t count, size_t *const block_ids);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -59,6 +94,91 @@ extern "C"
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Frees every block in the list (ids out of range are skipped)
+	/// \param bs BS device
+	/// \param block_ids The blocks to free, sorted lists free the fastest
+	/// \param count Number of entries in block_ids
+	///
+	void block_store_release_many(block_store_t *const bs, const size_t *const block_ids, const size_t count);
+
+	///
+	/// Searches for a run of consecutive free blocks, marks all of them as in use,
+	///  and returns the id of the first one. Extents never cross the bitmap's own blocks.
+	/// \param bs BS device
+	/// \param count Number of blocks in the extent
+	/// \return First block id of the extent, SIZE_MAX on error
+	///
+	size_t block_store_allocate_extent(block_store_t *const bs, const size_t count);
+
+	///
+	/// Frees the specified run of blocks
+	///  Nothing is freed if the run is out of range or covers any of the bitmap's own blocks
+	/// \param bs BS device
+	/// \param block_id The first block of the extent
+	/// \param count Number of blocks in the extent
+	///
+	void block_store_release_extent(block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Attempts to allocate every block of a run, all or nothing, a word of the bitmap at a time
+	/// \param bs BS device
+	/// \param block_id The first block of the run
+	/// \param count Number of blocks in the run
+	/// \return true if the whole run was free and is now allocated, false on error or if any of it was in use
+	///  (blocks parked in a magazine count as in use here)
+	///
+	bool block_store_request_range(block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Frees every block of a run, a word of the bitmap at a time
+	///  Nothing is freed if the run is out of range, covers any of the bitmap's own blocks, or has a pinned block in it
+	/// \param bs BS device
+	/// \param block_id The first block of the run
+	/// \param count Number of blocks in the run
+	/// \return Number of blocks that were allocated and now aren't, 0 on error
+	///
+	size_t block_store_release_range(block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Puts a per-thread cache of free block ids in front of the bitmap, after this
+	///  allocate/release mostly stay within the calling thread and only touch the bitmap in batches
+	///  Allocate no longer always returns the lowest free block, and the used/free counts include parked blocks as free
+	///  Must be called before the device is shared between threads
+	/// \param bs BS device
+	/// \param capacity Number of ids each thread's magazine holds, 1 to BLOCK_STORE_MAGAZINE_MAX
+	/// \return true on success, false on error or if magazines were already enabled
+	///
+	bool block_store_enable_magazines(block_store_t *const bs, const size_t capacity);
+
+	///
+	/// Returns every block parked in the magazines to the bitmap
+	///  Serialize and sync do this themselves, so parked blocks never show up as allocated in an image
+	/// \param bs BS device
+	///
+	void block_store_drain_magazines(block_store_t *const bs);
+
+	///
+	/// Splits the device's ids into shards, ranges that different threads start their searches for free blocks in
+	///  Threads allocate from their own shard, and only from the others once it's full
+	///  It's only a placement hint, shards have no bitmap or lock of their own: the bitmap (and its summary) is still
+	///  the one shared, atomically updated bitmap. Threads in different shards claim in different cache lines of it,
+	///  but a summary word covers 8 shards, so they still meet there whenever a word of theirs fills up or empties
+	///  Ids and the image don't change
+	///  Must be called before the device is shared between threads
+	/// \param bs BS device
+	/// \param shards Number of shards wanted, small devices may get fewer
+	/// \return true on success, false on error or if the device was already sharded
+	///
+	bool block_store_enable_shards(block_store_t *const bs, const size_t shards);
+
+	///
+	/// Number of shards the device is split into
+	/// \param bs BS device
+	/// \return Number of shards, 1 if the device isn't sharded, 0 on error
+	///
+	size_t block_store_get_shard_count(const block_store_t *const bs);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -66,6 +186,16 @@ extern "C"
 	///
 	size_t block_store_get_used_blocks(const block_store_t *const bs);
 
+	///
+	/// Calls func for every allocated block, in order, skipping over free ones a word of the bitmap at a time
+	///  Blocks allocated or freed while this runs may or may not be visited
+	/// \param bs BS device
+	/// \param func The function to call, with the block's id and arg
+	/// \param arg Passed through to func
+	/// \return Number of blocks visited, SIZE_MAX on error
+	///
+	size_t block_store_for_each_allocated(const block_store_t *const bs, void (*func)(size_t, void *), void *arg);
+
 	///
 	/// Counts the number of blocks marked free for use
 	/// \param bs BS device
@@ -80,6 +210,20 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns the total number of user-addressable blocks of this device
+	/// \param bs BS device
+	/// \return Total blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_total_blocks_ex(const block_store_t *const bs);
+
+	///
+	/// Returns the number of bytes in each block of this device
+	/// \param bs BS device
+	/// \return Block size in bytes, 0 on error
+	///
+	size_t block_store_get_block_size(const block_store_t *const bs);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
 	/// \param bs BS device
@@ -98,6 +242,88 @@ extern "C"
 	///
 	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+	///
+	/// Reads the listed blocks, in order, into the buffers described by iov, in order
+	///  Every block is checked before anything is copied, and runs of consecutive ids
+	///  are copied with a single memcpy per buffer
+	/// \param bs BS device
+	/// \param block_ids Source block ids
+	/// \param id_count Number of entries in block_ids
+	/// \param iov Buffers to fill, together they must hold at least id_count blocks
+	/// \param iov_count Number of entries in iov
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const size_t id_count, const struct iovec *const iov, const size_t iov_count);
+
+	///
+	/// Writes the buffers described by iov, in order, to the listed blocks, in order
+	///  Every block is checked before anything is copied, and runs of consecutive ids
+	///  are copied with a single memcpy per buffer
+	/// \param bs BS device
+	/// \param block_ids Destination block ids
+	/// \param id_count Number of entries in block_ids
+	/// \param iov Buffers to write, together they must hold at least id_count blocks
+	/// \param iov_count Number of entries in iov
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const size_t id_count, const struct iovec *const iov, const size_t iov_count);
+
+	///
+	/// Pins a block, or a run of consecutive blocks, and returns a pointer straight into the device
+	///  Pinned blocks can't be released, so the pointer stays good until block_store_unpin
+	/// \param bs BS device
+	/// \param block_id First block to pin
+	/// \param count Number of blocks to pin
+	/// \return Pointer to count * block size bytes of the first block, NULL on error
+	///
+	const void *block_store_pin_read(const block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Pins a block, or a run of consecutive blocks, and returns a writable pointer straight into the device
+	///  The bitmap's own blocks can only be pinned for reading
+	/// \param bs BS device
+	/// \param block_id First block to pin
+	/// \param count Number of blocks to pin
+	/// \return Pointer to count * block size bytes of the first block, NULL on error
+	///
+	void *block_store_pin_write(block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Drops a pin taken by block_store_pin_read or block_store_pin_write
+	/// \param bs BS device
+	/// \param block_id First block that was pinned
+	/// \param count Number of blocks that were pinned
+	///
+	void block_store_unpin(const block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Takes a read-only snapshot of the device as it is now
+	///  Nothing is copied up front except the bitmap: the snapshot shares the device's blocks, and
+	///  a chunk of them is only copied for it the first time something writes to it afterwards
+	///  The bitmap copy makes this O(num_blocks / 8) bytes of copying rather than constant time, since
+	///  allocations change the bitmap with lock-free atomics that have no copy-on-write hook
+	///  Writes through pointers pinned before the snapshot was taken may still show up in it
+	/// \param bs BS device
+	/// \return Pointer to the new snapshot, NULL on error
+	///
+	block_store_snapshot_t *block_store_snapshot(block_store_t *const bs);
+
+	///
+	/// Reads a block as it was when the snapshot was taken
+	/// \param snapshot The snapshot
+	/// \param block_id Source block id
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error (including blocks that weren't allocated at the time)
+	///
+	size_t block_store_snapshot_read(const block_store_snapshot_t *const snapshot, const size_t block_id, void *buffer);
+
+	///
+	/// Lets go of a snapshot, the chunks preserved for it go to the next older one if it still needs them
+	///  Destroying the device releases any snapshots still held, so their handles go with it
+	/// \param snapshot The snapshot
+	///
+	void block_store_snapshot_release(block_store_snapshot_t *const snapshot);
+
 	///
 	/// Imports BS device from the given file - for grads/bonus
 	/// \param filename The file to load
@@ -105,6 +331,83 @@ extern "C"
 	///
 	block_store_t *block_store_deserialize(const char *const filename);
 
+	///
+	/// Imports BS device with the given geometry from the given file
+	/// \param filename The file to load
+	/// \param num_blocks Total number of blocks the image was created with
+	/// \param block_size Number of bytes per block the image was created with
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_ex(const char *const filename, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Imports BS device with the given geometry from the given file, without reading in its data blocks up front
+	///  Only the bitmap is read before this returns; every other block is read from the file the first time
+	///  something needs it (or sooner, by a background thread, if prefetch is set). The file has to stay put
+	///  until the device is destroyed, and changes to the device don't go back to it
+	/// \param filename The file to load
+	/// \param num_blocks Total number of blocks the image was created with
+	/// \param block_size Number of bytes per block the image was created with
+	/// \param prefetch Whether to read in the rest of the image in the background
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_lazy(const char *const filename, const size_t num_blocks, const size_t block_size, const bool prefetch);
+
+	///
+	/// Opens an image file as a BS device by mapping it into memory
+	///  Blocks are only read from the file when they're first touched, and changes go back
+	///  to the file on their own, block_store_sync forces them out
+	/// \param filename The image to map
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap(const char *const filename);
+
+	///
+	/// Opens an image file with the given geometry as a BS device by mapping it into memory
+	/// \param filename The image to map
+	/// \param num_blocks Total number of blocks the image was created with
+	/// \param block_size Number of bytes per block the image was created with
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap_ex(const char *const filename, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Opens an image file with the given geometry as a BS device that keeps only some of its blocks in memory
+	///  Blocks stay in the file and go through a cache of cache_blocks frames (CLOCK replacement), and
+	///  writes only go back to the file when their frame is evicted, on block_store_sync, or on destroy
+	///  The bitmap's own blocks are always in memory
+	///  The calls that need the whole device in memory (pins, vectored I/O, snapshots, checkpoints,
+	///  serialize and logging) fail on a cached device
+	/// \param filename The image to open
+	/// \param num_blocks Total number of blocks the image was created with
+	/// \param block_size Number of bytes per block the image was created with
+	/// \param cache_blocks Most blocks to keep in memory at once, besides the bitmap's
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_cached(const char *const filename, const size_t num_blocks, const size_t block_size, const size_t cache_blocks);
+
+	typedef struct block_store_cache_stats {
+		uint64_t hits;        // Reads and writes that found their block cached
+		uint64_t misses;      // Reads and writes that didn't
+		uint64_t evictions;   // Blocks pushed out to make room
+		uint64_t writebacks;  // Dirty blocks written back to the file
+	} block_store_cache_stats_t;
+
+	///
+	/// Reports how a cached device's cache has been doing since it was opened
+	/// \param bs BS device
+	/// \param stats Receives the counts
+	/// \return true on success, false on error or if the device isn't cached
+	///
+	bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+	///
+	/// Flushes changes to a file-backed BS device out to its file
+	/// \param bs BS device
+	/// \return true once everything is on disk, false on error or if the device isn't file-backed
+	///
+	bool block_store_sync(const block_store_t *const bs);
+
 	///
 	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
 	/// \param bs BS device
@@ -113,6 +416,140 @@ extern "C"
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Writes only the blocks that changed since the image was last written or read
+	///  into an existing image of the same geometry, one write per run of changed blocks
+	/// \param bs BS device
+	/// \param filename The image to update, it must already exist and be the full size of the device
+	/// \return Number of bytes written (0 if nothing changed), SIZE_MAX on error
+	///
+	size_t block_store_serialize_incremental(const block_store_t *const bs, const char *const filename);
+
+	///
+	/// Writes only the allocated blocks of the BS device to file, overwriting it if it exists
+	///  The file is still a full image of the device, but free blocks are left as holes,
+	///  so the write (and, on most file systems, the space taken) scales with the blocks in use
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_serialize_sparse(const block_store_t *const bs, const char *const filename);
+
+	// What a device's write-ahead log has done since it was enabled
+	typedef struct block_store_wal_stats {
+		uint64_t records;  // Writes and allocation changes logged
+		uint64_t bytes;    // Bytes logged, record headers included
+		uint64_t commits;  // Calls to block_store_commit
+		uint64_t syncs;    // fsyncs those commits took, fewer than commits when they got grouped
+	} block_store_wal_stats_t;
+
+	///
+	/// Starts logging every write and allocation change to "<filename>.wal", on top of a fresh image in filename
+	///  Deserializing the image replays whatever made it into the log, writes it into the image and removes the log,
+	///  serializing to it again trims the log
+	///  Writes through pinned pointers aren't logged
+	///  Must be called before the device is shared between threads
+	/// \param bs BS device
+	/// \param filename The image, it's (re)written here
+	/// \return true on success, false on error or if the device already has a log
+	///
+	bool block_store_enable_wal(block_store_t *const bs, const char *const filename);
+
+	///
+	/// Makes everything logged so far durable
+	///  Concurrent commits are grouped, one fsync covers everyone who was waiting for it
+	/// \param bs BS device
+	/// \return true once it's all on disk, false on error or if the device has no log
+	///
+	bool block_store_commit(block_store_t *const bs);
+
+	///
+	/// Reports what the device's log has done since it was enabled
+	/// \param bs BS device
+	/// \param stats Receives the counts
+	/// \return true on success, false on error or if the device has no log
+	///
+	bool block_store_get_wal_stats(const block_store_t *const bs, block_store_wal_stats_t *const stats);
+
+	// Operations timed by the stats, each gets its own latency histogram
+	typedef enum {
+		BLOCK_STORE_STAT_ALLOCATE,   // block_store_allocate, _allocate_many and _allocate_extent
+		BLOCK_STORE_STAT_RELEASE,    // block_store_release, _release_many and _release_range
+		BLOCK_STORE_STAT_READ,       // block_store_read and block_store_readv
+		BLOCK_STORE_STAT_WRITE,      // block_store_write and block_store_writev
+		BLOCK_STORE_STAT_SERIALIZE,  // block_store_serialize, _incremental and _sparse
+		BLOCK_STORE_STAT_COUNT
+	} BLOCK_STORE_STAT;
+
+	// What a device has done since its stats were enabled or last reset
+	// Bucket i of a latency histogram counts operations that took 2^i to 2^(i+1) - 1 ns, the last bucket everything slower
+	// Only successful calls are counted and timed, except allocation_failures
+	typedef struct block_store_stats {
+		uint64_t allocations;          // Blocks handed out by block_store_allocate, _allocate_many and _allocate_extent
+		uint64_t allocation_failures;  // Calls that came back with fewer blocks than they asked for
+		uint64_t magazine_hits;        // block_store_allocate calls a magazine served without a search of the bitmap
+		uint64_t scanned_bits;         // Bits in the bitmap words that allocate and allocate_many searches loaded
+		                               //  (extent searches aren't counted)
+		uint64_t releases;             // Blocks freed by block_store_release, _release_many and _release_range
+		uint64_t reads;
+		uint64_t read_bytes;
+		uint64_t writes;
+		uint64_t written_bytes;
+		uint64_t serializes;
+		uint64_t serialized_bytes;
+		uint64_t latency[BLOCK_STORE_STAT_COUNT][BLOCK_STORE_LATENCY_BUCKETS];
+	} block_store_stats_t;
+
+	///
+	/// Starts collecting counters and latency histograms for the device, until then they cost one test per call
+	///  The counters are updated without locks, so threads don't wait on each other to count
+	///  Must be called before the device is shared between threads
+	/// \param bs BS device
+	/// \return true on success, false on error or if stats were already enabled
+	///
+	bool block_store_enable_stats(block_store_t *const bs);
+
+	///
+	/// Copies out the device's stats, each counter is read atomically but they aren't read all at once
+	/// \param bs BS device
+	/// \param stats Receives the stats
+	/// \return true on success, false on error or if stats aren't enabled
+	///
+	bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+	///
+	/// Zeroes the device's stats, they keep being collected
+	/// \param bs BS device
+	///
+	void block_store_reset_stats(block_store_t *const bs);
+
+	///
+	/// Starts writing the entirety of the BS device to file in the background, overwriting it if it exists
+	///  The image is of the device as it was when this was called: it works from a snapshot, so
+	///  the device stays fully usable (writes included) while the checkpoint runs
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Pointer to the running checkpoint, NULL on error
+	///
+	block_store_checkpoint_t *block_store_checkpoint_start(block_store_t *const bs, const char *const filename);
+
+	///
+	/// Reports how far along a background checkpoint is
+	/// \param checkpoint The checkpoint
+	/// \param written Receives the number of bytes of the image done so far (holes left for free blocks count too), may be NULL
+	/// \param total Receives the number of bytes the image will have, may be NULL
+	/// \return true once the checkpoint has finished (see block_store_checkpoint_wait for how it went), false otherwise
+	///
+	bool block_store_checkpoint_progress(const block_store_checkpoint_t *const checkpoint, size_t *const written, size_t *const total);
+
+	///
+	/// Waits for a background checkpoint to finish and frees it
+	///  Every checkpoint has to be waited for, and before its device is destroyed
+	/// \param checkpoint The checkpoint
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_checkpoint_wait(block_store_checkpoint_t *const checkpoint);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,95 @@
+#ifndef BLOCK_STORE_ASYNC_H__
+#define BLOCK_STORE_ASYNC_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include "block_store.h"
+
+	// An asynchronous front end for a BS device, modelled on a submission/completion ring
+	// Ops go in with block_store_async_submit, a pool of workers runs them against the device,
+	//  and their results come back out through block_store_async_poll/block_store_async_wait
+	// Completions come back in whatever order the workers finish, user_data says which op is which
+	typedef struct block_store_async block_store_async_t;
+
+	typedef enum {
+		BLOCK_STORE_OP_READ,      // block_store_read(block_id, buffer)
+		BLOCK_STORE_OP_WRITE,     // block_store_write(block_id, buffer)
+		BLOCK_STORE_OP_ALLOCATE,  // block_store_allocate()
+		BLOCK_STORE_OP_RELEASE    // block_store_release(block_id)
+	} block_store_op_t;
+
+	typedef struct block_store_sqe {
+		block_store_op_t op;
+		size_t block_id;     // Block to read/write/release, ignored by allocate
+		void *buffer;        // A block's worth of bytes to read into/write from, must stay valid until the op completes
+		uint64_t user_data;  // Handed back untouched in the completion
+	} block_store_sqe_t;
+
+	typedef struct block_store_cqe {
+		uint64_t user_data;  // From the submission
+		size_t result;       // Whatever the synchronous call returns, 0 for release
+	} block_store_cqe_t;
+
+	///
+	/// Starts a ring and its workers in front of a BS device
+	/// \param bs BS device, it has to outlive the ring
+	/// \param queue_depth Most ops that can be in flight (submitted but not yet reaped) at once
+	/// \param workers Number of worker threads
+	/// \return Pointer to a new ring, NULL on error
+	///
+	block_store_async_t *block_store_async_create(block_store_t *const bs, const size_t queue_depth, const size_t workers);
+
+	///
+	/// Waits for every submitted op to finish, then stops the workers and frees the ring
+	///  Completions that were never reaped are dropped
+	/// \param ring The ring
+	///
+	void block_store_async_destroy(block_store_async_t *const ring);
+
+	///
+	/// Queues a batch of ops, as many as there's room for
+	/// \param ring The ring
+	/// \param sqes The ops to run
+	/// \param count Number of entries in sqes
+	/// \return Number of ops queued, 0 on error
+	///  Queuing stops when the ring is full (submit the rest once some completions are reaped)
+	///  or at the first entry that isn't a known op
+	///
+	size_t block_store_async_submit(block_store_async_t *const ring, const block_store_sqe_t *const sqes, const size_t count);
+
+	///
+	/// Reaps whatever completions are ready, without waiting
+	/// \param ring The ring
+	/// \param cqes Array to receive the completions
+	/// \param max Number of entries cqes can hold
+	/// \return Number of completions reaped, 0 on error
+	///
+	size_t block_store_async_poll(block_store_async_t *const ring, block_store_cqe_t *const cqes, const size_t max);
+
+	///
+	/// Reaps completions, waiting until at least min of them are ready
+	///  (or everything in flight, if that's fewer)
+	/// \param ring The ring
+	/// \param cqes Array to receive the completions
+	/// \param max Number of entries cqes can hold
+	/// \param min Number of completions to wait for
+	/// \return Number of completions reaped, 0 on error
+	///
+	size_t block_store_async_wait(block_store_async_t *const ring, block_store_cqe_t *const cqes, const size_t max, const size_t min);
+
+	///
+	/// Number of ops submitted but not yet reaped
+	/// \param ring The ring
+	/// \return Ops in flight, SIZE_MAX on error
+	///
+	size_t block_store_async_in_flight(const block_store_async_t *const ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
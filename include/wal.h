@@ -0,0 +1,114 @@
+#ifndef WAL_H__
+#define WAL_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// An append-only log of typed records with group commit
+// Records are buffered as they're appended, and wal_commit makes them durable: the first committer
+// in writes out everything buffered so far with a single fsync, and everyone who arrives while
+// that's happening waits for it (or the next one) instead of doing their own
+// Positions in the log (LSNs) count record bytes from when the log was created, and never go back
+typedef struct wal wal_t;
+
+///
+/// Called for every intact record by wal_replay, in the order they were appended
+/// \param context Whatever was passed to wal_replay
+/// \param type, arg0, arg1 As passed to wal_append
+/// \param payload The record's payload, only good until the callback returns
+/// \param size Size of the payload
+///
+typedef void (*wal_replay_fn)(void *context, const uint32_t type, const uint64_t arg0, const uint64_t arg1, const void *payload, const size_t size);
+
+///
+/// Creates a new, empty log, overwriting the file if it exists
+/// \param filename The log file
+/// \param header Bytes stored at the front of the log, wal_replay only replays logs with the same header
+/// \param header_size Size of the header
+/// \return Pointer to the new log, NULL on error
+///
+wal_t *wal_create(const char *const filename, const void *const header, const size_t header_size);
+
+///
+/// Writes out anything still buffered (without syncing it) and closes the log
+/// \param wal The log
+///
+void wal_destroy(wal_t *const wal);
+
+///
+/// Appends a record to the log's buffer, it's durable once a commit covers its LSN
+/// \param wal The log
+/// \param type, arg0, arg1 Whatever the caller wants to know about the record at replay
+/// \param payload The record's data, may be NULL if size is 0
+/// \param size Size of the payload
+/// \return The LSN just past the record, 0 on error
+///
+uint64_t wal_append(wal_t *const wal, const uint32_t type, const uint64_t arg0, const uint64_t arg1, const void *const payload, const size_t size);
+
+///
+/// Makes every record up to the given LSN durable
+/// \param wal The log
+/// \param lsn The LSN to commit up to, or 0 for everything appended so far
+/// \return true once it's all on disk, false on error
+///
+bool wal_commit(wal_t *const wal, const uint64_t lsn);
+
+///
+/// LSN just past the last record appended
+/// \param wal The log
+/// \return The LSN, 0 on error
+///
+uint64_t wal_position(const wal_t *const wal);
+
+///
+/// Drops every record before the given LSN, once whatever they describe is safely stored elsewhere
+///  The records after it are kept, and the log is synced before this returns
+///  The kept records go into a new file that replaces the log with a rename, so a crash part way
+///  through leaves either the old log or the new one, never a torn mix of the two
+/// \param wal The log
+/// \param lsn The first LSN to keep
+/// \return true on success, false on error
+///
+bool wal_truncate(wal_t *const wal, const uint64_t lsn);
+
+///
+/// Syncs the directory a file is in, so the file's creation (or a rename onto it) survives a crash
+/// \param filename The file
+/// \return true on success, false on error
+///
+bool wal_sync_directory(const char *const filename);
+
+///
+/// Counts of what the log has done since it was created
+/// \param wal The log
+/// \param records Receives the number of records appended
+/// \param bytes Receives the number of bytes appended, record headers included
+/// \param commits Receives the number of wal_commit calls
+/// \param syncs Receives the number of fsyncs the commits actually took
+/// \return true on success, false on error
+///
+bool wal_stats(const wal_t *const wal, uint64_t *const records, uint64_t *const bytes, uint64_t *const commits, uint64_t *const syncs);
+
+///
+/// Feeds every intact record of a log file to a callback, stopping at the first torn or corrupt one
+///  (that's where a crash cut the log off)
+/// \param filename The log file
+/// \param header The header the log has to start with
+/// \param header_size Size of the header
+/// \param callback Called for each record
+/// \param context Passed through to the callback
+/// \return Number of records replayed, SIZE_MAX if there's no log or it has a different header
+///
+size_t wal_replay(const char *const filename, const void *const header, const size_t header_size, wal_replay_fn callback, void *const context);
+
+#ifdef __cplusplus
+	}
+#endif
+
+#endif
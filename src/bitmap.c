@@ -1,16 +1,32 @@
 #include "bitmap.h"
 #include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITMAP_POPCOUNT_X86
+#endif
 
 // Just the one for now. Indicates we're an overlay and should not free
 // (also, make sure that ALL is as wide as ll of the flags)
 typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
 
+// Each summary level has one bit per word of the level below it, 64^11 covers any size_t bit count
+#define SUMMARY_MAX_LEVELS 11
+
+// Which summary tree: words that still have a clear bit, or words that have a set bit
+typedef enum { SUMMARY_ZERO = 0, SUMMARY_SET = 1, SUMMARY_TREES = 2 } SUMMARY_TREE;
+
 struct bitmap 
 {
 	unsigned leftover_bits;  // Packing will increase this to an int anyway
 	BITMAP_FLAGS flags;	  // Generic place to store flags. Not enough flags to worry about width yet.
 	uint8_t *data;
 	size_t bit_count, byte_count;
+	// Optional out-of-band summary (see bitmap_summarize), never part of the exported data
+	// summary[tree][0] has a bit per data word, summary[tree][n] has a bit per word of level n - 1
+	uint64_t *summary[SUMMARY_TREES][SUMMARY_MAX_LEVELS];
+	uint64_t *summary_storage;  // Both trees share this one allocation
+	size_t summary_words[SUMMARY_MAX_LEVELS];
+	size_t summary_levels;  // 0 when there's no summary
 };
 
 #define FLAG_CHECK(bitmap, flag) ((bitmap)->flags & flag)
@@ -46,6 +62,82 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 #undef B2
 // There is an alternative for getting bit count that only loops as many times as there are bits set
 // but that's still a loop and this table is 256B.
+
+// Counts the bits set in whole bytes, bitmap_total_set picks the fastest of these the CPU has the first time it's called
+typedef size_t (*bitmap_popcount_fn)(const uint8_t *const data, const size_t bytes);
+
+// Eight bytes at a time with the popcount builtin, what that turns into depends on the target of the function it's
+// inlined into, which is why it's always inlined
+static inline __attribute__((always_inline)) size_t bitmap_popcount_words(const uint8_t *const data, const size_t bytes)
+{
+	size_t total = 0;
+	size_t idx = 0;
+	for (; idx + sizeof(uint64_t) <= bytes; idx += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + idx, sizeof(word));
+		total += __builtin_popcountll(word);
+	}
+	for (; idx < bytes; ++idx)
+	{
+		total += bit_totals[data[idx]];
+	}
+	return total;
+}
+
+// Whatever the compiler makes of popcount without being told about the CPU
+static size_t bitmap_popcount_generic(const uint8_t *const data, const size_t bytes)
+{
+	return bitmap_popcount_words(data, bytes);
+}
+
+#ifdef BITMAP_POPCOUNT_X86
+// Same again, but the builtin turns into the popcnt instruction
+__attribute__((target("popcnt"))) static size_t bitmap_popcount_popcnt(const uint8_t *const data, const size_t bytes)
+{
+	return bitmap_popcount_words(data, bytes);
+}
+
+// 32 bytes at a time: look up each nibble's count with a shuffle, then sum the byte counts with sad
+// http://0x80.pl/articles/sse-popcount.html
+__attribute__((target("avx2"))) static size_t bitmap_popcount_avx2(const uint8_t *const data, const size_t bytes)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0F);
+	__m256i sums = _mm256_setzero_si256();
+	size_t idx = 0;
+	for (; idx + sizeof(__m256i) <= bytes; idx += sizeof(__m256i))
+	{
+		const __m256i v = _mm256_loadu_si256((const __m256i*)(data + idx));
+		const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+		                                       _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+	size_t total = (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1)
+	             + (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+	return total + bitmap_popcount_popcnt(data + idx, bytes - idx);
+}
+#endif
+
+static bitmap_popcount_fn bitmap_popcount_pick(void)
+{
+#ifdef BITMAP_POPCOUNT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return bitmap_popcount_avx2;
+	}
+	if (__builtin_cpu_supports("popcnt"))
+	{
+		return bitmap_popcount_popcnt;
+	}
+#endif
+	return bitmap_popcount_generic;
+}
+
+// Picked on first use, every thread that races to pick it picks the same one
+static bitmap_popcount_fn bitmap_popcount = NULL;
 /*
    unsigned int v; // count the number of bits set in v
    unsigned int c; // c accumulates the total bits set in v
@@ -59,24 +151,371 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// The scans work on 64 bit words instead of bytes so they can skip 64 bits with one compare
+// and find the bit inside a word with count-trailing-zeros instead of a loop
+// The storage is still a byte array (it has to match the image on disk), so words are
+// assembled from it such that bit n of the bitmap is bit (n & 63) of word (n >> 6)
+#define WORD_BITS 64
+#define WORD_SHIFT 6
+#define WORD_INDEX_MASK 0x3F
+
+// Words needed to cover every bit, the last one may only be partially in use
+static inline size_t bitmap_word_count(const bitmap_t *const bitmap)
+{
+	return (bitmap->bit_count + WORD_BITS - 1) >> WORD_SHIFT;
+}
+
+// Byte order of a word in memory vs in a register, bit n has to be bit (n & 63) either way
+static inline uint64_t bitmap_word_order(const uint64_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap64(value);
+#else
+	return value;
+#endif
+}
+
+// Whether a word can be handled with a single 64 bit access
+// Overlays can sit anywhere and the byte count isn't a multiple of 8, so the rest go byte by byte
+// (the bytes past the end belong to someone else, even touching them atomically could lose their writes)
+static inline bool bitmap_word_whole(const bitmap_t *const bitmap, const size_t word)
+{
+	const size_t offset = word << 3;
+	return ((uintptr_t)(bitmap->data + offset) & 0x07) == 0 && offset + sizeof(uint64_t) <= bitmap->byte_count;
+}
+
+// Loads one word of the bitmap
+// Loads are atomic (but relaxed, so just plain loads on anything we care about)
+// because other threads may be claiming and releasing bits while we look
+static inline uint64_t bitmap_load_word(const bitmap_t *const bitmap, const size_t word)
+{
+	const size_t offset = word << 3;
+	if (bitmap_word_whole(bitmap, word))
+	{
+		return bitmap_word_order(__atomic_load_n((const uint64_t *) (bitmap->data + offset), __ATOMIC_RELAXED));
+	}
+	uint64_t value = 0;
+	for (size_t byte = 0; byte < 8 && offset + byte < bitmap->byte_count; ++byte)
+	{
+		value |= (uint64_t) __atomic_load_n(bitmap->data + offset + byte, __ATOMIC_RELAXED) << (byte << 3);
+	}
+	return value;
+}
+
+// Atomically sets whichever bits of want are still clear in the word
+// Returns the bits this call set, anything missing was set by someone else first
+static uint64_t bitmap_word_claim(bitmap_t *const bitmap, const size_t word, const uint64_t want)
+{
+	uint8_t *const data = bitmap->data + (word << 3);
+	if (bitmap_word_whole(bitmap, word))
+	{
+		uint64_t *const target = (uint64_t *) data;
+		uint64_t expected = __atomic_load_n(target, __ATOMIC_RELAXED);
+		uint64_t claimed;
+		do
+		{
+			claimed = want & ~bitmap_word_order(expected);
+			if (!claimed)
+			{
+				return 0;
+			}
+		} while (!__atomic_compare_exchange_n(target, &expected, expected | bitmap_word_order(claimed), true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		return claimed;
+	}
+	uint64_t claimed = 0;
+	for (size_t byte = 0; byte < 8; ++byte)
+	{
+		const uint8_t bits = (uint8_t) (want >> (byte << 3));
+		if (!bits)
+		{
+			continue;
+		}
+		uint8_t expected = __atomic_load_n(data + byte, __ATOMIC_RELAXED);
+		uint8_t got;
+		do
+		{
+			got = bits & ~expected;
+		} while (got && !__atomic_compare_exchange_n(data + byte, &expected, expected | got, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		claimed |= (uint64_t) got << (byte << 3);
+	}
+	return claimed;
+}
+
+// Atomically clears the given bits of the word, returns the ones that were actually set
+static uint64_t bitmap_word_release(bitmap_t *const bitmap, const size_t word, const uint64_t bits)
+{
+	uint8_t *const data = bitmap->data + (word << 3);
+	if (bitmap_word_whole(bitmap, word))
+	{
+		return bits & bitmap_word_order(__atomic_fetch_and((uint64_t *) data, ~bitmap_word_order(bits), __ATOMIC_SEQ_CST));
+	}
+	uint64_t released = 0;
+	for (size_t byte = 0; byte < 8; ++byte)
+	{
+		const uint8_t clear = (uint8_t) (bits >> (byte << 3));
+		if (clear)
+		{
+			released |= (uint64_t) (__atomic_fetch_and(data + byte, (uint8_t) ~clear, __ATOMIC_SEQ_CST) & clear) << (byte << 3);
+		}
+	}
+	return released;
+}
+
+// Atomically sets bits in a word, returns the ones that were clear before
+// Unlike bitmap_word_claim there's nothing to back out of, so no need to compare and swap
+static uint64_t bitmap_word_set(bitmap_t *const bitmap, const size_t word, const uint64_t bits)
+{
+	uint8_t *const data = bitmap->data + (word << 3);
+	if (bitmap_word_whole(bitmap, word))
+	{
+		return bits & ~bitmap_word_order(__atomic_fetch_or((uint64_t *) data, bitmap_word_order(bits), __ATOMIC_SEQ_CST));
+	}
+	uint64_t set = 0;
+	for (size_t byte = 0; byte < 8; ++byte)
+	{
+		const uint8_t add = (uint8_t) (bits >> (byte << 3));
+		if (add)
+		{
+			set |= (uint64_t) (add & ~__atomic_fetch_or(data + byte, add, __ATOMIC_SEQ_CST)) << (byte << 3);
+		}
+	}
+	return set;
+}
+
+// Mask of the bits of the given word that are actually part of the bitmap
+static inline uint64_t bitmap_word_mask(const bitmap_t *const bitmap, const size_t word)
+{
+	const size_t tail_bits = bitmap->bit_count & WORD_INDEX_MASK;
+	if (tail_bits && word == bitmap_word_count(bitmap) - 1)
+	{
+		return (UINT64_C(1) << tail_bits) - 1;
+	}
+	return UINT64_MAX;
+}
+
+// Mask of count bits starting at bit first of a word
+static inline uint64_t bitmap_range_mask(const size_t first, const size_t count)
+{
+	return (count == WORD_BITS ? UINT64_MAX : (UINT64_C(1) << count) - 1) << first;
+}
+
+// The summary trees let a scan jump straight to the next interesting word instead of
+// walking every word in between, which is what makes ffz cheap on a nearly full bitmap
+// A summary bit is set when the word it covers has something to find, so each level
+// is the "has anything" map of the level below it and the top level is a single word
+//
+// Bits may be claimed and released from several threads at once, so the trees are only
+// ever updated with atomics, and are allowed to be briefly wrong in one direction:
+// a set bit over nothing just costs a search a wasted look, but a clear bit over
+// something would hide it for good, so whoever clears a bit checks afterwards that
+// nothing showed up underneath it in the meantime and puts it back if it did
+
+// Whether the tree should have the bit for the given data word set
+static inline bool summary_wanted(const bitmap_t *const bitmap, const SUMMARY_TREE tree, const size_t word)
+{
+	const uint64_t valid = bitmap_word_mask(bitmap, word);
+	const uint64_t value = bitmap_load_word(bitmap, word) & valid;
+	return tree == SUMMARY_ZERO ? value != valid : value != 0;
+}
+
+// Sets bit idx of the given level, and up the tree as long as the parent was empty
+static void summary_mark(bitmap_t *const bitmap, const SUMMARY_TREE tree, size_t level, size_t idx)
+{
+	for (; level < bitmap->summary_levels; ++level, idx >>= WORD_SHIFT)
+	{
+		uint64_t *word = bitmap->summary[tree][level] + (idx >> WORD_SHIFT);
+		if (__atomic_fetch_or(word, UINT64_C(1) << (idx & WORD_INDEX_MASK), __ATOMIC_SEQ_CST))
+		{
+			return;  // parent already knows this word has something
+		}
+	}
+}
+
+// Clears the bit for the given data word, and up the tree as long as that empties the word
+static void summary_clear(bitmap_t *const bitmap, const SUMMARY_TREE tree, const size_t data_word)
+{
+	size_t idx = data_word;
+	for (size_t level = 0; level < bitmap->summary_levels; ++level, idx >>= WORD_SHIFT)
+	{
+		uint64_t *word = bitmap->summary[tree][level] + (idx >> WORD_SHIFT);
+		const uint64_t left = __atomic_and_fetch(word, ~(UINT64_C(1) << (idx & WORD_INDEX_MASK)), __ATOMIC_SEQ_CST);
+		// Did whatever this bit covers fill back in before our clear landed?
+		const bool refilled = level == 0 ? summary_wanted(bitmap, tree, data_word)
+							  : __atomic_load_n(bitmap->summary[tree][level - 1] + idx, __ATOMIC_SEQ_CST) != 0;
+		if (refilled)
+		{
+			summary_mark(bitmap, tree, level, idx);
+			return;
+		}
+		if (left)
+		{
+			return;  // still something left below, parent stays set
+		}
+	}
+}
+
+// Brings both trees up to date after data word changed
+static inline void summary_update(bitmap_t *const bitmap, const size_t word)
+{
+	const uint64_t bit = UINT64_C(1) << (word & WORD_INDEX_MASK);
+	for (int tree = 0; tree < SUMMARY_TREES; ++tree)
+	{
+		const bool wanted = summary_wanted(bitmap, (SUMMARY_TREE) tree, word);
+		const bool marked = (__atomic_load_n(bitmap->summary[tree][0] + (word >> WORD_SHIFT), __ATOMIC_SEQ_CST) & bit) != 0;
+		if (wanted && !marked)
+		{
+			summary_mark(bitmap, (SUMMARY_TREE) tree, 0, word);
+		}
+		else if (!wanted && marked)
+		{
+			summary_clear(bitmap, (SUMMARY_TREE) tree, word);
+		}
+	}
+}
+
+// Finds the first data word at or after the given one that has its bit set in the tree
+// Climbs until some level has a set bit past our position, then follows the lowest set bits down
+static size_t summary_find(const bitmap_t *const bitmap, const SUMMARY_TREE tree, size_t idx)
+{
+	for (;;)
+	{
+		size_t level = 0;
+		for (;;)
+		{
+			const size_t word = idx >> WORD_SHIFT;
+			if (word >= bitmap->summary_words[level])
+			{
+				return SIZE_MAX;
+			}
+			const uint64_t value = __atomic_load_n(bitmap->summary[tree][level] + word, __ATOMIC_RELAXED) & (UINT64_MAX << (idx & WORD_INDEX_MASK));
+			if (value)
+			{
+				idx = (word << WORD_SHIFT) + __builtin_ctzll(value);
+				break;
+			}
+			// nothing left in this word, carry on from the next one, which is the next bit one level up
+			idx = word + 1;
+			if (++level == bitmap->summary_levels)
+			{
+				return SIZE_MAX;
+			}
+		}
+		while (level--)
+		{
+			const uint64_t value = __atomic_load_n(bitmap->summary[tree][level] + idx, __ATOMIC_RELAXED);
+			if (!value)
+			{
+				break;  // emptied out from under us, everything this bit covered is gone
+			}
+			idx = (idx << WORD_SHIFT) + __builtin_ctzll(value);
+		}
+		if (level == SIZE_MAX)
+		{
+			return idx;
+		}
+		// start over from the first data word past the empty one
+		idx = (idx + 1) << (WORD_SHIFT * (level + 1));
+	}
+}
+
+// Finds the first bit in [from, end) that is set (or clear, if find_set is false), end is at most bit_count
+// Returns SIZE_MAX if there isn't one, without loading any data word past the one holding end - 1
+// Adds the number of data words it loaded to loaded, unless that's NULL
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t from, const size_t end, const bool find_set, size_t *const loaded)
+{
+	if (from >= end)
+	{
+		return SIZE_MAX;
+	}
+	// Flip the word when looking for zeros so we're always looking for ones
+	const uint64_t flip = find_set ? 0 : UINT64_MAX;
+	const size_t words = (end + WORD_BITS - 1) >> WORD_SHIFT;
+	size_t word = from >> WORD_SHIFT;
+	size_t found = SIZE_MAX;
+	size_t seen = 1;
+	// Ignore everything before from in the first word
+	uint64_t value = (bitmap_load_word(bitmap, word) ^ flip) & (UINT64_MAX << (from & WORD_INDEX_MASK));
+	for (;;)
+	{
+		value &= bitmap_word_mask(bitmap, word);
+		if (value)
+		{
+			const size_t bit = (word << WORD_SHIFT) + __builtin_ctzll(value);
+			found = bit < end ? bit : SIZE_MAX;
+			break;
+		}
+		if (bitmap->summary_levels)
+		{
+			word = summary_find(bitmap, find_set ? SUMMARY_SET : SUMMARY_ZERO, word + 1);
+			if (word >= words)
+			{
+				break;
+			}
+		}
+		else if (++word == words)
+		{
+			break;
+		}
+		value = bitmap_load_word(bitmap, word) ^ flip;
+		++seen;
+	}
+	if (loaded)
+	{
+		*loaded += seen;
+	}
+	return found;
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
 	bitmap->data[bit >> 3] |= mask[bit & 0x07];
+	if (bitmap->summary_levels)
+	{
+		summary_update(bitmap, bit >> WORD_SHIFT);
+	}
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
 	bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+	if (bitmap->summary_levels)
+	{
+		summary_update(bitmap, bit >> WORD_SHIFT);
+	}
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
-	return bitmap->data[bit >> 3] & mask[bit & 0x07];
+	return __atomic_load_n(bitmap->data + (bit >> 3), __ATOMIC_RELAXED) & mask[bit & 0x07];
+}
+
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) 
+{
+	const bool was_set = __atomic_fetch_or(bitmap->data + (bit >> 3), mask[bit & 0x07], __ATOMIC_SEQ_CST) & mask[bit & 0x07];
+	if (!was_set && bitmap->summary_levels)
+	{
+		summary_update(bitmap, bit >> WORD_SHIFT);
+	}
+	return was_set;
+}
+
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) 
+{
+	const bool was_set = __atomic_fetch_and(bitmap->data + (bit >> 3), invert_mask[bit & 0x07], __ATOMIC_SEQ_CST) & mask[bit & 0x07];
+	if (was_set && bitmap->summary_levels)
+	{
+		summary_update(bitmap, bit >> WORD_SHIFT);
+	}
+	return was_set;
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
 {
 	bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+	if (bitmap->summary_levels)
+	{
+		summary_update(bitmap, bit >> WORD_SHIFT);
+	}
 }
 
 void bitmap_invert(bitmap_t *const bitmap) 
@@ -85,17 +524,20 @@ void bitmap_invert(bitmap_t *const bitmap)
 	{
 		bitmap->data[byte] = ~bitmap->data[byte];
 	}
+	// Words with a zero now have a one and vice versa, so the trees just trade places
+	for (size_t level = 0; level < bitmap->summary_levels; ++level)
+	{
+		uint64_t *temp = bitmap->summary[SUMMARY_ZERO][level];
+		bitmap->summary[SUMMARY_ZERO][level] = bitmap->summary[SUMMARY_SET][level];
+		bitmap->summary[SUMMARY_SET][level] = temp;
+	}
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) 
 {
 	if (bitmap) 
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
-		{
-		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
+		return bitmap_scan(bitmap, 0, bitmap->bit_count, true, NULL);
 	}
 	return SIZE_MAX;
 }
@@ -104,15 +546,290 @@ size_t bitmap_ffz(const bitmap_t *const bitmap)
 {
 	if (bitmap) 
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+		return bitmap_scan(bitmap, 0, bitmap->bit_count, false, NULL);
+	}
+	return SIZE_MAX;
+}
+
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from) 
+{
+	if (bitmap) 
+	{
+		return bitmap_scan(bitmap, from, bitmap->bit_count, true, NULL);
+	}
+	return SIZE_MAX;
+}
+
+size_t bitmap_next_clear(const bitmap_t *const bitmap, const size_t from) 
+{
+	if (bitmap) 
+	{
+		return bitmap_scan(bitmap, from, bitmap->bit_count, false, NULL);
+	}
+	return SIZE_MAX;
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t from, const size_t count) 
+{
+	if (bitmap && count) 
+	{
+		size_t start = from;
+		for (;;) 
 		{
+			// Jump to the next clear bit, then to the set bit that ends its run
+			start = bitmap_scan(bitmap, start, bitmap->bit_count, false, NULL);
+			if (start == SIZE_MAX || count > bitmap->bit_count - start) 
+			{
+				return SIZE_MAX;
+			}
+			size_t end = bitmap_scan(bitmap, start, bitmap->bit_count, true, NULL);
+			if (end == SIZE_MAX) 
+			{
+				end = bitmap->bit_count;
+			}
+			if (end - start >= count) 
+			{
+				return start;
+			}
+			start = end;
 		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
 	}
 	return SIZE_MAX;
 }
 
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t count, size_t *const bits) 
+{
+	return bitmap ? bitmap_claim_zeros_range(bitmap, 0, bitmap->bit_count, count, bits, NULL) : 0;
+}
+
+size_t bitmap_claim_zeros_range(bitmap_t *const bitmap, const size_t start, const size_t length, const size_t count, size_t *const bits, size_t *const scanned) 
+{
+	size_t found = 0;
+	size_t loaded = 0;
+	if (bitmap && bits && start < bitmap->bit_count) 
+	{
+		const size_t end = length < bitmap->bit_count - start ? start + length : bitmap->bit_count;
+		size_t from = start;
+		while (found < count) 
+		{
+			// Let the scan find the next word with room in it, then take everything we can from it
+			// It stops at end, so a claim limited to a range never reads the words past it
+			from = bitmap_scan(bitmap, from, end, false, &loaded);
+			if (from >= end) 
+			{
+				break;
+			}
+			const size_t word = from >> WORD_SHIFT;
+			uint64_t zeros = ~bitmap_load_word(bitmap, word) & bitmap_word_mask(bitmap, word) & (UINT64_MAX << (from & WORD_INDEX_MASK));
+			if (end < (word + 1) << WORD_SHIFT) 
+			{
+				zeros &= (UINT64_C(1) << (end & WORD_INDEX_MASK)) - 1;
+			}
+			uint64_t want = 0;
+			for (size_t needed = count - found; zeros && needed; --needed) 
+			{
+				const uint64_t lowest = zeros & -zeros;
+				want |= lowest;
+				zeros ^= lowest;
+			}
+			uint64_t claimed = bitmap_word_claim(bitmap, word, want);
+			if (claimed && bitmap->summary_levels) 
+			{
+				summary_update(bitmap, word);
+			}
+			// If another thread beat us to some of them, this word gets another look
+			if (claimed == want) 
+			{
+				from = (word + 1) << WORD_SHIFT;
+			}
+			for (; claimed; claimed &= claimed - 1) 
+			{
+				bits[found++] = (word << WORD_SHIFT) + __builtin_ctzll(claimed);
+			}
+		}
+	}
+	if (scanned) 
+	{
+		*scanned = loaded * WORD_BITS;
+	}
+	return found;
+}
+
+size_t bitmap_reset_many(bitmap_t *const bitmap, const size_t *const bits, const size_t count, size_t *const cleared) 
+{
+	size_t released = 0;
+	if (bitmap && bits) 
+	{
+		// Gather up bits for the same word and clear them all with one atomic
+		size_t word = SIZE_MAX;
+		uint64_t clear = 0;
+		for (size_t idx = 0; idx <= count; ++idx) 
+		{
+			const bool done = idx == count;
+			if (!done && bits[idx] >= bitmap->bit_count) 
+			{
+				continue;
+			}
+			if (done || (bits[idx] >> WORD_SHIFT) != word) 
+			{
+				if (clear) 
+				{
+					uint64_t got = bitmap_word_release(bitmap, word, clear);
+					if (got && bitmap->summary_levels) 
+					{
+						summary_update(bitmap, word);
+					}
+					for (; got; got &= got - 1) 
+					{
+						if (cleared) 
+						{
+							cleared[released] = (word << WORD_SHIFT) + __builtin_ctzll(got);
+						}
+						++released;
+					}
+				}
+				if (done) 
+				{
+					break;
+				}
+				word = bits[idx] >> WORD_SHIFT;
+				clear = 0;
+			}
+			clear |= UINT64_C(1) << (bits[idx] & WORD_INDEX_MASK);
+		}
+	}
+	return released;
+}
+
+// Releases every bit of [start, end) a word at a time, used to undo a partial claim_range
+static size_t bitmap_release_span(bitmap_t *const bitmap, const size_t start, const size_t end)
+{
+	size_t released = 0;
+	for (size_t bit = start; bit < end;) 
+	{
+		const size_t word = bit >> WORD_SHIFT;
+		const size_t stop = ((word + 1) << WORD_SHIFT) < end ? (word + 1) << WORD_SHIFT : end;
+		const uint64_t cleared = bitmap_word_release(bitmap, word, bitmap_range_mask(bit & WORD_INDEX_MASK, stop - bit));
+		if (cleared && bitmap->summary_levels) 
+		{
+			summary_update(bitmap, word);
+		}
+		released += __builtin_popcountll(cleared);
+		bit = stop;
+	}
+	return released;
+}
+
+bool bitmap_claim_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (!bitmap || !count || start >= bitmap->bit_count || count > bitmap->bit_count - start) 
+	{
+		return false;
+	}
+	const size_t end = start + count;
+	for (size_t bit = start; bit < end;) 
+	{
+		const size_t word = bit >> WORD_SHIFT;
+		const size_t stop = ((word + 1) << WORD_SHIFT) < end ? (word + 1) << WORD_SHIFT : end;
+		const uint64_t want = bitmap_range_mask(bit & WORD_INDEX_MASK, stop - bit);
+		const uint64_t claimed = bitmap_word_claim(bitmap, word, want);
+		if (claimed && bitmap->summary_levels) 
+		{
+			summary_update(bitmap, word);
+		}
+		if (claimed != want) 
+		{
+			// Someone else has part of it, hand back everything we took
+			if (bitmap_word_release(bitmap, word, claimed) && bitmap->summary_levels) 
+			{
+				summary_update(bitmap, word);
+			}
+			bitmap_release_span(bitmap, start, bit);
+			return false;
+		}
+		bit = stop;
+	}
+	return true;
+}
+
+// Whether start and count describe a non-empty range inside the bitmap
+static inline bool bitmap_range_valid(const bitmap_t *const bitmap, const size_t start, const size_t count)
+{
+	return bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start;
+}
+
+size_t bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (!bitmap_range_valid(bitmap, start, count)) 
+	{
+		return 0;
+	}
+	size_t set = 0;
+	const size_t end = start + count;
+	for (size_t bit = start; bit < end;) 
+	{
+		// head and tail words get masked, everything in between is a whole word at once
+		const size_t word = bit >> WORD_SHIFT;
+		const size_t stop = ((word + 1) << WORD_SHIFT) < end ? (word + 1) << WORD_SHIFT : end;
+		const uint64_t added = bitmap_word_set(bitmap, word, bitmap_range_mask(bit & WORD_INDEX_MASK, stop - bit));
+		if (added && bitmap->summary_levels) 
+		{
+			summary_update(bitmap, word);
+		}
+		set += __builtin_popcountll(added);
+		bit = stop;
+	}
+	return set;
+}
+
+size_t bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (!bitmap_range_valid(bitmap, start, count)) 
+	{
+		return 0;
+	}
+	return bitmap_release_span(bitmap, start, start + count);
+}
+
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (!bitmap_range_valid(bitmap, start, count)) 
+	{
+		return false;
+	}
+	const size_t end = start + count;
+	for (size_t bit = start; bit < end;) 
+	{
+		const size_t word = bit >> WORD_SHIFT;
+		const size_t stop = ((word + 1) << WORD_SHIFT) < end ? (word + 1) << WORD_SHIFT : end;
+		const uint64_t want = bitmap_range_mask(bit & WORD_INDEX_MASK, stop - bit);
+		if ((bitmap_load_word(bitmap, word) & want) != want) 
+		{
+			return false;
+		}
+		bit = stop;
+	}
+	return true;
+}
+
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (!bitmap_range_valid(bitmap, start, count)) 
+	{
+		return 0;
+	}
+	size_t total = 0;
+	const size_t end = start + count;
+	for (size_t bit = start; bit < end;) 
+	{
+		const size_t word = bit >> WORD_SHIFT;
+		const size_t stop = ((word + 1) << WORD_SHIFT) < end ? (word + 1) << WORD_SHIFT : end;
+		total += __builtin_popcountll(bitmap_load_word(bitmap, word) & bitmap_range_mask(bit & WORD_INDEX_MASK, stop - bit));
+		bit = stop;
+	}
+	return total;
+}
+
 size_t bitmap_total_set(const bitmap_t *const bitmap) 
 {
 	size_t total = 0;
@@ -120,10 +837,13 @@ size_t bitmap_total_set(const bitmap_t *const bitmap)
 	{
 		// If we have leftover, stop a byte early because we have to handle it differently.
 		size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-		for (size_t idx = 0; idx < stop; ++idx) 
+		bitmap_popcount_fn popcount = __atomic_load_n(&bitmap_popcount, __ATOMIC_RELAXED);
+		if (popcount == NULL)
 		{
-			total += bit_totals[bitmap->data[idx]];
+			popcount = bitmap_popcount_pick();
+			__atomic_store_n(&bitmap_popcount, popcount, __ATOMIC_RELAXED);
 		}
+		total = popcount(bitmap->data, stop);
 		if (bitmap->leftover_bits) 
 		{
 			// haha, this is readable
@@ -140,12 +860,10 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 {
 	if (bitmap && func) 
 	{
-		for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+		// skips a word (or, with a summary, a whole subtree) of clear bits at a time
+		for (size_t idx = bitmap_scan(bitmap, 0, bitmap->bit_count, true, NULL); idx != SIZE_MAX; idx = bitmap_scan(bitmap, idx + 1, bitmap->bit_count, true, NULL)) 
 		{
-			if (bitmap_test(bitmap, idx)) 
-			{
-				func(idx, arg);
-			}
+			func(idx, arg);
 		}
 	}
 }
@@ -153,6 +871,85 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
 	memset(bitmap->data, pattern, bitmap->byte_count);
+	if (bitmap->summary_levels)
+	{
+		bitmap_summarize(bitmap);
+	}
+}
+
+bool bitmap_summarize(bitmap_t *const bitmap) 
+{
+	if (!bitmap) 
+	{
+		return false;
+	}
+	if (!bitmap->summary_levels) 
+	{
+		// Work out how big each level is, then grab one block for all of them
+		size_t total_words = 0;
+		size_t words = bitmap_word_count(bitmap);
+		size_t levels = 0;
+		do 
+		{
+			words = (words + WORD_BITS - 1) >> WORD_SHIFT;
+			bitmap->summary_words[levels++] = words;
+			total_words += words;
+		} while (words > 1);
+
+		uint64_t *summary = (uint64_t *) malloc(total_words * SUMMARY_TREES * sizeof(uint64_t));
+		if (!summary) 
+		{
+			return false;
+		}
+		bitmap->summary_storage = summary;
+		for (int tree = 0; tree < SUMMARY_TREES; ++tree) 
+		{
+			for (size_t level = 0; level < levels; ++level) 
+			{
+				bitmap->summary[tree][level] = summary;
+				summary += bitmap->summary_words[level];
+			}
+		}
+		bitmap->summary_levels = levels;
+	}
+	for (int tree = 0; tree < SUMMARY_TREES; ++tree) 
+	{
+		for (size_t level = 0; level < bitmap->summary_levels; ++level) 
+		{
+			memset(bitmap->summary[tree][level], 0, bitmap->summary_words[level] * sizeof(uint64_t));
+		}
+	}
+
+	// Bottom level straight from the data, then each level from the one below it
+	const size_t words = bitmap_word_count(bitmap);
+	for (size_t word = 0; word < words; ++word) 
+	{
+		const uint64_t valid = bitmap_word_mask(bitmap, word);
+		const uint64_t value = bitmap_load_word(bitmap, word) & valid;
+		const uint64_t bit = UINT64_C(1) << (word & WORD_INDEX_MASK);
+		if (value != valid) 
+		{
+			bitmap->summary[SUMMARY_ZERO][0][word >> WORD_SHIFT] |= bit;
+		}
+		if (value) 
+		{
+			bitmap->summary[SUMMARY_SET][0][word >> WORD_SHIFT] |= bit;
+		}
+	}
+	for (int tree = 0; tree < SUMMARY_TREES; ++tree) 
+	{
+		for (size_t level = 1; level < bitmap->summary_levels; ++level) 
+		{
+			for (size_t idx = 0; idx < bitmap->summary_words[level - 1]; ++idx) 
+			{
+				if (bitmap->summary[tree][level - 1][idx]) 
+				{
+					bitmap->summary[tree][level][idx >> WORD_SHIFT] |= UINT64_C(1) << (idx & WORD_INDEX_MASK);
+				}
+			}
+		}
+	}
+	return true;
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) 
@@ -221,6 +1018,11 @@ void bitmap_destroy(bitmap_t *bitmap)
 			// don't free memory that isn't ours!
 			free(bitmap->data);
 		}
+		if (bitmap->summary_levels) 
+		{
+			// the summary is always ours though, even for overlays
+			free(bitmap->summary_storage);
+		}
 		free(bitmap);
 	}
 }
@@ -239,6 +1041,7 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 		if (bitmap) 
 		{
 			bitmap->flags		 = flags;
+			bitmap->summary_levels = 0;
 			bitmap->bit_count	 = n_bits;
 			bitmap->byte_count	= n_bits >> 3;
 			bitmap->leftover_bits = n_bits & 0x07;
@@ -0,0 +1,337 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_cache.h"
+
+// Frame flags
+#define FRAME_REFERENCED 1  // Used since the clock hand last went past, so it gets another lap
+#define FRAME_DIRTY 2       // Written since it was read or last written back
+
+// Marks an empty frame, and the end of a hash chain
+#define NO_FRAME SIZE_MAX
+
+struct block_cache {
+	int fd;
+	size_t block_size;
+
+	pthread_mutex_t lock;   // Guards everything below
+
+	size_t frame_count;
+	uint8_t *frames;        // frame_count blocks' worth of bytes
+	size_t *blocks;         // Block held by each frame, NO_FRAME if it's empty
+	uint8_t *flags;
+	size_t hand;            // Next frame the clock looks at
+
+	// Which frame holds a block: chains of frames through next, from the bucket the block hashes to
+	size_t *buckets;
+	size_t bucket_mask;     // Number of buckets - 1, it's a power of 2
+	size_t *next;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writebacks;
+};
+
+static bool block_cache_io(const int fd, uint8_t *data, size_t size, off_t offset, const bool writing)
+{
+	while (size)
+	{
+		ssize_t done = writing ? pwrite(fd, data, size, offset) : pread(fd, data, size, offset);
+		if (done <= 0)
+		{
+			perror(writing ? "Error writing to file" : "Error reading from file");
+			return false;
+		}
+		data += done;
+		size -= done;
+		offset += done;
+	}
+	return true;
+}
+
+static inline size_t *block_cache_bucket(const block_cache_t *const cache, const size_t block)
+{
+	return &cache->buckets[block & cache->bucket_mask];
+}
+
+// Frame holding a block, NO_FRAME if it isn't cached
+static size_t block_cache_find(const block_cache_t *const cache, const size_t block)
+{
+	size_t frame = *block_cache_bucket(cache, block);
+	while (frame != NO_FRAME && cache->blocks[frame] != block)
+	{
+		frame = cache->next[frame];
+	}
+	return frame;
+}
+
+static void block_cache_unlink(block_cache_t *const cache, const size_t frame)
+{
+	size_t *link = block_cache_bucket(cache, cache->blocks[frame]);
+	while (*link != frame)
+	{
+		link = &cache->next[*link];
+	}
+	*link = cache->next[frame];
+	cache->blocks[frame] = NO_FRAME;
+}
+
+static bool block_cache_write_back(block_cache_t *const cache, const size_t frame)
+{
+	if ((cache->flags[frame] & FRAME_DIRTY) == 0)
+	{
+		return true;
+	}
+	if (block_cache_io(cache->fd, cache->frames + frame * cache->block_size, cache->block_size, (off_t)(cache->blocks[frame] * cache->block_size), true) == false)
+	{
+		return false;
+	}
+	cache->flags[frame] &= ~FRAME_DIRTY;
+	cache->writebacks++;
+	return true;
+}
+
+// Empties a frame for block and hands it back, NO_FRAME if the frame it picked couldn't be written back
+static size_t block_cache_claim(block_cache_t *const cache, const size_t block)
+{
+	// CLOCK: go round until a frame turns up that's empty or wasn't used since the last lap
+	size_t frame;
+	for (;;)
+	{
+		frame = cache->hand;
+		cache->hand = (cache->hand + 1) % cache->frame_count;
+		if (cache->blocks[frame] == NO_FRAME || (cache->flags[frame] & FRAME_REFERENCED) == 0)
+		{
+			break;
+		}
+		cache->flags[frame] &= ~FRAME_REFERENCED;
+	}
+
+	if (cache->blocks[frame] != NO_FRAME)
+	{
+		if (block_cache_write_back(cache, frame) == false)
+		{
+			return NO_FRAME;
+		}
+		block_cache_unlink(cache, frame);
+		cache->evictions++;
+	}
+
+	cache->blocks[frame] = block;
+	cache->flags[frame] = 0;
+	size_t *bucket = block_cache_bucket(cache, block);
+	cache->next[frame] = *bucket;
+	*bucket = frame;
+	return frame;
+}
+
+///
+/// Creates a cache in front of an open file, the file stays the caller's to close
+/// \param fd The file, opened for reading and writing
+/// \param block_size Number of bytes per block, block n is at offset n * block_size
+/// \param frames Number of blocks the cache holds at most
+/// \return Pointer to the new cache, NULL on error
+///
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t frames)
+{
+	if (fd < 0 || block_size == 0 || frames == 0 || frames > SIZE_MAX / block_size)
+	{
+		return NULL;
+	}
+
+	block_cache_t *cache = (block_cache_t*)calloc(1, sizeof(block_cache_t));
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+	cache->fd = fd;
+	cache->block_size = block_size;
+	cache->frame_count = frames;
+
+	// about one frame per bucket keeps the chains short
+	size_t buckets = 1;
+	while (buckets < frames)
+	{
+		buckets <<= 1;
+	}
+	cache->bucket_mask = buckets - 1;
+
+	cache->frames = (uint8_t*)malloc(frames * block_size);
+	cache->blocks = (size_t*)malloc(frames * sizeof(size_t));
+	cache->flags = (uint8_t*)calloc(frames, sizeof(uint8_t));
+	cache->next = (size_t*)malloc(frames * sizeof(size_t));
+	cache->buckets = (size_t*)malloc(buckets * sizeof(size_t));
+	if (cache->frames == NULL || cache->blocks == NULL || cache->flags == NULL || cache->next == NULL || cache->buckets == NULL)
+	{
+		free(cache->frames);
+		free(cache->blocks);
+		free(cache->flags);
+		free(cache->next);
+		free(cache->buckets);
+		free(cache);
+		return NULL;
+	}
+	for (size_t i = 0; i < frames; i++)
+	{
+		cache->blocks[i] = NO_FRAME;
+	}
+	for (size_t i = 0; i < buckets; i++)
+	{
+		cache->buckets[i] = NO_FRAME;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+///
+/// Writes back any dirty frames (without syncing them) and frees the cache
+/// \param cache The cache
+///
+void block_cache_destroy(block_cache_t *const cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+
+	block_cache_flush(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->frames);
+	free(cache->blocks);
+	free(cache->flags);
+	free(cache->next);
+	free(cache->buckets);
+	free(cache);
+}
+
+///
+/// Reads a block, from its frame if it has one, from the file otherwise
+/// \param cache The cache
+/// \param block The block to read
+/// \param buffer Receives the block's bytes
+/// \return true on success, false on error
+///
+bool block_cache_read(block_cache_t *const cache, const size_t block, void *const buffer)
+{
+	if (cache == NULL || buffer == NULL || block == NO_FRAME)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	size_t frame = block_cache_find(cache, block);
+	if (frame != NO_FRAME)
+	{
+		cache->hits++;
+	}
+	else
+	{
+		cache->misses++;
+		frame = block_cache_claim(cache, block);
+		if (frame == NO_FRAME)
+		{
+			pthread_mutex_unlock(&cache->lock);
+			return false;
+		}
+		if (block_cache_io(cache->fd, cache->frames + frame * cache->block_size, cache->block_size, (off_t)(block * cache->block_size), false) == false)
+		{
+			// nothing valid made it into the frame, so it goes back to being empty
+			block_cache_unlink(cache, frame);
+			pthread_mutex_unlock(&cache->lock);
+			return false;
+		}
+	}
+	cache->flags[frame] |= FRAME_REFERENCED;
+	memcpy(buffer, cache->frames + frame * cache->block_size, cache->block_size);
+	pthread_mutex_unlock(&cache->lock);
+	return true;
+}
+
+///
+/// Writes a whole block into its frame, it only reaches the file once the frame is evicted or flushed
+/// \param cache The cache
+/// \param block The block to write
+/// \param buffer The block's new bytes
+/// \return true on success, false on error
+///
+bool block_cache_write(block_cache_t *const cache, const size_t block, const void *const buffer)
+{
+	if (cache == NULL || buffer == NULL || block == NO_FRAME)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	size_t frame = block_cache_find(cache, block);
+	if (frame != NO_FRAME)
+	{
+		cache->hits++;
+	}
+	else
+	{
+		// the whole block gets overwritten, so there's no need to read it in first
+		cache->misses++;
+		frame = block_cache_claim(cache, block);
+		if (frame == NO_FRAME)
+		{
+			pthread_mutex_unlock(&cache->lock);
+			return false;
+		}
+	}
+	cache->flags[frame] |= FRAME_REFERENCED | FRAME_DIRTY;
+	memcpy(cache->frames + frame * cache->block_size, buffer, cache->block_size);
+	pthread_mutex_unlock(&cache->lock);
+	return true;
+}
+
+///
+/// Writes back every dirty frame, the frames stay cached
+/// \param cache The cache
+/// \return true on success, false on error
+///
+bool block_cache_flush(block_cache_t *const cache)
+{
+	if (cache == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	bool ok = true;
+	for (size_t frame = 0; frame < cache->frame_count; frame++)
+	{
+		if (cache->blocks[frame] != NO_FRAME && block_cache_write_back(cache, frame) == false)
+		{
+			ok = false;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ok;
+}
+
+///
+/// Counts of what the cache has done since it was created
+/// \param cache The cache
+/// \param hits Receives the number of reads and writes that found their block cached
+/// \param misses Receives the number of reads and writes that didn't
+/// \param evictions Receives the number of blocks pushed out to make room
+/// \param writebacks Receives the number of dirty frames written to the file
+/// \return true on success, false on error
+///
+bool block_cache_stats(const block_cache_t *const cache, uint64_t *const hits, uint64_t *const misses, uint64_t *const evictions, uint64_t *const writebacks)
+{
+	if (cache == NULL || hits == NULL || misses == NULL || evictions == NULL || writebacks == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock((pthread_mutex_t*)&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	*evictions = cache->evictions;
+	*writebacks = cache->writebacks;
+	pthread_mutex_unlock((pthread_mutex_t*)&cache->lock);
+	return true;
+}
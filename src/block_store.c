@@ -1,480 +1,3270 @@
-#include <unistd.h>
-#include <stdio.h>
-#include <stdint.h>
-#include <string.h>
-#include <errno.h>
-#include <fcntl.h>
-#include "bitmap.h"
-#include "block_store.h"
-// include more if you need
-
-
-// You might find this handy. I put it around unused parameters, but you should
-// remove it before you submit. Just allows things to compile initially.
-#define UNUSED(x) (void)(x)
-
-struct block_store {
-
-    bitmap_t* bitmap;   // Bitmap to track free/used blocks
-    uint8_t* data;     // Blocks are contiguous, essentially making a block device a giant physical array, this is that array
-
-};
-
-
-/*
-Implementation Guidelines for block_store_create
-
-block_store_create(): This function creates a new block store and returns a pointer to it. 
-It first allocates memory for the block store and initializes it to zeros using the 
-memset (an alternative method to initialize newly-allocated memory to all 0s is to use calloc instead of malloc). 
-Then it sets the bitmap field of the block store to an overlay of a bitmap with size BITMAP_SIZE_BYTES on 
-the blocks starting at index BITMAP_START_BLOCK. (You should define BITMAP_START_BLOCK based on already 
-defined constants.) Finally, it marks the blocks used by the bitmap as allocated using the block_store_request 
-function.
-
-*/
-
-///
-/// This creates a new BS device, ready to go
-/// \return Pointer to a new block storage device, NULL on error
-///
-block_store_t *block_store_create()
-{
-	block_store_t* bs = (block_store_t*)calloc(1, sizeof(block_store_t));
-	if (bs == NULL)
-	{
-		return NULL;
-	}
-
-	bs->data = (uint8_t*)calloc(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
-	if (bs->data == NULL)
-	{
-		free(bs);
-		return NULL;
-	}
-
-	bs->bitmap = bitmap_overlay(BITMAP_SIZE_BITS, bs->data + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
-	if (bs->bitmap == NULL)
-	{
-		free(bs->data);
-		free(bs);
-		return NULL;
-	}
-
-	for (int i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++)
-	{
-		if (block_store_request(bs, i) == false)
-		{
-			bitmap_destroy(bs->bitmap);
-			free(bs->data);
-			free(bs);
-			return NULL;
-		}
-	}
-	return bs;
-}
-
-
-/*
-Implementation Guidelines for block_store_destroy
-
-block_store_destroy(block_store_t *const bs): This function destroys a block store by freeing 
-the memory allocated to it. It first checks if the pointer to the block store is not NULL, and if so, 
-it frees the memory allocated to the bitmap and then to the block store.
-
-*/
-
-
-///
-/// Destroys the provided block storage device
-/// This is an idempotent operation, so there is no return value
-/// \param bs BS device
-///
-void block_store_destroy(block_store_t *const bs)
-{
-	if(bs)
-	{
-		if (bs->bitmap)
-		{
-			bitmap_destroy(bs->bitmap);
-			bs->bitmap = NULL;
-		}
-
-		if(bs->data)
-		{
-			free(bs->data);
-			bs->data = NULL;
-		}
-
-		free(bs);
-	}
-}
-
-
-/*
-
-Implementation Guidelines for block_store_allocate
-
-block_store_allocate(block_store_t *const bs): This function finds the first free block in the 
-block store and marks it as allocated in the bitmap. It returns the index of the allocated block 
-or SIZE_MAX if no free block is available.
-
-*/
-
-///
-/// Searches for a free block, marks it as in use, and returns the block's id
-/// \param bs BS device
-/// \return Allocated block's id, SIZE_MAX on error
-///
-size_t block_store_allocate(block_store_t *const bs)
-{
-	if (bs == NULL || bs->bitmap == NULL)
-	{
-		return SIZE_MAX;
-	}
-
-	size_t ffzAddress = bitmap_ffz(bs->bitmap);
-	
-	if (ffzAddress == SIZE_MAX)
-	{
-		return SIZE_MAX;
-	}
-	
-	bitmap_set(bs->bitmap, ffzAddress);
-
-	return ffzAddress;
-}
-
-
-/*
-
-Implementation Guidelines for block_store_request
-
-block_store_request(block_store_t *const bs, const size_t block_id): This function marks a 
-specific block as allocated in the bitmap. It first checks if the pointer to the block store 
-is not NULL and if the block_id is within the range of valid block indices. If the block is 
-already marked as allocated, it returns false. Otherwise, it marks the block as allocated and 
-checks that the block was indeed marked as allocated by testing the bitmap. It returns true if 
-the block was successfully marked as allocated, false otherwise.
-
-*/
-
-
-///
-/// Attempts to allocate the requested block id
-/// \param bs the block store object
-/// \block_id the requested block identifier
-/// \return boolean indicating succes of operation
-///
-bool block_store_request(block_store_t *const bs, const size_t block_id)
-{
-	if (bs == NULL || bs->bitmap == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS)
-	{
-		return false;
-	}
-
-	// block_id is valid and this block is already in use
-	// I'm not sure if we would be able to safely test a bit if it's block_id  wasn't valid so this is in a separate check
-	if (bitmap_test(bs->bitmap, block_id) == 1)
-	{
-		return false;
-	}
-
-	bitmap_set(bs->bitmap, block_id);
-
-	return bitmap_test(bs->bitmap, block_id);
-}
-
-
-/*
-
-Implementation Guidelines for block_store_release
-
-block_store_release(block_store_t *const bs, const size_t block_id): This function marks a 
-specific block as free in the bitmap. It first checks if the pointer to the block store is 
-not NULL and if the block_id is within the range of valid block indices. Then, it resets the 
-bit corresponding to the block in the bitmap.
-
-*/
-
-///
-/// Frees the specified block
-/// \param bs BS device
-/// \param block_id The block to free
-///
-void block_store_release(block_store_t *const bs, const size_t block_id)
-{
-	if (bs != NULL && bs->bitmap != NULL && block_id < BLOCK_STORE_NUM_BLOCKS)
-	{
-		bitmap_reset(bs->bitmap, block_id);
-	}
-}
-
-/*
-
-Implementation Guidelines for block_store_get_used_blocks
-
-block_store_get_used_blocks(const block_store_t *const bs): This function returns the 
-number of blocks that are currently allocated in the block store. It first checks if the 
-pointer to the block store is not NULL and then uses the bitmap_total_set function to 
-count the number of set bits in the bitmap.
-
-*/
-
-///
-/// Counts the number of blocks marked as in use
-/// \param bs BS device
-/// \return Total blocks in use, SIZE_MAX on error
-///
-size_t block_store_get_used_blocks(const block_store_t *const bs)
-{
-	if (bs == NULL || bs->bitmap == NULL)
-	{
-		return SIZE_MAX;
-	}
-
-	return bitmap_total_set(bs->bitmap);
-}
-
-
-/*
-
-Implementation Guidelines for block_store_get_free_blocks
-
-block_store_get_free_blocks(const block_store_t *const bs): This function returns the 
-number of blocks that are currently free in the block store. It first checks if the 
-pointer to the block store is not NULL and then calculates the difference between the 
-total number of blocks and the number of used blocks using the block_store_get_used_blocks 
-and BLOCK_STORE_NUM_BLOCKS.
-
-*/
-
-///
-/// Counts the number of blocks marked free for use
-/// \param bs BS device
-/// \return Total blocks free, SIZE_MAX on error
-///
-size_t block_store_get_free_blocks(const block_store_t *const bs)
-{
-	if (bs == NULL || bs->bitmap == NULL)
-	{
-		return SIZE_MAX;
-	}
-
-	return BLOCK_STORE_NUM_BLOCKS - block_store_get_used_blocks(bs);
-}
-
-
-/*
-
-Implementation Guidelines for block_store_get_total_blocks
-
-block_store_get_total_blocks(): This function returns the total number of blocks in the block 
-store, which is defined by BLOCK_STORE_NUM_BLOCKS.
-
-*/
-
-///
-/// Returns the total number of user-addressable blocks
-///  (since this is constant, you don't even need the bs object)
-/// \return Total blocks
-///
-size_t block_store_get_total_blocks()
-{
-	return BLOCK_STORE_NUM_BLOCKS;
-}
-
-
-/*
-
-Implementation Guidelines for block_store_read
-
-block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer): This function 
-reads the contents of a block into a buffer. It returns the number of bytes successfully read.
-
-*/
-
-///
-/// Reads data from the specified block and writes it to the designated buffer
-/// \param bs BS device
-/// \param block_id Source block id
-/// \param buffer Data buffer to write to
-/// \return Number of bytes read, 0 on error
-///
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) // this function definition assumes that the user is passing a buffer that is at least BLOCK_SIZE_BYTES, if we passed the size of the buffer we could more safely write to the buffer with memcpy_s that would clear the buffer if we overflowed it
-{
-	if (bs == NULL || bs->bitmap == NULL || bs->data  == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS || buffer == NULL)
-	{
-		return 0;
-	}
-
-	// block_id is valid but this block is not allocated, cannot read data from it
-	// I'm not sure if we would be able to safely test a bit if it's block_id  wasn't valid so this is in a separate check
-	if (bitmap_test(bs->bitmap, block_id) == 0)
-	{
-		return 0;
-	}
-
-	memcpy(buffer, bs->data + (block_id * BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
-
-	return BLOCK_SIZE_BYTES;
-	
-}
-
-/*
-
-Implementation Guidelines for block_store_write
-
-block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer): This function writes 
-the contents of a buffer to a block. It returns the number of bytes successfully written.
-
-*/
-
-///
-/// Reads data from the specified buffer and writes it to the designated block
-/// \param bs BS device
-/// \param block_id Destination block id
-/// \param buffer Data buffer to read from
-/// \return Number of bytes written, 0 on error
-///
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
-{
-	if (bs == NULL || bs->bitmap  == NULL || bs->data  == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS || buffer == NULL)
-	{
-		return 0;
-	}
-
-	// block_id is valid but this block is not allocated, cannot write data to it
-	// I'm not sure if we would be able to safely test a bit if it's block_id  wasn't valid so this is in a separate check
-	if (bitmap_test(bs->bitmap, block_id) == 0)
-	{
-		return 0;
-	}
-
-	memcpy(bs->data + (block_id * BLOCK_SIZE_BYTES), buffer, BLOCK_SIZE_BYTES);
-
-	return BLOCK_SIZE_BYTES;
-}
-
-/*
-
-Implementation Guidelines for block_store_deserialize
-
-block_store_deserialize(const char *const filename): This function deserializes a block store 
-from a file. It returns a pointer to the resulting block_store_t struct.
-
-*/
-
-///
-/// Imports BS device from the given file - for grads/bonus
-/// \param filename The file to load
-/// \return Pointer to new BS device, NULL on error
-///
-block_store_t *block_store_deserialize(const char *const filename)
-{
-	if (filename == NULL) // check for invalid parameters
-    {
-        return NULL;
-    }
-
-
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) // if open failed
-    {
-		perror("Error opening file for reading");
-        return NULL;
-    }
-
-	block_store_t* bs = block_store_create();
-	if (bs == NULL)
-	{
-		close(fd);
-		return NULL;
-	}
-
-    size_t numBytesRead = read(fd, bs->data, BLOCK_STORE_NUM_BYTES);
-
-	// reading the full bs->data array in already covers the padding issue described, padding not implemented here
-
-	if (close(fd) != 0) // ensures all data is read before checking if the read was successful
-	{
-		perror("Error closing the file");
-        return NULL;
-	}
-	
-	// deserializing is only successful if the entire block store was read
-    if (numBytesRead != BLOCK_STORE_NUM_BYTES)
-    {
-		perror("Error reading from file"); // we didn't read the entire block store from the file, deserializing is only successful if we read the entire block store
-		block_store_destroy(bs);
-        return NULL;
-    }
-	//else statement not required
-    return bs;
-}
-
-/*
-
-Implementation Guidelines for block_store_serialize
-
-block_store_serialize(const block_store_t *const bs, const char *const filename): This function serializes 
-a block store to a file. It returns the size of the resulting file in bytes. 
-
-Note: If a test case 
-expects a specific number of bytes to be written but your file is smaller, pad the rest of the file 
-with zeros until the file is of the expected size. Modify your block_store_deserialize function accordingly 
-to accept padding if present.
-
-*/
-
-///
-/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
-/// \param bs BS device
-/// \param filename The file to write to
-/// \return Number of bytes written, 0 on error
-///
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
-{
-	if (bs == NULL || bs->bitmap  == NULL|| bs->data == NULL || filename == NULL) // check for invalid parameters
-    {
-        return 0;
-    }
-
-	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666); // need comment here
-    
-	if (fd == -1) // if open failed
-    {
-		perror("Error opening file for writing");
-        return 0;
-    }
-	
-    // looping structure is more robust than using write() of for the whole block_store
-    size_t numBytesWritten = 0;
-	while(numBytesWritten < BLOCK_STORE_NUM_BYTES){
-		size_t bytesWritten = write(fd, bs->data + numBytesWritten, BLOCK_STORE_NUM_BYTES - numBytesWritten);
-		if(bytesWritten <= 0){ //Check for write failed
-			perror("Error writing to file");
-			close(fd);
-			return 0;
-		}
-		numBytesWritten += bytesWritten;
-	}
-	// writing the full bs->data array already covers the padding issue described above, padding not implemented here
-
-	if (close(fd) != 0) // ensures all data is written before checking if the write was successful
-	{
-		perror("Error closing the file");
-        return 0;
-	}
-
-	// serialize is only successful if the entire block store was written
-    if (numBytesWritten != BLOCK_STORE_NUM_BYTES)
-    {
-		perror("Error writing to file"); // we didn't write the entire block store, serializing is only successful if we read the entire block store
-        return 0;
-    }
-    else
-    {
-        return numBytesWritten; // This should always be BLOCK_STORE_NUM_BYTES since we are assuming serialize is only successful if the entire block store was written
-	}
-}
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bitmap.h"
+#include "block_cache.h"
+#include "block_store.h"
+#include "wal.h"
+// include more if you need
+
+
+// You might find this handy. I put it around unused parameters, but you should
+// remove it before you submit. Just allows things to compile initially.
+#define UNUSED(x) (void)(x)
+
+// Magazines are per-thread stacks of free block ids that were claimed from the bitmap in a batch
+// A thread allocates from and releases into its own magazine, and only goes to the shared bitmap
+// when the magazine runs dry or fills up, so the bitmap's cache lines stop bouncing between cores
+#define MAGAZINE_SLOTS 64  // threads beyond this share magazines, which is fine, each has its own lock
+
+typedef struct block_store_magazine {
+    _Alignas(64) bool lock;  // a whole cache line each, or the magazines would just bounce instead
+    size_t count;
+    size_t ids[BLOCK_STORE_MAGAZINE_MAX];  // lowest id on top
+} block_store_magazine_t;
+
+// Sharding splits the id space into ranges, and threads start their searches for free blocks in their home shard,
+// only going looking in the others when it's full. Claims are atomic either way, shards don't lock anything, they just
+// keep threads claiming in different words of the bitmap, and a claim never scans past the end of the shard it's in.
+// Shards are a multiple of 512 blocks, so their slices of the bitmap are whole cache lines (the summary above them
+// is still shared)
+#define SHARD_ROUNDING 512
+
+// Set in a block's pin count while a release decides whether it can free it
+#define PIN_RELEASING UINT32_C(0x80000000)
+
+// Most ids release_many holds against pins at once
+#define RELEASE_BATCH 64
+
+// Readers never lock: they note the sequence numbers of the stripes they're reading, copy, and go again if any moved
+// Writers make their stripes' numbers odd for the duration of the copy, which also keeps other writers out
+// Chunk n belongs to stripe n % seq_stripes, so a run of up to seq_stripes consecutive chunks never has a stripe twice
+#define SEQ_STRIPES 1024
+
+// Snapshots share the live device's data, and a chunk only gets copied for them the first time it's written after one is taken
+// Chunks are a page's worth of blocks (or one block, if blocks are bigger than that), and the seqlock stripes
+// work in chunks too, so a writer holding a chunk's stripe is free to copy the whole chunk
+#define CHUNK_BYTES 4096
+
+// Background checkpoints write to "<filename>.ckpt" and only rename it over filename once it's all on disk,
+// so a crash part way through leaves the old image alone
+#define CHECKPOINT_SUFFIX ".ckpt"
+
+struct block_store_checkpoint {
+    block_store_snapshot_t* snapshot;     // What's being written out, taken when the checkpoint started
+    char* filename;
+    char* temporary;                      // filename + CHECKPOINT_SUFFIX
+    uint64_t logged;                      // Log position the image covers, if filename is the log's image
+    pthread_t thread;
+    size_t total;                         // Bytes in the image
+    size_t written;                       // Bytes written so far, updated by the thread as it goes
+    bool done;                            // Set by the thread once it's finished, successful or not
+    size_t result;                        // Bytes written if it all went through, 0 otherwise
+};
+
+// Snapshots are kept newest first, and each has the chunks that were written after it was taken (and before the
+// next one was), as they were. The rest it shares with the next newer snapshot, and the newest with the live device
+struct block_store_snap {
+    block_store_t* bs;
+    uint64_t generation;                  // Snapshots are numbered from 1 in the order they're taken
+    block_store_snapshot_t* newer;
+    block_store_snapshot_t* older;
+    bitmap_t* bitmap;                     // The bitmap is copied outright, it doesn't go through block_store_write
+                                          //  NULL once the snapshot is lost (a chunk couldn't be preserved for it)
+    // Open addressed table of preserved chunks, by chunk number
+    size_t* chunk_ids;
+    uint8_t** chunks;
+    size_t chunk_capacity;                // Power of 2, or 0 while nothing has been preserved
+    size_t chunk_used;
+};
+
+// With a log enabled, every write and allocation change is appended to "<image>.wal" as it happens,
+// and deserializing the image replays the log on top of it
+// A full or incremental serialize to the same image makes everything logged before it redundant, so it trims the log
+#define WAL_SUFFIX ".wal"
+
+typedef enum {
+    WAL_WRITE = 1,  // arg0 first block, arg1 number of blocks, payload their new contents
+    WAL_ALLOCATE,   // arg0 first block, arg1 number of blocks
+    WAL_RELEASE,    // arg0 first block, arg1 number of blocks
+    WAL_ALLOCATE_MANY,  // arg1 number of blocks, payload their ids (as size_t)
+    WAL_RELEASE_MANY    // arg1 number of blocks, payload their ids (as size_t)
+} WAL_RECORD;
+
+// Logs only replay onto devices with the same geometry
+typedef struct block_store_wal_header {
+    char magic[8];
+    uint64_t num_blocks;
+    uint64_t block_size;
+} block_store_wal_header_t;
+
+// Threads get a number the first time they allocate, which picks their magazine and home shard on every device
+static size_t block_store_next_thread;
+static _Thread_local size_t block_store_thread_id = SIZE_MAX;
+
+struct block_store {
+
+    bitmap_t* bitmap;   // Bitmap to track free/used blocks
+    uint8_t* data;     // Blocks are contiguous, essentially making a block device a giant physical array, this is that array
+
+    size_t num_blocks;          // Total blocks in the device, including the ones holding the bitmap
+    size_t block_size;          // Bytes per block
+    size_t bitmap_start_block;  // First block of the in-band bitmap
+    size_t bitmap_num_blocks;   // Number of blocks the in-band bitmap occupies
+
+    bool mapped;        // data is a shared mapping of an image file rather than our own memory
+    block_cache_t* cache;   // Set when blocks live in an image file behind a cache, data is NULL then
+    int fd;                 // The image file, only open along with cache or loaded
+    uint8_t* loaded;        // Per chunk, whether it's been read in yet, NULL unless the device was deserialized lazily
+    pthread_t prefetcher;   // Reads in the rest of a lazy device in the background, if asked to
+    bool prefetching;       // prefetcher was started
+    bool stop_prefetch;
+    uint8_t* resident;      // The bitmap's own blocks, kept in memory when data is NULL
+
+    bitmap_t* dirty;    // Blocks changed since the image was last written or read, out-of-band, never serialized
+
+    uint32_t* pins;     // Outstanding pins per block, pinned blocks can't be released (see PIN_RELEASING)
+
+    block_store_magazine_t* magazines;  // MAGAZINE_SLOTS of them, NULL until block_store_enable_magazines
+    size_t magazine_capacity;           // ids a magazine holds before it spills back into the bitmap
+    bitmap_t* parked;   // Blocks sitting in a magazine: set in the bitmap, but free as far as anyone else is concerned
+    size_t parked_count;
+    size_t used;        // Blocks allocated to someone, kept in step with the bitmap so the getters don't count
+
+    uint64_t* seq;      // Per-stripe sequence numbers, odd while a write is in progress
+    size_t seq_stripes;
+
+    size_t chunk_blocks;        // Blocks per chunk
+    size_t chunk_count;
+    uint64_t* chunk_gen;        // Per chunk, the newest snapshot generation it has been preserved for
+    uint64_t snapshot_gen;      // Generation of the newest snapshot taken, 0 if there never was one
+    block_store_snapshot_t* snapshots;  // Newest live snapshot
+    pthread_mutex_t snapshot_lock;      // Guards the snapshot list and their tables
+
+    wal_t* wal;         // NULL until block_store_enable_wal
+    char* wal_image;    // The image the log is on top of
+    pthread_mutex_t wal_lock;   // Keeps allocation records in the order the bitmap changed, see block_store_free_begin
+
+    size_t shard_count;         // 0 until block_store_enable_shards
+    size_t shard_blocks;        // Blocks per shard, shard n starts at n * shard_blocks (the last may be short)
+
+    block_store_stats_t* stats;   // NULL until block_store_enable_stats, so leaving them off costs one test per call
+
+};
+
+
+// Works out the geometry and sets up everything except the data arena and the bitmap over it
+static block_store_t *block_store_alloc(const size_t num_blocks, const size_t block_size)
+{
+	if (num_blocks == 0 || block_size == 0 || num_blocks > SIZE_MAX / block_size)
+	{
+		return NULL;
+	}
+
+	// one bit per block, rounded up to whole bytes and then to whole blocks
+	size_t bitmap_bytes = (num_blocks + 7) / 8;
+	size_t bitmap_num_blocks = (bitmap_bytes + block_size - 1) / block_size;
+	if (bitmap_num_blocks >= num_blocks) // the bitmap would leave no room for data
+	{
+		return NULL;
+	}
+
+	block_store_t* bs = (block_store_t*)calloc(1, sizeof(block_store_t));
+	if (bs == NULL)
+	{
+		return NULL;
+	}
+	pthread_mutex_init(&bs->snapshot_lock, NULL);
+	pthread_mutex_init(&bs->wal_lock, NULL);
+
+	bs->num_blocks = num_blocks;
+	bs->block_size = block_size;
+	bs->bitmap_num_blocks = bitmap_num_blocks;
+	// keep the bitmap where the default device has it, small devices just get it pushed to the end
+	bs->bitmap_start_block = BITMAP_START_BLOCK;
+	if (bs->bitmap_start_block + bitmap_num_blocks > num_blocks)
+	{
+		bs->bitmap_start_block = num_blocks - bitmap_num_blocks;
+	}
+
+	// from here on destroy knows how to clean up whatever we managed to set up
+	bs->pins = (uint32_t*)calloc(num_blocks, sizeof(uint32_t));
+	bs->dirty = bitmap_create(num_blocks);
+	bs->chunk_blocks = block_size < CHUNK_BYTES ? CHUNK_BYTES / block_size : 1;
+	bs->chunk_count = (num_blocks + bs->chunk_blocks - 1) / bs->chunk_blocks;
+	bs->chunk_gen = (uint64_t*)calloc(bs->chunk_count, sizeof(uint64_t));
+	bs->seq_stripes = bs->chunk_count < SEQ_STRIPES ? bs->chunk_count : SEQ_STRIPES;
+	bs->seq = (uint64_t*)calloc(bs->seq_stripes, sizeof(uint64_t));
+	if (bs->pins == NULL || bs->dirty == NULL || bs->seq == NULL || bs->chunk_gen == NULL)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+// Called after any contents change: the blocks will need writing out at the next incremental serialize
+static void block_store_data_changed(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	for (size_t i = first; i < first + count; i++)
+	{
+		bitmap_test_and_set(bs->dirty, i);
+	}
+}
+
+// With a log, bits are only ever cleared between these two, and the frees are logged before the lock goes
+// Claims log under the same lock, and a block can only be claimed once its bit is clear, so the claim's record
+// always lands after the record of the free it followed, and replay ends up with the bits the device has
+static void block_store_free_begin(block_store_t *const bs)
+{
+	if (bs->wal)
+	{
+		pthread_mutex_lock(&bs->wal_lock);
+	}
+}
+
+static void block_store_free_end(block_store_t *const bs)
+{
+	if (bs->wal)
+	{
+		pthread_mutex_unlock(&bs->wal_lock);
+	}
+}
+
+// Appends an allocation record, frees are already between block_store_free_begin and block_store_free_end
+static void block_store_log_allocation(block_store_t *const bs, const bool allocated, const WAL_RECORD type, const uint64_t first, const uint64_t count, const void *const payload, const size_t size)
+{
+	if (bs->wal == NULL)
+	{
+		return;
+	}
+	if (allocated)
+	{
+		pthread_mutex_lock(&bs->wal_lock);
+	}
+	wal_append(bs->wal, type, first, count, payload, size);
+	if (allocated)
+	{
+		pthread_mutex_unlock(&bs->wal_lock);
+	}
+}
+
+// Called after any change to the allocation bitmap, blocks first through first + count - 1 became allocated (or free)
+// The bits live in the bitmap's own blocks, so those are what changed as far as the image is concerned
+// Doesn't touch the used count, for callers that can't say exactly how many bits they changed
+static void block_store_allocation_logged(block_store_t *const bs, const size_t first, const size_t count, const bool allocated)
+{
+	block_store_log_allocation(bs, allocated, allocated ? WAL_ALLOCATE : WAL_RELEASE, first, count, NULL, 0);
+	const size_t bitsPerBlock = bs->block_size * 8;
+	block_store_data_changed(bs, bs->bitmap_start_block + first / bitsPerBlock, (first + count - 1) / bitsPerBlock - first / bitsPerBlock + 1);
+}
+
+// Same, for a list of blocks rather than a run, logged as one record
+static void block_store_allocation_listed(block_store_t *const bs, const size_t *const block_ids, const size_t count, const bool allocated)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	block_store_log_allocation(bs, allocated, allocated ? WAL_ALLOCATE_MANY : WAL_RELEASE_MANY, 0, count, block_ids, count * sizeof(size_t));
+	const size_t bitsPerBlock = bs->block_size * 8;
+	for (size_t i = 0; i < count; i++)
+	{
+		block_store_data_changed(bs, bs->bitmap_start_block + block_ids[i] / bitsPerBlock, 1);
+	}
+}
+
+// Same, for callers that changed every one of the count bits
+static void block_store_allocation_changed(block_store_t *const bs, const size_t first, const size_t count, const bool allocated)
+{
+	if (allocated)
+	{
+		__atomic_fetch_add(&bs->used, count, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_fetch_sub(&bs->used, count, __ATOMIC_RELAXED);
+	}
+	block_store_allocation_logged(bs, first, count, allocated);
+}
+
+// Rebuilds the bitmap summary and the used count, after the bitmap changed behind the allocators' backs
+static bool block_store_summarize(const block_store_t *const bs)
+{
+	const bool summarized = bitmap_summarize(bs->bitmap);
+	__atomic_store_n(&((block_store_t*)bs)->used, bitmap_total_set(bs->bitmap) - __atomic_load_n(&bs->parked_count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	return summarized;
+}
+
+// Called with the stripes of a write still held, so the log gets writes to a block in the order they happened
+static void block_store_log_write(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	if (bs->wal)
+	{
+		wal_append(bs->wal, WAL_WRITE, first, count, bs->data + (first * bs->block_size), count * bs->block_size);
+	}
+}
+
+// Lays the bitmap over its blocks in the data arena (or resident copy), which has to be in place already
+static bool block_store_attach_bitmap(block_store_t *const bs)
+{
+	bs->bitmap = bitmap_overlay(bs->num_blocks, bs->data ? bs->data + (bs->bitmap_start_block * bs->block_size) : bs->resident);
+	if (bs->bitmap == NULL)
+	{
+		return false;
+	}
+
+	// the summary keeps allocate from walking the whole bitmap on a full device
+	return block_store_summarize(bs);
+}
+
+// Waits out any writers on the stripes of blocks first to first + count - 1, returns a token for block_store_read_retry
+static uint64_t block_store_read_begin(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	// the numbers only ever go up, so the sum only stays the same if none of them moved
+	uint64_t total = 0;
+	for (size_t chunk = first / bs->chunk_blocks; chunk <= (first + count - 1) / bs->chunk_blocks; chunk++)
+	{
+		uint64_t seq;
+		while ((seq = __atomic_load_n(&bs->seq[chunk % bs->seq_stripes], __ATOMIC_ACQUIRE)) & 1)
+		{
+			sched_yield();
+		}
+		total += seq;
+	}
+	return total;
+}
+
+// Whether a writer got in since block_store_read_begin, in which case whatever was copied may be torn
+static bool block_store_read_retry(const block_store_t *const bs, const size_t first, const size_t count, const uint64_t token)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint64_t total = 0;
+	for (size_t chunk = first / bs->chunk_blocks; chunk <= (first + count - 1) / bs->chunk_blocks; chunk++)
+	{
+		total += __atomic_load_n(&bs->seq[chunk % bs->seq_stripes], __ATOMIC_RELAXED);
+	}
+	return total != token;
+}
+
+static void block_store_stripe_lock(const block_store_t *const bs, const size_t stripe)
+{
+	uint64_t seq = __atomic_load_n(&bs->seq[stripe], __ATOMIC_RELAXED);
+	do
+	{
+		while (seq & 1)
+		{
+			sched_yield();
+			seq = __atomic_load_n(&bs->seq[stripe], __ATOMIC_RELAXED);
+		}
+	} while (!__atomic_compare_exchange_n(&bs->seq[stripe], &seq, seq + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+}
+
+// Finds a chunk in a snapshot's table, the snapshot lock has to be held
+static uint8_t *block_store_snapshot_chunk(const block_store_snapshot_t *const snapshot, const size_t chunk)
+{
+	if (snapshot->chunk_capacity == 0)
+	{
+		return NULL;
+	}
+	for (size_t slot = chunk & (snapshot->chunk_capacity - 1); snapshot->chunks[slot]; slot = (slot + 1) & (snapshot->chunk_capacity - 1))
+	{
+		if (snapshot->chunk_ids[slot] == chunk)
+		{
+			return snapshot->chunks[slot];
+		}
+	}
+	return NULL;
+}
+
+// Adds a chunk to a snapshot's table, the snapshot lock has to be held
+// The table takes ownership of contents, false if it couldn't grow
+static bool block_store_snapshot_keep(block_store_snapshot_t *const snapshot, const size_t chunk, uint8_t *const contents)
+{
+	// stay under 3/4 full so lookups stay short
+	if ((snapshot->chunk_used + 1) * 4 > snapshot->chunk_capacity * 3)
+	{
+		const size_t capacity = snapshot->chunk_capacity ? snapshot->chunk_capacity * 2 : 16;
+		size_t *chunk_ids = (size_t*)calloc(capacity, sizeof(size_t));
+		uint8_t **chunks = (uint8_t**)calloc(capacity, sizeof(uint8_t*));
+		if (chunk_ids == NULL || chunks == NULL)
+		{
+			free(chunk_ids);
+			free(chunks);
+			return false;
+		}
+		for (size_t i = 0; i < snapshot->chunk_capacity; i++)
+		{
+			if (snapshot->chunks[i])
+			{
+				size_t slot = snapshot->chunk_ids[i] & (capacity - 1);
+				while (chunks[slot])
+				{
+					slot = (slot + 1) & (capacity - 1);
+				}
+				chunk_ids[slot] = snapshot->chunk_ids[i];
+				chunks[slot] = snapshot->chunks[i];
+			}
+		}
+		free(snapshot->chunk_ids);
+		free(snapshot->chunks);
+		snapshot->chunk_ids = chunk_ids;
+		snapshot->chunks = chunks;
+		snapshot->chunk_capacity = capacity;
+	}
+
+	size_t slot = chunk & (snapshot->chunk_capacity - 1);
+	while (snapshot->chunks[slot])
+	{
+		slot = (slot + 1) & (snapshot->chunk_capacity - 1);
+	}
+	snapshot->chunk_ids[slot] = chunk;
+	snapshot->chunks[slot] = contents;
+	snapshot->chunk_used++;
+	return true;
+}
+
+// Bytes in a chunk, the last one can be short
+static inline size_t block_store_chunk_bytes(const block_store_t *const bs, const size_t chunk)
+{
+	const size_t blocks = bs->num_blocks - chunk * bs->chunk_blocks;
+	return (blocks < bs->chunk_blocks ? blocks : bs->chunk_blocks) * bs->block_size;
+}
+
+// Copy-on-write: before the first write to a chunk since the newest snapshot was taken, that snapshot gets a copy
+// Called with the chunks' stripes held, so nothing else can be writing to them
+static void block_store_preserve(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	const uint64_t generation = __atomic_load_n(&bs->snapshot_gen, __ATOMIC_SEQ_CST);
+	if (generation == 0)
+	{
+		return;
+	}
+
+	block_store_t *const live = (block_store_t*)bs;
+	for (size_t chunk = first / bs->chunk_blocks; chunk <= (first + count - 1) / bs->chunk_blocks; chunk++)
+	{
+		if (__atomic_load_n(&bs->chunk_gen[chunk], __ATOMIC_ACQUIRE) >= generation)
+		{
+			continue;
+		}
+		pthread_mutex_lock(&live->snapshot_lock);
+		// a snapshot may have been taken (or let go of) since we looked
+		if (bs->chunk_gen[chunk] < bs->snapshot_gen && bs->snapshots && block_store_snapshot_chunk(bs->snapshots, chunk) == NULL)
+		{
+			const size_t bytes = block_store_chunk_bytes(bs, chunk);
+			uint8_t *contents = (uint8_t*)malloc(bytes);
+			// if the copy can't be made, the snapshot would end up seeing the write, so it's lost (its reads fail from here on)
+			if (contents == NULL || block_store_snapshot_keep(bs->snapshots, chunk, contents) == false)
+			{
+				free(contents);
+				bitmap_destroy(bs->snapshots->bitmap);
+				bs->snapshots->bitmap = NULL;
+			}
+			else
+			{
+				memcpy(contents, bs->data + (chunk * bs->chunk_blocks * bs->block_size), bytes);
+			}
+		}
+		__atomic_store_n(&live->chunk_gen[chunk], bs->snapshot_gen, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&live->snapshot_lock);
+	}
+}
+
+// Takes the stripes of blocks first to first + count - 1 (spanning at most seq_stripes chunks) for writing
+static void block_store_write_begin(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	// always in stripe order, so two writers that want some of the same stripes can't each hold what the other wants
+	const size_t start = (first / bs->chunk_blocks) % bs->seq_stripes;
+	const size_t end = start + (first + count - 1) / bs->chunk_blocks - first / bs->chunk_blocks + 1;
+	for (size_t stripe = 0; end > bs->seq_stripes && stripe < end - bs->seq_stripes; stripe++)
+	{
+		block_store_stripe_lock(bs, stripe);
+	}
+	for (size_t stripe = start; stripe < end && stripe < bs->seq_stripes; stripe++)
+	{
+		block_store_stripe_lock(bs, stripe);
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	block_store_preserve(bs, first, count);
+}
+
+static void block_store_write_end(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	for (size_t chunk = first / bs->chunk_blocks; chunk <= (first + count - 1) / bs->chunk_blocks; chunk++)
+	{
+		__atomic_fetch_add(&bs->seq[chunk % bs->seq_stripes], 1, __ATOMIC_RELEASE);
+	}
+}
+
+// Makes sure the chunks of blocks first to first + count - 1 have been read in from the image, on a lazily deserialized device
+// Has to be called before anything looks at (or writes part of) those blocks in the data arena, and without any stripes held
+static bool block_store_fault(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	if (bs->loaded == NULL)
+	{
+		return true;
+	}
+
+	for (size_t chunk = first / bs->chunk_blocks; chunk <= (first + count - 1) / bs->chunk_blocks; chunk++)
+	{
+		if (__atomic_load_n(&bs->loaded[chunk], __ATOMIC_ACQUIRE))
+		{
+			continue;
+		}
+		// the chunk's stripe keeps readers off it, and anyone else faulting it in waits for us
+		block_store_stripe_lock(bs, chunk % bs->seq_stripes);
+		bool ok = true;
+		if (bs->loaded[chunk] == 0)
+		{
+			const size_t bytes = block_store_chunk_bytes(bs, chunk);
+			const size_t offset = chunk * bs->chunk_blocks * bs->block_size;
+			for (size_t done = 0; ok && done < bytes;)
+			{
+				ssize_t bytesRead = pread(bs->fd, bs->data + offset + done, bytes - done, (off_t)(offset + done));
+				if (bytesRead <= 0)
+				{
+					perror("Error reading from file");
+					ok = false;
+				}
+				else
+				{
+					done += bytesRead;
+				}
+			}
+			if (ok)
+			{
+				__atomic_store_n(&bs->loaded[chunk], 1, __ATOMIC_RELEASE);
+			}
+		}
+		__atomic_fetch_add(&bs->seq[chunk % bs->seq_stripes], 1, __ATOMIC_RELEASE);
+		if (ok == false)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Whether a block is allocated to someone, as opposed to free or parked in a magazine
+static inline bool block_store_in_use(const block_store_t *const bs, const size_t block_id)
+{
+	return bitmap_test(bs->bitmap, block_id) && (bs->parked == NULL || bitmap_test(bs->parked, block_id) == false);
+}
+
+// A release holds a block's pin count at PIN_RELEASING (only ever from 0) while it frees the block, and pins wait for it
+// to go back to 0, so a pin either lands first and the release backs off, or lands after and sees the block is free
+static bool block_store_release_hold(const block_store_t *const bs, const size_t block_id)
+{
+	uint32_t expected = 0;
+	return __atomic_compare_exchange_n(&bs->pins[block_id], &expected, PIN_RELEASING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void block_store_release_unhold(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	for (size_t i = first; i < first + count; i++)
+	{
+		__atomic_store_n(&bs->pins[i], 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void block_store_pin_take(const block_store_t *const bs, const size_t block_id)
+{
+	uint32_t pins = __atomic_load_n(&bs->pins[block_id], __ATOMIC_RELAXED);
+	do
+	{
+		while (pins & PIN_RELEASING)
+		{
+			sched_yield();
+			pins = __atomic_load_n(&bs->pins[block_id], __ATOMIC_RELAXED);
+		}
+	} while (!__atomic_compare_exchange_n(&bs->pins[block_id], &pins, pins + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+}
+
+// Magazine locks are only held for a handful of bitmap operations, so they just spin
+static void block_store_lock(bool *const lock)
+{
+	while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+	{
+		sched_yield();
+	}
+}
+
+static void block_store_unlock(bool *const lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static size_t block_store_thread(void)
+{
+	if (block_store_thread_id == SIZE_MAX)
+	{
+		block_store_thread_id = __atomic_fetch_add(&block_store_next_thread, 1, __ATOMIC_RELAXED);
+	}
+	return block_store_thread_id;
+}
+
+// Stats counters are bumped without locks, relaxed is enough since nothing else is ordered by them
+static void block_store_stats_count(uint64_t *const counter, const uint64_t amount)
+{
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// Start time for block_store_stats_time, the clock isn't read at all when stats are off
+static uint64_t block_store_stats_clock(const block_store_t *const bs)
+{
+	if (bs->stats == NULL)
+	{
+		return 0;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// Adds the time since started to op's histogram, in the bucket of its highest set bit
+static void block_store_stats_time(const block_store_t *const bs, const BLOCK_STORE_STAT op, const uint64_t started)
+{
+	if (bs->stats == NULL)
+	{
+		return;
+	}
+	const uint64_t elapsed = block_store_stats_clock(bs) - started;
+	size_t bucket = 63 - __builtin_clzll(elapsed | 1);
+	if (bucket >= BLOCK_STORE_LATENCY_BUCKETS)
+	{
+		bucket = BLOCK_STORE_LATENCY_BUCKETS - 1;
+	}
+	block_store_stats_count(&bs->stats->latency[op][bucket], 1);
+}
+
+// Counts and times a read, write or serialize that went through, and hands bytes back for the caller to return
+static size_t block_store_stats_done(const block_store_t *const bs, const BLOCK_STORE_STAT op, const uint64_t started, const size_t bytes)
+{
+	if (bs->stats == NULL)
+	{
+		return bytes;
+	}
+	switch (op)
+	{
+	case BLOCK_STORE_STAT_READ:
+		block_store_stats_count(&bs->stats->reads, 1);
+		block_store_stats_count(&bs->stats->read_bytes, bytes);
+		break;
+	case BLOCK_STORE_STAT_WRITE:
+		block_store_stats_count(&bs->stats->writes, 1);
+		block_store_stats_count(&bs->stats->written_bytes, bytes);
+		break;
+	default:
+		block_store_stats_count(&bs->stats->serializes, 1);
+		block_store_stats_count(&bs->stats->serialized_bytes, bytes);
+		break;
+	}
+	block_store_stats_time(bs, op, started);
+	return bytes;
+}
+
+// Claims up to count free blocks, starting with the calling thread's home shard if the device is sharded
+static size_t block_store_claim(block_store_t *const bs, const size_t count, size_t *const block_ids)
+{
+	// the bitmap says how much of it each search actually loaded, but only if stats want to know
+	size_t scanned = 0;
+	size_t *const scan = bs->stats ? &scanned : NULL;
+	if (bs->shard_count == 0)
+	{
+		const size_t claimed = bitmap_claim_zeros_range(bs->bitmap, 0, bs->num_blocks, count, block_ids, scan);
+		if (scan)
+		{
+			block_store_stats_count(&bs->stats->scanned_bits, scanned);
+		}
+		return claimed;
+	}
+
+	size_t claimed = 0;
+	const size_t home = block_store_thread() % bs->shard_count;
+	for (size_t i = 0; i < bs->shard_count && claimed < count; i++)
+	{
+		const size_t first = (home + i) % bs->shard_count * bs->shard_blocks;
+		claimed += bitmap_claim_zeros_range(bs->bitmap, first, bs->shard_blocks, count - claimed, block_ids + claimed, scan);
+		if (scan)
+		{
+			block_store_stats_count(&bs->stats->scanned_bits, scanned);
+		}
+	}
+	return claimed;
+}
+
+// The calling thread's magazine, locked
+static block_store_magazine_t *block_store_magazine_lock(const block_store_t *const bs)
+{
+	block_store_magazine_t *magazine = &bs->magazines[block_store_thread() % MAGAZINE_SLOTS];
+	block_store_lock(&magazine->lock);
+	return magazine;
+}
+
+static void block_store_magazine_unlock(block_store_magazine_t *const magazine)
+{
+	block_store_unlock(&magazine->lock);
+}
+
+// Hands the top count ids of a locked magazine back to the bitmap
+static void block_store_magazine_spill(block_store_t *const bs, block_store_magazine_t *const magazine, const size_t count)
+{
+	size_t *const ids = magazine->ids + magazine->count - count;
+	for (size_t i = 0; i < count; i++)
+	{
+		bitmap_test_and_reset(bs->parked, ids[i]);
+	}
+	// parked blocks were already free as far as anyone else could tell, so this isn't an allocation change
+	bitmap_reset_many(bs->bitmap, ids, count, NULL);
+	magazine->count -= count;
+	__atomic_fetch_sub(&bs->parked_count, count, __ATOMIC_RELAXED);
+}
+
+// allocate through the calling thread's magazine, refilling it with half a magazine's worth if it's empty
+static size_t block_store_magazine_allocate(block_store_t *const bs)
+{
+	block_store_magazine_t *magazine = block_store_magazine_lock(bs);
+	if (magazine->count && bs->stats)
+	{
+		block_store_stats_count(&bs->stats->magazine_hits, 1);
+	}
+	if (magazine->count == 0)
+	{
+		size_t ids[BLOCK_STORE_MAGAZINE_MAX];
+		size_t claimed = block_store_claim(bs, (bs->magazine_capacity + 1) / 2, ids);
+		// claimed lowest first, stack them so the lowest comes off first
+		// they're only parked, the allocation changes when they come back out
+		for (size_t i = 0; i < claimed; i++)
+		{
+			bitmap_test_and_set(bs->parked, ids[i]);
+			magazine->ids[claimed - 1 - i] = ids[i];
+		}
+		magazine->count = claimed;
+		__atomic_fetch_add(&bs->parked_count, claimed, __ATOMIC_RELAXED);
+	}
+
+	size_t block_id = SIZE_MAX;
+	if (magazine->count)
+	{
+		block_id = magazine->ids[--magazine->count];
+		bitmap_test_and_reset(bs->parked, block_id);
+		__atomic_fetch_sub(&bs->parked_count, 1, __ATOMIC_RELAXED);
+	}
+	block_store_magazine_unlock(magazine);
+	if (block_id != SIZE_MAX)
+	{
+		block_store_allocation_changed(bs, block_id, 1, true);
+	}
+	return block_id;
+}
+
+// release into the calling thread's magazine, spilling half of it back to the bitmap if it's full
+// returns whether block_id was in use, the caller holds it against other releases (block_store_release_hold)
+static bool block_store_magazine_release(block_store_t *const bs, const size_t block_id)
+{
+	// a block that's free or already parked can't go in again, it would get handed out twice
+	if (bitmap_test(bs->bitmap, block_id) == false || bitmap_test(bs->parked, block_id))
+	{
+		return false;
+	}
+	block_store_magazine_t *magazine = block_store_magazine_lock(bs);
+	if (magazine->count == bs->magazine_capacity)
+	{
+		block_store_magazine_spill(bs, magazine, (bs->magazine_capacity + 1) / 2);
+	}
+	magazine->ids[magazine->count++] = block_id;
+	// only once it's in, so a request that sees the bit is sure to find the id when it gets to this magazine
+	bitmap_test_and_set(bs->parked, block_id);
+	__atomic_fetch_add(&bs->parked_count, 1, __ATOMIC_RELAXED);
+	block_store_magazine_unlock(magazine);
+	block_store_allocation_changed(bs, block_id, 1, false);
+	return true;
+}
+
+// Pulls a specific parked block out of whichever magazine has it, so it can be requested
+static bool block_store_unpark(block_store_t *const bs, const size_t block_id)
+{
+	for (size_t slot = 0; slot < MAGAZINE_SLOTS; slot++)
+	{
+		block_store_magazine_t *magazine = &bs->magazines[slot];
+		block_store_lock(&magazine->lock);
+		for (size_t i = 0; i < magazine->count; i++)
+		{
+			if (magazine->ids[i] == block_id)
+			{
+				memmove(magazine->ids + i, magazine->ids + i + 1, (magazine->count - i - 1) * sizeof(size_t));
+				magazine->count--;
+				bool unparked = bitmap_test_and_reset(bs->parked, block_id);
+				__atomic_fetch_sub(&bs->parked_count, 1, __ATOMIC_RELAXED);
+				block_store_magazine_unlock(magazine);
+				return unparked;
+			}
+		}
+		block_store_magazine_unlock(magazine);
+	}
+	return false;
+}
+
+/*
+Implementation Guidelines for block_store_create
+
+block_store_create(): This function creates a new block store and returns a pointer to it. 
+It first allocates memory for the block store and initializes it to zeros using the 
+memset (an alternative method to initialize newly-allocated memory to all 0s is to use calloc instead of malloc). 
+Then it sets the bitmap field of the block store to an overlay of a bitmap with size BITMAP_SIZE_BYTES on 
+the blocks starting at index BITMAP_START_BLOCK. (You should define BITMAP_START_BLOCK based on already 
+defined constants.) Finally, it marks the blocks used by the bitmap as allocated using the block_store_request 
+function.
+
+*/
+
+///
+/// This creates a new BS device, ready to go
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create()
+{
+	return block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+///
+/// This creates a new BS device with the requested geometry
+///  The in-band bitmap lives at BITMAP_START_BLOCK, or as close to it as the device allows
+/// \param num_blocks Total number of blocks in the device, including the bitmap's own blocks
+/// \param block_size Number of bytes per block
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size)
+{
+	block_store_t* bs = block_store_alloc(num_blocks, block_size);
+	if (bs == NULL)
+	{
+		return NULL;
+	}
+
+	bs->data = (uint8_t*)calloc(num_blocks, block_size);
+	if (bs->data == NULL || block_store_attach_bitmap(bs) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	// there's no image yet, so as far as any image is concerned everything has changed
+	bitmap_format(bs->dirty, 0xFF);
+
+	if (block_store_request_range(bs, bs->bitmap_start_block, bs->bitmap_num_blocks) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+
+/*
+Implementation Guidelines for block_store_destroy
+
+block_store_destroy(block_store_t *const bs): This function destroys a block store by freeing 
+the memory allocated to it. It first checks if the pointer to the block store is not NULL, and if so, 
+it frees the memory allocated to the bitmap and then to the block store.
+
+*/
+
+
+///
+/// Destroys the provided block storage device
+/// This is an idempotent operation, so there is no return value
+/// \param bs BS device
+///
+void block_store_destroy(block_store_t *const bs)
+{
+	if(bs)
+	{
+		if (bs->prefetching)
+		{
+			__atomic_store_n(&bs->stop_prefetch, true, __ATOMIC_RELAXED);
+			pthread_join(bs->prefetcher, NULL);
+		}
+		if (bs->loaded)
+		{
+			close(bs->fd);
+		}
+
+		if (bs->cache)
+		{
+			// write-back: whatever is only in the cache (or the resident bitmap) goes out now
+			block_store_sync(bs);
+			block_cache_destroy(bs->cache);
+			close(bs->fd);
+		}
+
+		if (bs->bitmap)
+		{
+			bitmap_destroy(bs->bitmap);
+			bs->bitmap = NULL;
+		}
+
+		if(bs->data)
+		{
+			if (bs->mapped)
+			{
+				munmap(bs->data, bs->num_blocks * bs->block_size);
+			}
+			else
+			{
+				free(bs->data);
+			}
+			bs->data = NULL;
+		}
+
+		free(bs->resident);
+		free(bs->loaded);
+		bitmap_destroy(bs->dirty);
+		bitmap_destroy(bs->parked);
+		free(bs->magazines);
+		free(bs->stats);
+		wal_destroy(bs->wal);
+		free(bs->wal_image);
+		// handles still out are dangling from here on, but at least they don't leak
+		while (bs->snapshots)
+		{
+			block_store_snapshot_release(bs->snapshots);
+		}
+		pthread_mutex_destroy(&bs->snapshot_lock);
+		pthread_mutex_destroy(&bs->wal_lock);
+		free(bs->chunk_gen);
+		free(bs->seq);
+		free(bs->pins);
+		free(bs);
+	}
+}
+
+
+/*
+
+Implementation Guidelines for block_store_allocate
+
+block_store_allocate(block_store_t *const bs): This function finds the first free block in the 
+block store and marks it as allocated in the bitmap. It returns the index of the allocated block 
+or SIZE_MAX if no free block is available.
+
+*/
+
+///
+/// Searches for a free block, marks it as in use, and returns the block's id
+/// \param bs BS device
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate(block_store_t *const bs)
+{
+	if (bs == NULL || bs->bitmap == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	size_t ffzAddress;
+	if (bs->magazines)
+	{
+		ffzAddress = block_store_magazine_allocate(bs);
+	}
+	// find and set in one step, another thread can't slip in between and take the same block
+	else if (block_store_claim(bs, 1, &ffzAddress) == 0)
+	{
+		ffzAddress = SIZE_MAX;
+	}
+	else
+	{
+		block_store_allocation_changed(bs, ffzAddress, 1, true);
+	}
+
+	if (bs->stats)
+	{
+		if (ffzAddress == SIZE_MAX)
+		{
+			block_store_stats_count(&bs->stats->allocation_failures, 1);
+		}
+		else
+		{
+			block_store_stats_count(&bs->stats->allocations, 1);
+			block_store_stats_time(bs, BLOCK_STORE_STAT_ALLOCATE, started);
+		}
+	}
+	return ffzAddress;
+}
+
+
+///
+/// Searches for up to count free blocks in a single pass, marks them as in use,
+///  and stores their ids
+/// \param bs BS device
+/// \param count Number of blocks wanted
+/// \param block_ids Array of at least count entries to receive the allocated ids
+/// \return Number of blocks allocated, which is less than count if the device filled up
+///
+size_t block_store_allocate_many(block_store_t *const bs, const size_t count, size_t *const block_ids)
+{
+	if (bs == NULL || bs->bitmap == NULL || block_ids == NULL)
+	{
+		return 0;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	size_t allocated = block_store_claim(bs, count, block_ids);
+	__atomic_fetch_add(&bs->used, allocated, __ATOMIC_RELAXED);
+	block_store_allocation_listed(bs, block_ids, allocated, true);
+
+	if (bs->stats)
+	{
+		block_store_stats_count(&bs->stats->allocations, allocated);
+		if (allocated < count)
+		{
+			block_store_stats_count(&bs->stats->allocation_failures, 1);
+		}
+		else
+		{
+			block_store_stats_time(bs, BLOCK_STORE_STAT_ALLOCATE, started);
+		}
+	}
+	return allocated;
+}
+
+/*
+
+Implementation Guidelines for block_store_request
+
+block_store_request(block_store_t *const bs, const size_t block_id): This function marks a 
+specific block as allocated in the bitmap. It first checks if the pointer to the block store 
+is not NULL and if the block_id is within the range of valid block indices. If the block is 
+already marked as allocated, it returns false. Otherwise, it marks the block as allocated and 
+checks that the block was indeed marked as allocated by testing the bitmap. It returns true if 
+the block was successfully marked as allocated, false otherwise.
+
+*/
+
+
+///
+/// Attempts to allocate the requested block id
+/// \param bs the block store object
+/// \block_id the requested block identifier
+/// \return boolean indicating succes of operation
+///
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+	if (bs == NULL || bs->bitmap == NULL || block_id >= bs->num_blocks)
+	{
+		return false;
+	}
+
+	// block_id is valid and this block is already in use (possibly by another thread that just beat us to it)
+	if (bitmap_test_and_set(bs->bitmap, block_id))
+	{
+		// unless it's only parked in a magazine, then it's free and can be taken back out
+		if (bs->magazines == NULL || bitmap_test(bs->parked, block_id) == false || block_store_unpark(bs, block_id) == false)
+		{
+			return false;
+		}
+	}
+
+	block_store_allocation_changed(bs, block_id, 1, true);
+
+	return true;
+}
+
+
+/*
+
+Implementation Guidelines for block_store_release
+
+block_store_release(block_store_t *const bs, const size_t block_id): This function marks a 
+specific block as free in the bitmap. It first checks if the pointer to the block store is 
+not NULL and if the block_id is within the range of valid block indices. Then, it resets the 
+bit corresponding to the block in the bitmap.
+
+*/
+
+///
+/// Frees the specified block
+/// \param bs BS device
+/// \param block_id The block to free
+///
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+	// pinned blocks have pointers handed out to them, they stay allocated until unpinned
+	if (bs != NULL && bs->bitmap != NULL && block_id < bs->num_blocks && block_store_release_hold(bs, block_id))
+	{
+		const uint64_t started = block_store_stats_clock(bs);
+		bool released = false;
+		block_store_free_begin(bs);
+		if (bs->magazines)
+		{
+			released = block_store_magazine_release(bs, block_id);
+		}
+		// only whoever actually cleared the bit reports it, releasing twice isn't two changes
+		else if (bitmap_test_and_reset(bs->bitmap, block_id))
+		{
+			block_store_allocation_changed(bs, block_id, 1, false);
+			released = true;
+		}
+		block_store_free_end(bs);
+		block_store_release_unhold(bs, block_id, 1);
+
+		if (released && bs->stats)
+		{
+			block_store_stats_count(&bs->stats->releases, 1);
+			block_store_stats_time(bs, BLOCK_STORE_STAT_RELEASE, started);
+		}
+	}
+}
+
+///
+/// Frees every block in the list (ids out of range are skipped)
+/// \param bs BS device
+/// \param block_ids The blocks to free, sorted lists free the fastest
+/// \param count Number of entries in block_ids
+///
+void block_store_release_many(block_store_t *const bs, const size_t *const block_ids, const size_t count)
+{
+	if (bs != NULL && bs->bitmap != NULL && block_ids != NULL)
+	{
+		if (bs->magazines)
+		{
+			// the ids go to the magazine one at a time anyway, and are counted there
+			for (size_t i = 0; i < count; i++)
+			{
+				block_store_release(bs, block_ids[i]);
+			}
+			return;
+		}
+		// a batch at a time is held against pins and freed in one pass, pinned ids (and repeats) drop out
+		const uint64_t started = block_store_stats_clock(bs);
+		size_t total = 0;
+		for (size_t i = 0; i < count;)
+		{
+			size_t held[RELEASE_BATCH];
+			size_t held_count = 0;
+			for (; i < count && held_count < RELEASE_BATCH; i++)
+			{
+				if (block_ids[i] < bs->num_blocks && block_store_release_hold(bs, block_ids[i]))
+				{
+					held[held_count++] = block_ids[i];
+				}
+			}
+			// only the bits this pass cleared are counted and logged, an id that was already free isn't ours to log
+			size_t cleared[RELEASE_BATCH];
+			block_store_free_begin(bs);
+			const size_t released = bitmap_reset_many(bs->bitmap, held, held_count, cleared);
+			__atomic_fetch_sub(&bs->used, released, __ATOMIC_RELAXED);
+			block_store_allocation_listed(bs, cleared, released, false);
+			block_store_free_end(bs);
+			for (size_t j = 0; j < held_count; j++)
+			{
+				block_store_release_unhold(bs, held[j], 1);
+			}
+			total += released;
+		}
+
+		if (total && bs->stats)
+		{
+			block_store_stats_count(&bs->stats->releases, total);
+			block_store_stats_time(bs, BLOCK_STORE_STAT_RELEASE, started);
+		}
+	}
+}
+
+///
+/// Searches for a run of consecutive free blocks, marks all of them as in use,
+///  and returns the id of the first one. Extents never cross the bitmap's own blocks.
+/// \param bs BS device
+/// \param count Number of blocks in the extent
+/// \return First block id of the extent, SIZE_MAX on error
+///
+size_t block_store_allocate_extent(block_store_t *const bs, const size_t count)
+{
+	if (bs == NULL || bs->bitmap == NULL || count == 0)
+	{
+		return SIZE_MAX;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	const size_t bitmapEnd = bs->bitmap_start_block + bs->bitmap_num_blocks;
+	size_t start = 0;
+	for (;;)
+	{
+		start = bitmap_find_zero_run(bs->bitmap, start, count);
+		if (start == SIZE_MAX)
+		{
+			if (bs->stats)
+			{
+				block_store_stats_count(&bs->stats->allocation_failures, 1);
+			}
+			return SIZE_MAX;
+		}
+		// the bitmap's blocks are normally in use anyway, but someone may have released them,
+		// so don't trust the bits and treat them as a wall
+		if (start < bitmapEnd && start + count > bs->bitmap_start_block)
+		{
+			start = bitmapEnd;
+			continue;
+		}
+		// another thread may have taken part of the run since we found it, look again from the same spot
+		if (bitmap_claim_range(bs->bitmap, start, count))
+		{
+			break;
+		}
+	}
+
+	block_store_allocation_changed(bs, start, count, true);
+
+	if (bs->stats)
+	{
+		block_store_stats_count(&bs->stats->allocations, count);
+		block_store_stats_time(bs, BLOCK_STORE_STAT_ALLOCATE, started);
+	}
+	return start;
+}
+
+///
+/// Frees the specified run of blocks
+///  Nothing is freed if the run is out of range or covers any of the bitmap's own blocks
+/// \param bs BS device
+/// \param block_id The first block of the extent
+/// \param count Number of blocks in the extent
+///
+void block_store_release_extent(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	block_store_release_range(bs, block_id, count);
+}
+
+///
+/// Attempts to allocate every block of a run, all or nothing, a word of the bitmap at a time
+/// \param bs BS device
+/// \param block_id The first block of the run
+/// \param count Number of blocks in the run
+/// \return true if the whole run was free and is now allocated, false on error or if any of it was in use
+///  (blocks parked in a magazine count as in use here)
+///
+bool block_store_request_range(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if (bs == NULL || bs->bitmap == NULL || count == 0 || block_id >= bs->num_blocks || count > bs->num_blocks - block_id)
+	{
+		return false;
+	}
+
+	if (bitmap_claim_range(bs->bitmap, block_id, count) == false)
+	{
+		return false;
+	}
+	block_store_allocation_changed(bs, block_id, count, true);
+	return true;
+}
+
+///
+/// Frees every block of a run, a word of the bitmap at a time
+///  Nothing is freed if the run is out of range, covers any of the bitmap's own blocks, or has a pinned block in it
+/// \param bs BS device
+/// \param block_id The first block of the run
+/// \param count Number of blocks in the run
+/// \return Number of blocks that were allocated and now aren't, 0 on error
+///
+size_t block_store_release_range(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if (bs == NULL || bs->bitmap == NULL || count == 0 || block_id >= bs->num_blocks || count > bs->num_blocks - block_id)
+	{
+		return 0;
+	}
+
+	if (block_id < bs->bitmap_start_block + bs->bitmap_num_blocks && block_id + count > bs->bitmap_start_block)
+	{
+		return 0;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	for (size_t i = block_id; i < block_id + count; i++)
+	{
+		if (block_store_release_hold(bs, i) == false)
+		{
+			block_store_release_unhold(bs, block_id, i - block_id);
+			return 0;
+		}
+	}
+
+	size_t released = 0;
+	block_store_free_begin(bs);
+	if (bs->magazines == NULL)
+	{
+		released = bitmap_reset_range(bs->bitmap, block_id, count);
+	}
+	else
+	{
+		for (size_t i = block_id; i < block_id + count; i++)
+		{
+			// parked blocks are already free, and their magazine still has them
+			if (bitmap_test(bs->parked, i) == false && bitmap_test_and_reset(bs->bitmap, i))
+			{
+				released++;
+			}
+		}
+	}
+	if (released)
+	{
+		__atomic_fetch_sub(&bs->used, released, __ATOMIC_RELAXED);
+		block_store_allocation_logged(bs, block_id, count, false);
+	}
+	block_store_free_end(bs);
+	block_store_release_unhold(bs, block_id, count);
+
+	if (released && bs->stats)
+	{
+		block_store_stats_count(&bs->stats->releases, released);
+		block_store_stats_time(bs, BLOCK_STORE_STAT_RELEASE, started);
+	}
+	return released;
+}
+
+///
+/// Puts a per-thread cache of free block ids in front of the bitmap, after this
+///  allocate/release mostly stay within the calling thread and only touch the bitmap in batches
+///  Allocate no longer always returns the lowest free block, and the used/free counts include parked blocks as free
+///  Must be called before the device is shared between threads
+/// \param bs BS device
+/// \param capacity Number of ids each thread's magazine holds, 1 to BLOCK_STORE_MAGAZINE_MAX
+/// \return true on success, false on error or if magazines were already enabled
+///
+bool block_store_enable_magazines(block_store_t *const bs, const size_t capacity)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->magazines != NULL || capacity == 0 || capacity > BLOCK_STORE_MAGAZINE_MAX)
+	{
+		return false;
+	}
+
+	bs->parked = bitmap_create(bs->num_blocks);
+	bs->magazines = (block_store_magazine_t*)aligned_alloc(_Alignof(block_store_magazine_t), MAGAZINE_SLOTS * sizeof(block_store_magazine_t));
+	if (bs->parked == NULL || bs->magazines == NULL)
+	{
+		bitmap_destroy(bs->parked);
+		free(bs->magazines);
+		bs->parked = NULL;
+		bs->magazines = NULL;
+		return false;
+	}
+	memset(bs->magazines, 0, MAGAZINE_SLOTS * sizeof(block_store_magazine_t));
+	bs->magazine_capacity = capacity;
+	return true;
+}
+
+///
+/// Returns every block parked in the magazines to the bitmap
+///  Serialize and sync do this themselves, so parked blocks never show up as allocated in an image
+/// \param bs BS device
+///
+void block_store_drain_magazines(block_store_t *const bs)
+{
+	if (bs == NULL || bs->magazines == NULL)
+	{
+		return;
+	}
+
+	for (size_t slot = 0; slot < MAGAZINE_SLOTS; slot++)
+	{
+		block_store_magazine_t *magazine = &bs->magazines[slot];
+		block_store_lock(&magazine->lock);
+		block_store_magazine_spill(bs, magazine, magazine->count);
+		block_store_magazine_unlock(magazine);
+	}
+}
+
+///
+/// Splits the device's ids into shards, ranges that different threads start their searches for free blocks in
+///  Threads allocate from their own shard, and only from the others once it's full
+///  It's only a placement hint, shards have no bitmap or lock of their own: the bitmap (and its summary) is still
+///  the one shared, atomically updated bitmap. Threads in different shards claim in different cache lines of it,
+///  but a summary word covers 8 shards, so they still meet there whenever a word of theirs fills up or empties
+///  Ids and the image don't change
+///  Must be called before the device is shared between threads
+/// \param bs BS device
+/// \param shards Number of shards wanted, small devices may get fewer
+/// \return true on success, false on error or if the device was already sharded
+///
+bool block_store_enable_shards(block_store_t *const bs, const size_t shards)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->shard_count != 0 || shards == 0)
+	{
+		return false;
+	}
+
+	// shards are rounded up to whole cache lines of the bitmap, which can mean fewer of them
+	size_t shard_blocks = (bs->num_blocks + shards - 1) / shards;
+	shard_blocks = (shard_blocks + SHARD_ROUNDING - 1) / SHARD_ROUNDING * SHARD_ROUNDING;
+	bs->shard_count = (bs->num_blocks + shard_blocks - 1) / shard_blocks;
+	bs->shard_blocks = shard_blocks;
+	return true;
+}
+
+///
+/// Number of shards the device is split into
+/// \param bs BS device
+/// \return Number of shards, 1 if the device isn't sharded, 0 on error
+///
+size_t block_store_get_shard_count(const block_store_t *const bs)
+{
+	if (bs == NULL)
+	{
+		return 0;
+	}
+	return bs->shard_count ? bs->shard_count : 1;
+}
+
+/*
+
+Implementation Guidelines for block_store_get_used_blocks
+
+block_store_get_used_blocks(const block_store_t *const bs): This function returns the 
+number of blocks that are currently allocated in the block store. It first checks if the 
+pointer to the block store is not NULL and then uses the bitmap_total_set function to 
+count the number of set bits in the bitmap.
+
+*/
+
+///
+/// Counts the number of blocks marked as in use
+/// \param bs BS device
+/// \return Total blocks in use, SIZE_MAX on error
+///
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+	if (bs == NULL || bs->bitmap == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	// kept up to date by every allocation change, parked blocks don't count
+	return __atomic_load_n(&bs->used, __ATOMIC_RELAXED);
+}
+
+
+/*
+
+Implementation Guidelines for block_store_get_free_blocks
+
+block_store_get_free_blocks(const block_store_t *const bs): This function returns the 
+number of blocks that are currently free in the block store. It first checks if the 
+pointer to the block store is not NULL and then calculates the difference between the 
+total number of blocks and the number of used blocks using the block_store_get_used_blocks 
+and BLOCK_STORE_NUM_BLOCKS.
+
+*/
+
+///
+/// Calls func for every allocated block, in order, skipping over free ones a word of the bitmap at a time
+///  Blocks allocated or freed while this runs may or may not be visited
+/// \param bs BS device
+/// \param func The function to call, with the block's id and arg
+/// \param arg Passed through to func
+/// \return Number of blocks visited, SIZE_MAX on error
+///
+size_t block_store_for_each_allocated(const block_store_t *const bs, void (*func)(size_t, void *), void *arg)
+{
+	if (bs == NULL || bs->bitmap == NULL || func == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	size_t visited = 0;
+	for (size_t block = bitmap_next_set(bs->bitmap, 0); block != SIZE_MAX; block = bitmap_next_set(bs->bitmap, block + 1))
+	{
+		// parked blocks are set in the bitmap, but they're free
+		if (block_store_in_use(bs, block))
+		{
+			func(block, arg);
+			visited++;
+		}
+	}
+	return visited;
+}
+
+///
+/// Counts the number of blocks marked free for use
+/// \param bs BS device
+/// \return Total blocks free, SIZE_MAX on error
+///
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+	if (bs == NULL || bs->bitmap == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	return bs->num_blocks - block_store_get_used_blocks(bs);
+}
+
+
+/*
+
+Implementation Guidelines for block_store_get_total_blocks
+
+block_store_get_total_blocks(): This function returns the total number of blocks in the block 
+store, which is defined by BLOCK_STORE_NUM_BLOCKS.
+
+*/
+
+///
+/// Returns the total number of user-addressable blocks
+///  (since this is constant, you don't even need the bs object)
+/// \return Total blocks
+///
+size_t block_store_get_total_blocks()
+{
+	return BLOCK_STORE_NUM_BLOCKS;
+}
+
+///
+/// Returns the total number of user-addressable blocks of this device
+/// \param bs BS device
+/// \return Total blocks, SIZE_MAX on error
+///
+size_t block_store_get_total_blocks_ex(const block_store_t *const bs)
+{
+	if (bs == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	return bs->num_blocks;
+}
+
+///
+/// Returns the number of bytes in each block of this device
+/// \param bs BS device
+/// \return Block size in bytes, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs)
+{
+	if (bs == NULL)
+	{
+		return 0;
+	}
+
+	return bs->block_size;
+}
+
+
+// Whether a block is one of the bitmap's own, which stay resident when the rest of the device is behind a cache
+static inline bool block_store_is_bitmap(const block_store_t *const bs, const size_t block_id)
+{
+	return block_id >= bs->bitmap_start_block && block_id < bs->bitmap_start_block + bs->bitmap_num_blocks;
+}
+
+// Called after a write to block_id: writing over the bitmap's own blocks changes it behind the overlay's back,
+// so its summary has to be rebuilt
+static void block_store_written(const block_store_t *const bs, const size_t block_id)
+{
+	if (block_store_is_bitmap(bs, block_id))
+	{
+		block_store_summarize(bs);
+	}
+}
+
+static bool block_store_cached_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+	if (block_store_is_bitmap(bs, block_id))
+	{
+		uint64_t token;
+		do
+		{
+			token = block_store_read_begin(bs, block_id, 1);
+			memcpy(buffer, bs->resident + (block_id - bs->bitmap_start_block) * bs->block_size, bs->block_size);
+		} while (block_store_read_retry(bs, block_id, 1, token));
+		return true;
+	}
+	return block_cache_read(bs->cache, block_id, buffer);
+}
+
+static bool block_store_cached_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+	if (block_store_is_bitmap(bs, block_id))
+	{
+		block_store_write_begin(bs, block_id, 1);
+		memcpy(bs->resident + (block_id - bs->bitmap_start_block) * bs->block_size, buffer, bs->block_size);
+		block_store_write_end(bs, block_id, 1);
+		block_store_written(bs, block_id);
+	}
+	else if (block_cache_write(bs->cache, block_id, buffer) == false)
+	{
+		return false;
+	}
+	block_store_data_changed(bs, block_id, 1);
+	return true;
+}
+
+/*
+
+Implementation Guidelines for block_store_read
+
+block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer): This function 
+reads the contents of a block into a buffer. It returns the number of bytes successfully read.
+
+*/
+
+///
+/// Reads data from the specified block and writes it to the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) // this function definition assumes that the user is passing a buffer that is at least BLOCK_SIZE_BYTES, if we passed the size of the buffer we could more safely write to the buffer with memcpy_s that would clear the buffer if we overflowed it
+{
+	if (bs == NULL || bs->bitmap == NULL || (bs->data == NULL && bs->cache == NULL) || block_id >= bs->num_blocks || buffer == NULL)
+	{
+		return 0;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	// block_id is valid but this block is not allocated, cannot read data from it
+	// I'm not sure if we would be able to safely test a bit if it's block_id  wasn't valid so this is in a separate check
+	if (block_store_in_use(bs, block_id) == false)
+	{
+		return 0;
+	}
+
+	if (bs->cache)
+	{
+		if (block_store_cached_read(bs, block_id, buffer) == false)
+		{
+			return 0;
+		}
+		return block_store_stats_done(bs, BLOCK_STORE_STAT_READ, started, bs->block_size);
+	}
+	if (block_store_fault(bs, block_id, 1) == false)
+	{
+		return 0;
+	}
+
+	uint64_t token;
+	do
+	{
+		token = block_store_read_begin(bs, block_id, 1);
+		memcpy(buffer, bs->data + (block_id * bs->block_size), bs->block_size);
+	} while (block_store_read_retry(bs, block_id, 1, token));
+
+	return block_store_stats_done(bs, BLOCK_STORE_STAT_READ, started, bs->block_size);
+	
+}
+
+/*
+
+Implementation Guidelines for block_store_write
+
+block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer): This function writes 
+the contents of a buffer to a block. It returns the number of bytes successfully written.
+
+*/
+
+///
+/// Reads data from the specified buffer and writes it to the designated block
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+	if (bs == NULL || bs->bitmap  == NULL || (bs->data == NULL && bs->cache == NULL) || block_id >= bs->num_blocks || buffer == NULL)
+	{
+		return 0;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	// block_id is valid but this block is not allocated, cannot write data to it
+	// I'm not sure if we would be able to safely test a bit if it's block_id  wasn't valid so this is in a separate check
+	if (block_store_in_use(bs, block_id) == false)
+	{
+		return 0;
+	}
+
+	if (bs->cache)
+	{
+		if (block_store_cached_write(bs, block_id, buffer) == false)
+		{
+			return 0;
+		}
+		return block_store_stats_done(bs, BLOCK_STORE_STAT_WRITE, started, bs->block_size);
+	}
+	// the rest of the chunk has to be there before a snapshot can copy it
+	if (block_store_fault(bs, block_id, 1) == false)
+	{
+		return 0;
+	}
+
+	block_store_write_begin(bs, block_id, 1);
+	memcpy(bs->data + (block_id * bs->block_size), buffer, bs->block_size);
+	block_store_log_write(bs, block_id, 1);
+	block_store_write_end(bs, block_id, 1);
+	block_store_data_changed(bs, block_id, 1);
+	block_store_written(bs, block_id);
+
+	return block_store_stats_done(bs, BLOCK_STORE_STAT_WRITE, started, bs->block_size);
+}
+
+// Checks that a run of blocks is in range and allocated, ready to be pinned
+static bool block_store_pinnable(const block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL || count == 0 || block_id >= bs->num_blocks || count > bs->num_blocks - block_id)
+	{
+		return false;
+	}
+
+	for (size_t i = block_id; i < block_id + count; i++)
+	{
+		if (block_store_in_use(bs, i) == false)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+///
+/// Pins a block, or a run of consecutive blocks, and returns a pointer straight into the device
+///  Pinned blocks can't be released, so the pointer stays good until block_store_unpin
+/// \param bs BS device
+/// \param block_id First block to pin
+/// \param count Number of blocks to pin
+/// \return Pointer to count * block size bytes of the first block, NULL on error
+///
+const void *block_store_pin_read(const block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if (block_store_pinnable(bs, block_id, count) == false || block_store_fault(bs, block_id, count) == false)
+	{
+		return NULL;
+	}
+
+	// pinning doesn't change the device, just our bookkeeping, which is why bs can be const
+	for (size_t i = block_id; i < block_id + count; i++)
+	{
+		block_store_pin_take(bs, i);
+	}
+	// a release may have freed a block between the check and the pin, if so the pins come back off
+	for (size_t i = block_id; i < block_id + count; i++)
+	{
+		if (block_store_in_use(bs, i) == false)
+		{
+			block_store_unpin(bs, block_id, count);
+			return NULL;
+		}
+	}
+
+	return bs->data + (block_id * bs->block_size);
+}
+
+///
+/// Pins a block, or a run of consecutive blocks, and returns a writable pointer straight into the device
+///  The bitmap's own blocks can only be pinned for reading
+/// \param bs BS device
+/// \param block_id First block to pin
+/// \param count Number of blocks to pin
+/// \return Pointer to count * block size bytes of the first block, NULL on error
+///
+void *block_store_pin_write(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	// writing the bitmap through a pointer would go around its summary
+	if (bs != NULL && block_id < bs->bitmap_start_block + bs->bitmap_num_blocks && block_id + count > bs->bitmap_start_block)
+	{
+		return NULL;
+	}
+
+	void *block = (void*)block_store_pin_read(bs, block_id, count);
+	if (block)
+	{
+		// the writes themselves happen behind our back, incremental serialize keeps pinned blocks dirty
+		block_store_data_changed(bs, block_id, count);
+		// and snapshots get their copies now, there's no telling when the writes will come
+		for (size_t chunk = block_id / bs->chunk_blocks; chunk <= (block_id + count - 1) / bs->chunk_blocks; chunk++)
+		{
+			block_store_write_begin(bs, chunk * bs->chunk_blocks, 1);
+			block_store_write_end(bs, chunk * bs->chunk_blocks, 1);
+		}
+	}
+	return block;
+}
+
+///
+/// Drops a pin taken by block_store_pin_read or block_store_pin_write
+/// \param bs BS device
+/// \param block_id First block that was pinned
+/// \param count Number of blocks that were pinned
+///
+void block_store_unpin(const block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if (bs == NULL || bs->pins == NULL || block_id >= bs->num_blocks || count > bs->num_blocks - block_id)
+	{
+		return;
+	}
+
+	for (size_t i = block_id; i < block_id + count; i++)
+	{
+		// only drop pins that are actually there, an extra unpin can't steal someone else's
+		// (a block held by a release has none)
+		uint32_t pins = __atomic_load_n(&bs->pins[i], __ATOMIC_ACQUIRE);
+		while ((pins & ~PIN_RELEASING) && !__atomic_compare_exchange_n(&bs->pins[i], &pins, pins - 1, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		{
+		}
+	}
+}
+
+// Shared by readv/writev: checks the whole batch, then moves runs of consecutive ids
+// between the arena and the buffers with as few memcpys as the buffers allow
+static size_t block_store_transfer(const block_store_t *const bs, const size_t *const block_ids, const size_t id_count, const struct iovec *const iov, const size_t iov_count, const bool toStore)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL || block_ids == NULL || id_count == 0 || iov == NULL || iov_count == 0
+		|| id_count > SIZE_MAX / bs->block_size)
+	{
+		return 0;
+	}
+
+	// all or nothing, so every block has to be good before we touch anything
+	const size_t bitmapEnd = bs->bitmap_start_block + bs->bitmap_num_blocks;
+	bool touchesBitmap = false;
+	for (size_t i = 0; i < id_count; i++)
+	{
+		if (block_ids[i] >= bs->num_blocks || block_store_in_use(bs, block_ids[i]) == false || block_store_fault(bs, block_ids[i], 1) == false)
+		{
+			return 0;
+		}
+		touchesBitmap |= block_ids[i] >= bs->bitmap_start_block && block_ids[i] < bitmapEnd;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	const size_t numBytesTotal = id_count * bs->block_size;
+	size_t bufferBytes = 0;
+	for (size_t i = 0; i < iov_count && bufferBytes < numBytesTotal; i++)
+	{
+		if (iov[i].iov_len && iov[i].iov_base == NULL)
+		{
+			return 0;
+		}
+		bufferBytes += iov[i].iov_len;
+	}
+	if (bufferBytes < numBytesTotal)
+	{
+		return 0;
+	}
+
+	size_t vec = 0;
+	size_t vecOffset = 0;
+	size_t i = 0;
+	while (i < id_count)
+	{
+		// grow the run as long as the ids are consecutive (and their stripes are all different)
+		size_t run = 1;
+		while (i + run < id_count && block_ids[i + run] == block_ids[i] + run
+			&& (block_ids[i] + run) / bs->chunk_blocks - block_ids[i] / bs->chunk_blocks < bs->seq_stripes)
+		{
+			run++;
+		}
+
+		// a read that a writer got into goes again from the same place in the buffers
+		const size_t runVec = vec;
+		const size_t runVecOffset = vecOffset;
+		uint64_t token = 0;
+		do
+		{
+			vec = runVec;
+			vecOffset = runVecOffset;
+			if (toStore)
+			{
+				block_store_write_begin(bs, block_ids[i], run);
+			}
+			else
+			{
+				token = block_store_read_begin(bs, block_ids[i], run);
+			}
+
+			uint8_t *block = bs->data + (block_ids[i] * bs->block_size);
+			size_t runBytes = run * bs->block_size;
+			while (runBytes)
+			{
+				size_t chunk = iov[vec].iov_len - vecOffset;
+				if (chunk > runBytes)
+				{
+					chunk = runBytes;
+				}
+				uint8_t *buffer = (uint8_t*)iov[vec].iov_base + vecOffset;
+				if (toStore)
+				{
+					memcpy(block, buffer, chunk);
+				}
+				else
+				{
+					memcpy(buffer, block, chunk);
+				}
+				block += chunk;
+				runBytes -= chunk;
+				vecOffset += chunk;
+				if (vecOffset == iov[vec].iov_len)
+				{
+					vec++;
+					vecOffset = 0;
+				}
+			}
+		} while (!toStore && block_store_read_retry(bs, block_ids[i], run, token));
+
+		if (toStore)
+		{
+			block_store_log_write(bs, block_ids[i], run);
+			block_store_write_end(bs, block_ids[i], run);
+			block_store_data_changed(bs, block_ids[i], run);
+		}
+		i += run;
+	}
+
+	// same as block_store_written, the overlay changed underneath the summary
+	if (toStore && touchesBitmap)
+	{
+		block_store_summarize(bs);
+	}
+
+	return block_store_stats_done(bs, toStore ? BLOCK_STORE_STAT_WRITE : BLOCK_STORE_STAT_READ, started, numBytesTotal);
+}
+
+///
+/// Reads the listed blocks, in order, into the buffers described by iov, in order
+///  Every block is checked before anything is copied, and runs of consecutive ids
+///  are copied with a single memcpy per buffer
+/// \param bs BS device
+/// \param block_ids Source block ids
+/// \param id_count Number of entries in block_ids
+/// \param iov Buffers to fill, together they must hold at least id_count blocks
+/// \param iov_count Number of entries in iov
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const size_t id_count, const struct iovec *const iov, const size_t iov_count)
+{
+	return block_store_transfer(bs, block_ids, id_count, iov, iov_count, false);
+}
+
+///
+/// Writes the buffers described by iov, in order, to the listed blocks, in order
+///  Every block is checked before anything is copied, and runs of consecutive ids
+///  are copied with a single memcpy per buffer
+/// \param bs BS device
+/// \param block_ids Destination block ids
+/// \param id_count Number of entries in block_ids
+/// \param iov Buffers to write, together they must hold at least id_count blocks
+/// \param iov_count Number of entries in iov
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const size_t id_count, const struct iovec *const iov, const size_t iov_count)
+{
+	return block_store_transfer(bs, block_ids, id_count, iov, iov_count, true);
+}
+
+///
+/// Takes a read-only snapshot of the device as it is now
+///  Nothing is copied up front except the bitmap: the snapshot shares the device's blocks, and
+///  a chunk of them is only copied for it the first time something writes to it afterwards
+///  The bitmap copy makes this O(num_blocks / 8) bytes of copying rather than constant time, since
+///  allocations change the bitmap with lock-free atomics that have no copy-on-write hook
+///  Writes through pointers pinned before the snapshot was taken may still show up in it
+/// \param bs BS device
+/// \return Pointer to the new snapshot, NULL on error
+///
+block_store_snapshot_t *block_store_snapshot(block_store_t *const bs)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL)
+	{
+		return NULL;
+	}
+
+	block_store_snapshot_t *snapshot = (block_store_snapshot_t*)calloc(1, sizeof(block_store_snapshot_t));
+	const size_t bytes = bitmap_get_bytes(bs->bitmap);
+	uint8_t *copy = (uint8_t*)malloc(bytes);
+	if (snapshot == NULL || copy == NULL)
+	{
+		free(snapshot);
+		free(copy);
+		return NULL;
+	}
+	// the bitmap's words are updated atomically, so they have to be read that way too
+	const uint8_t *live = bitmap_export(bs->bitmap);
+	for (size_t i = 0; i < bytes; i++)
+	{
+		copy[i] = __atomic_load_n(&live[i], __ATOMIC_RELAXED);
+	}
+	snapshot->bitmap = bitmap_import(bs->num_blocks, copy);
+	free(copy);
+	if (snapshot->bitmap == NULL)
+	{
+		free(snapshot);
+		return NULL;
+	}
+	// blocks sitting in magazines are free as far as anyone outside is concerned
+	// the copy is still the snapshot's own, so nothing else can be changing it
+	for (size_t i = bs->parked ? bitmap_next_set(bs->parked, 0) : SIZE_MAX; i != SIZE_MAX; i = bitmap_next_set(bs->parked, i + 1))
+	{
+		bitmap_reset(snapshot->bitmap, i);
+	}
+	snapshot->bs = bs;
+
+	pthread_mutex_lock(&bs->snapshot_lock);
+	snapshot->generation = bs->snapshot_gen + 1;
+	__atomic_store_n(&bs->snapshot_gen, snapshot->generation, __ATOMIC_SEQ_CST);
+	snapshot->older = bs->snapshots;
+	if (bs->snapshots)
+	{
+		bs->snapshots->newer = snapshot;
+	}
+	bs->snapshots = snapshot;
+	pthread_mutex_unlock(&bs->snapshot_lock);
+	return snapshot;
+}
+
+// Finds the preserved copy of a chunk as a snapshot saw it, the snapshot lock has to be held
+// It's in the snapshot itself, or the nearest newer one that has it; NULL means it's still the live device's
+static const uint8_t *block_store_snapshot_find(const block_store_snapshot_t *snapshot, const size_t chunk)
+{
+	for (; snapshot; snapshot = snapshot->newer)
+	{
+		const uint8_t *contents = block_store_snapshot_chunk(snapshot, chunk);
+		if (contents)
+		{
+			return contents;
+		}
+	}
+	return NULL;
+}
+
+// Copies blocks first to first + count - 1 (all in the same chunk) as the snapshot saw them
+// false if the snapshot is lost or the blocks couldn't be read in, in which case the buffer holds nothing useful
+static bool block_store_snapshot_copy(const block_store_snapshot_t *const snapshot, const size_t first, const size_t count, uint8_t *const buffer)
+{
+	block_store_t *const bs = snapshot->bs;
+	const size_t chunk = first / bs->chunk_blocks;
+	const size_t offset = (first % bs->chunk_blocks) * bs->block_size;
+
+	pthread_mutex_lock(&bs->snapshot_lock);
+	const uint8_t *contents = block_store_snapshot_find(snapshot, chunk);
+	if (contents == NULL)
+	{
+		// writers preserve under the snapshot lock while holding their stripes, so it can't be held across the read
+		pthread_mutex_unlock(&bs->snapshot_lock);
+		if (block_store_fault(bs, first, count) == false)
+		{
+			return false;
+		}
+		uint64_t token;
+		do
+		{
+			token = block_store_read_begin(bs, first, count);
+			memcpy(buffer, bs->data + (first * bs->block_size), count * bs->block_size);
+		} while (block_store_read_retry(bs, first, count, token));
+		pthread_mutex_lock(&bs->snapshot_lock);
+		// a write may have got in since we looked, but if it did, the chunk was preserved first
+		contents = block_store_snapshot_find(snapshot, chunk);
+	}
+	if (contents)
+	{
+		memcpy(buffer, contents + offset, count * bs->block_size);
+	}
+
+	// the bitmap's own blocks come from the snapshot's copy of it
+	const bool kept = snapshot->bitmap != NULL;
+	const size_t bitmap_bytes = kept ? bitmap_get_bytes(snapshot->bitmap) : 0;
+	for (size_t block = first; kept && block < first + count; block++)
+	{
+		if (block >= bs->bitmap_start_block && block < bs->bitmap_start_block + bs->bitmap_num_blocks)
+		{
+			const size_t from = (block - bs->bitmap_start_block) * bs->block_size;
+			const size_t copied = from >= bitmap_bytes ? 0 : (bitmap_bytes - from < bs->block_size ? bitmap_bytes - from : bs->block_size);
+			uint8_t *const to = buffer + (block - first) * bs->block_size;
+			memcpy(to, bitmap_export(snapshot->bitmap) + from, copied);
+			memset(to + copied, 0, bs->block_size - copied);
+		}
+	}
+	pthread_mutex_unlock(&bs->snapshot_lock);
+	return kept;
+}
+
+///
+/// Reads a block as it was when the snapshot was taken
+/// \param snapshot The snapshot
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error (including blocks that weren't allocated at the time)
+///
+size_t block_store_snapshot_read(const block_store_snapshot_t *const snapshot, const size_t block_id, void *buffer)
+{
+	if (snapshot == NULL || block_id >= snapshot->bs->num_blocks || buffer == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&snapshot->bs->snapshot_lock);
+	const bool allocated = snapshot->bitmap != NULL && bitmap_test(snapshot->bitmap, block_id);
+	pthread_mutex_unlock(&snapshot->bs->snapshot_lock);
+	if (allocated == false || block_store_snapshot_copy(snapshot, block_id, 1, (uint8_t*)buffer) == false)
+	{
+		return 0;
+	}
+	return snapshot->bs->block_size;
+}
+
+///
+/// Lets go of a snapshot, the chunks preserved for it go to the next older one if it still needs them
+///  Destroying the device releases any snapshots still held, so their handles go with it
+/// \param snapshot The snapshot
+///
+void block_store_snapshot_release(block_store_snapshot_t *const snapshot)
+{
+	if (snapshot == NULL)
+	{
+		return;
+	}
+	block_store_t *const bs = snapshot->bs;
+
+	pthread_mutex_lock(&bs->snapshot_lock);
+	for (size_t i = 0; i < snapshot->chunk_capacity; i++)
+	{
+		// the older snapshot was reading this one's copy, unless it has its own (from an earlier write)
+		if (snapshot->chunks[i] == NULL || snapshot->older == NULL || block_store_snapshot_chunk(snapshot->older, snapshot->chunk_ids[i]))
+		{
+			free(snapshot->chunks[i]);
+		}
+		else if (block_store_snapshot_keep(snapshot->older, snapshot->chunk_ids[i], snapshot->chunks[i]) == false)
+		{
+			// it would read the wrong data from here on, so it's lost
+			free(snapshot->chunks[i]);
+			bitmap_destroy(snapshot->older->bitmap);
+			snapshot->older->bitmap = NULL;
+		}
+	}
+
+	if (snapshot->older)
+	{
+		snapshot->older->newer = snapshot->newer;
+	}
+	if (snapshot->newer)
+	{
+		snapshot->newer->older = snapshot->older;
+	}
+	else
+	{
+		bs->snapshots = snapshot->older;
+	}
+	pthread_mutex_unlock(&bs->snapshot_lock);
+
+	bitmap_destroy(snapshot->bitmap);
+	free(snapshot->chunk_ids);
+	free(snapshot->chunks);
+	free(snapshot);
+}
+
+///
+/// Opens an image file as a BS device by mapping it into memory
+///  Blocks are only read from the file when they're first touched, and changes go back
+///  to the file on their own, block_store_sync forces them out
+/// \param filename The image to map
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_open_mmap(const char *const filename)
+{
+	return block_store_open_mmap_ex(filename, BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+///
+/// Opens an image file with the given geometry as a BS device by mapping it into memory
+/// \param filename The image to map
+/// \param num_blocks Total number of blocks the image was created with
+/// \param block_size Number of bytes per block the image was created with
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_open_mmap_ex(const char *const filename, const size_t num_blocks, const size_t block_size)
+{
+	if (filename == NULL)
+	{
+		return NULL;
+	}
+
+	block_store_t* bs = block_store_alloc(num_blocks, block_size);
+	if (bs == NULL)
+	{
+		return NULL;
+	}
+
+	int fd = open(filename, O_RDWR);
+	if (fd == -1)
+	{
+		perror("Error opening file for mapping");
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	// the image has to be exactly the device, a short file would SIGBUS on the missing pages
+	const size_t numBytesTotal = num_blocks * block_size;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != numBytesTotal)
+	{
+		close(fd);
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	void *mapping = mmap(NULL, numBytesTotal, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps its own reference to the file
+	if (mapping == MAP_FAILED)
+	{
+		perror("Error mapping file");
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bs->data = (uint8_t*)mapping;
+	bs->mapped = true;
+
+	// the bitmap is already in the image, so only its pages get read here
+	if (block_store_attach_bitmap(bs) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+///
+/// Opens an image file with the given geometry as a BS device that keeps only some of its blocks in memory
+///  Blocks stay in the file and go through a cache of cache_blocks frames (CLOCK replacement), and
+///  writes only go back to the file when their frame is evicted, on block_store_sync, or on destroy
+///  The bitmap's own blocks are always in memory
+///  The calls that need the whole device in memory (pins, vectored I/O, snapshots, checkpoints,
+///  serialize and logging) fail on a cached device
+/// \param filename The image to open
+/// \param num_blocks Total number of blocks the image was created with
+/// \param block_size Number of bytes per block the image was created with
+/// \param cache_blocks Most blocks to keep in memory at once, besides the bitmap's
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_open_cached(const char *const filename, const size_t num_blocks, const size_t block_size, const size_t cache_blocks)
+{
+	if (filename == NULL || cache_blocks == 0)
+	{
+		return NULL;
+	}
+
+	block_store_t* bs = block_store_alloc(num_blocks, block_size);
+	if (bs == NULL)
+	{
+		return NULL;
+	}
+
+	int fd = open(filename, O_RDWR);
+	if (fd == -1)
+	{
+		perror("Error opening file");
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	const size_t numBytesTotal = num_blocks * block_size;
+	struct stat st;
+	const size_t bitmapBytes = bs->bitmap_num_blocks * block_size;
+	bs->resident = (uint8_t*)malloc(bitmapBytes);
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != numBytesTotal || bs->resident == NULL
+		|| pread(fd, bs->resident, bitmapBytes, (off_t)(bs->bitmap_start_block * block_size)) != (ssize_t)bitmapBytes)
+	{
+		close(fd);
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	bs->cache = block_cache_create(fd, block_size, cache_blocks);
+	if (bs->cache == NULL)
+	{
+		close(fd);
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bs->fd = fd;
+
+	if (block_store_attach_bitmap(bs) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+///
+/// Reports how a cached device's cache has been doing since it was opened
+/// \param bs BS device
+/// \param stats Receives the counts
+/// \return true on success, false on error or if the device isn't cached
+///
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats)
+{
+	if (bs == NULL || bs->cache == NULL || stats == NULL)
+	{
+		return false;
+	}
+	return block_cache_stats(bs->cache, &stats->hits, &stats->misses, &stats->evictions, &stats->writebacks);
+}
+
+// Where the log is up to, if filename is the image it's on top of (0 otherwise)
+// Everything logged before this point is in memory already, so an image written after it includes it
+static uint64_t block_store_wal_position(const block_store_t *const bs, const char *const filename)
+{
+	return bs->wal && strcmp(filename, bs->wal_image) == 0 ? wal_position(bs->wal) : 0;
+}
+
+// Called once an image is written, before its file is closed
+// If the log is on top of this image, the image has to be on disk before the log can let go of what it covers
+static bool block_store_image_written(const block_store_t *const bs, const char *const filename, const int fd, const uint64_t logged)
+{
+	if (bs->wal == NULL || strcmp(filename, bs->wal_image) != 0)
+	{
+		return true;
+	}
+	if (fsync(fd) != 0)
+	{
+		perror("Error syncing the file");
+		return false;
+	}
+	return wal_truncate(bs->wal, logged);
+}
+
+///
+/// Flushes changes to a file-backed BS device out to its file
+/// \param bs BS device
+/// \return true once everything is on disk, false on error or if the device isn't file-backed
+///
+bool block_store_sync(const block_store_t *const bs)
+{
+	if (bs == NULL || (bs->mapped == false && bs->cache == NULL))
+	{
+		return false;
+	}
+
+	// parked blocks are free, the image shouldn't say otherwise
+	block_store_drain_magazines((block_store_t*)bs);
+
+	if (bs->cache)
+	{
+		// the bitmap's words change atomically, so they're copied out that way rather than written straight from under the allocators
+		const size_t bytes = bs->bitmap_num_blocks * bs->block_size;
+		uint8_t *bitmap = (uint8_t*)malloc(bytes);
+		if (bitmap == NULL)
+		{
+			return false;
+		}
+		for (size_t i = 0; i < bytes; i++)
+		{
+			bitmap[i] = __atomic_load_n(&bs->resident[i], __ATOMIC_RELAXED);
+		}
+		bool ok = block_cache_flush(bs->cache);
+		for (size_t done = 0; ok && done < bytes;)
+		{
+			ssize_t bytesWritten = pwrite(bs->fd, bitmap + done, bytes - done, (off_t)(bs->bitmap_start_block * bs->block_size + done));
+			if (bytesWritten <= 0)
+			{
+				perror("Error writing to file");
+				ok = false;
+			}
+			else
+			{
+				done += bytesWritten;
+			}
+		}
+		free(bitmap);
+		if (ok && fsync(bs->fd) != 0)
+		{
+			perror("Error syncing the file");
+			ok = false;
+		}
+		return ok;
+	}
+
+	if (msync(bs->data, bs->num_blocks * bs->block_size, MS_SYNC) != 0)
+	{
+		perror("Error syncing mapped file");
+		return false;
+	}
+	return true;
+}
+
+///
+/// Writes only the blocks that changed since the image was last written or read
+///  into an existing image of the same geometry, one write per run of changed blocks
+/// \param bs BS device
+/// \param filename The image to update, it must already exist and be the full size of the device
+/// \return Number of bytes written (0 if nothing changed), SIZE_MAX on error
+///
+size_t block_store_serialize_incremental(const block_store_t *const bs, const char *const filename)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL || filename == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	block_store_drain_magazines((block_store_t*)bs);
+	const uint64_t logged = block_store_wal_position(bs, filename);
+
+	int fd = open(filename, O_WRONLY);
+	if (fd == -1)
+	{
+		perror("Error opening file for incremental write");
+		return SIZE_MAX;
+	}
+
+	// anything else isn't an image of this device, only a full serialize can fix that
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != bs->num_blocks * bs->block_size)
+	{
+		close(fd);
+		return SIZE_MAX;
+	}
+
+	size_t numBytesWritten = 0;
+	for (size_t block = bitmap_next_set(bs->dirty, 0); block != SIZE_MAX; block = bitmap_next_set(bs->dirty, block))
+	{
+		// coalesce the run of dirty blocks into one write
+		const size_t end = bitmap_next_clear(bs->dirty, block);
+		const size_t run = (end == SIZE_MAX ? bs->num_blocks : end) - block;
+
+		// clear the bits before copying, so a write that lands while we copy marks the block again
+		// pinned blocks can still be written through their pointers, so they stay dirty
+		for (size_t i = block; i < block + run; i++)
+		{
+			if (__atomic_load_n(&bs->pins[i], __ATOMIC_ACQUIRE) == 0)
+			{
+				bitmap_test_and_reset(bs->dirty, i);
+			}
+		}
+
+		const size_t runBytes = run * bs->block_size;
+		const size_t offset = block * bs->block_size;
+		size_t done = 0;
+		while (done < runBytes)
+		{
+			ssize_t bytesWritten = pwrite(fd, bs->data + offset + done, runBytes - done, offset + done);
+			if (bytesWritten <= 0)
+			{
+				perror("Error writing to file");
+				block_store_data_changed(bs, block, run);
+				close(fd);
+				return SIZE_MAX;
+			}
+			done += bytesWritten;
+		}
+		numBytesWritten += runBytes;
+		block += run;
+	}
+
+	if (block_store_image_written(bs, filename, fd, logged) == false)
+	{
+		close(fd);
+		return SIZE_MAX;
+	}
+	if (close(fd) != 0)
+	{
+		perror("Error closing the file");
+		return SIZE_MAX;
+	}
+	return block_store_stats_done(bs, BLOCK_STORE_STAT_SERIALIZE, started, numBytesWritten);
+}
+
+///
+/// Writes only the allocated blocks of the BS device to file, overwriting it if it exists
+///  The file is still a full image of the device, but free blocks are left as holes,
+///  so the write (and, on most file systems, the space taken) scales with the blocks in use
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_serialize_sparse(const block_store_t *const bs, const char *const filename)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL || filename == NULL)
+	{
+		return 0;
+	}
+
+	const uint64_t started = block_store_stats_clock(bs);
+	block_store_drain_magazines((block_store_t*)bs);
+	// a lazily deserialized device has to finish reading its image before it can write one
+	if (block_store_fault(bs, 0, bs->num_blocks) == false)
+	{
+		return 0;
+	}
+	const uint64_t logged = block_store_wal_position(bs, filename);
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+	{
+		perror("Error opening file for writing");
+		return 0;
+	}
+
+	// the file starts out as one big hole, and reads of a hole come back as zeros
+	if (ftruncate(fd, (off_t)(bs->num_blocks * bs->block_size)) != 0)
+	{
+		perror("Error sizing the file");
+		close(fd);
+		return 0;
+	}
+
+	size_t numBytesWritten = 0;
+	for (size_t block = bitmap_next_set(bs->bitmap, 0); block != SIZE_MAX; block = bitmap_next_set(bs->bitmap, block))
+	{
+		// coalesce the run of allocated blocks into one write
+		const size_t end = bitmap_next_clear(bs->bitmap, block);
+		const size_t run = (end == SIZE_MAX ? bs->num_blocks : end) - block;
+
+		const size_t runBytes = run * bs->block_size;
+		const size_t offset = block * bs->block_size;
+		size_t done = 0;
+		while (done < runBytes)
+		{
+			ssize_t bytesWritten = pwrite(fd, bs->data + offset + done, runBytes - done, offset + done);
+			if (bytesWritten <= 0)
+			{
+				perror("Error writing to file");
+				close(fd);
+				return 0;
+			}
+			done += bytesWritten;
+		}
+		numBytesWritten += runBytes;
+		block += run;
+	}
+
+	if (block_store_image_written(bs, filename, fd, logged) == false)
+	{
+		close(fd);
+		return 0;
+	}
+	if (close(fd) != 0)
+	{
+		perror("Error closing the file");
+		return 0;
+	}
+	bitmap_format(bs->dirty, 0x00); // the image is now the device
+	return block_store_stats_done(bs, BLOCK_STORE_STAT_SERIALIZE, started, numBytesWritten);
+}
+
+///
+/// Starts logging every write and allocation change to "<filename>.wal", on top of a fresh image in filename
+///  Deserializing the image replays whatever made it into the log, writes it into the image and removes the log,
+///  serializing to it again trims the log
+///  Writes through pinned pointers aren't logged
+///  Must be called before the device is shared between threads
+/// \param bs BS device
+/// \param filename The image, it's (re)written here
+/// \return true on success, false on error or if the device already has a log
+///
+bool block_store_enable_wal(block_store_t *const bs, const char *const filename)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL || filename == NULL || bs->wal != NULL)
+	{
+		return false;
+	}
+
+	char *logname = (char*)malloc(strlen(filename) + sizeof(WAL_SUFFIX));
+	bs->wal_image = strdup(filename);
+	if (logname == NULL || bs->wal_image == NULL)
+	{
+		free(logname);
+		free(bs->wal_image);
+		bs->wal_image = NULL;
+		return false;
+	}
+	strcpy(logname, filename);
+	strcat(logname, WAL_SUFFIX);
+
+	// empty the log before writing the image, an old log replayed over a new image would undo it
+	const block_store_wal_header_t header = {"BSWAL01", bs->num_blocks, bs->block_size};
+	wal_t *wal = wal_create(logname, &header, sizeof(header));
+	free(logname);
+	if (wal == NULL || block_store_serialize(bs, filename) == 0)
+	{
+		wal_destroy(wal);
+		free(bs->wal_image);
+		bs->wal_image = NULL;
+		return false;
+	}
+
+	bs->wal = wal;
+	return true;
+}
+
+///
+/// Makes everything logged so far durable
+///  Concurrent commits are grouped, one fsync covers everyone who was waiting for it
+/// \param bs BS device
+/// \return true once it's all on disk, false on error or if the device has no log
+///
+bool block_store_commit(block_store_t *const bs)
+{
+	if (bs == NULL || bs->wal == NULL)
+	{
+		return false;
+	}
+	return wal_commit(bs->wal, 0);
+}
+
+///
+/// Reports what the device's log has done since it was enabled
+/// \param bs BS device
+/// \param stats Receives the counts
+/// \return true on success, false on error or if the device has no log
+///
+bool block_store_get_wal_stats(const block_store_t *const bs, block_store_wal_stats_t *const stats)
+{
+	if (bs == NULL || bs->wal == NULL || stats == NULL)
+	{
+		return false;
+	}
+	return wal_stats(bs->wal, &stats->records, &stats->bytes, &stats->commits, &stats->syncs);
+}
+
+///
+/// Starts collecting counters and latency histograms for the device, until then they cost one test per call
+///  The counters are updated without locks, so threads don't wait on each other to count
+///  Must be called before the device is shared between threads
+/// \param bs BS device
+/// \return true on success, false on error or if stats were already enabled
+///
+bool block_store_enable_stats(block_store_t *const bs)
+{
+	if (bs == NULL || bs->stats != NULL)
+	{
+		return false;
+	}
+
+	bs->stats = (block_store_stats_t*)calloc(1, sizeof(block_store_stats_t));
+	return bs->stats != NULL;
+}
+
+// The stats are nothing but uint64_t counters, so they can be copied and cleared one counter at a time
+#define STATS_COUNTERS (sizeof(block_store_stats_t) / sizeof(uint64_t))
+
+///
+/// Copies out the device's stats, each counter is read atomically but they aren't read all at once
+/// \param bs BS device
+/// \param stats Receives the stats
+/// \return true on success, false on error or if stats aren't enabled
+///
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats)
+{
+	if (bs == NULL || bs->stats == NULL || stats == NULL)
+	{
+		return false;
+	}
+
+	const uint64_t *from = (const uint64_t*)bs->stats;
+	uint64_t *to = (uint64_t*)stats;
+	for (size_t i = 0; i < STATS_COUNTERS; i++)
+	{
+		to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+	}
+	return true;
+}
+
+///
+/// Zeroes the device's stats, they keep being collected
+/// \param bs BS device
+///
+void block_store_reset_stats(block_store_t *const bs)
+{
+	if (bs == NULL || bs->stats == NULL)
+	{
+		return;
+	}
+
+	uint64_t *counters = (uint64_t*)bs->stats;
+	for (size_t i = 0; i < STATS_COUNTERS; i++)
+	{
+		__atomic_store_n(counters + i, 0, __ATOMIC_RELAXED);
+	}
+}
+
+// Whether any of blocks first to first + count - 1 were allocated when the snapshot was taken
+// A lost snapshot says yes, so block_store_snapshot_copy gets to report it
+static bool block_store_snapshot_allocated(const block_store_snapshot_t *const snapshot, const size_t first, const size_t count)
+{
+	pthread_mutex_lock(&snapshot->bs->snapshot_lock);
+	const bool allocated = snapshot->bitmap == NULL || bitmap_next_set(snapshot->bitmap, first) < first + count;
+	pthread_mutex_unlock(&snapshot->bs->snapshot_lock);
+	return allocated;
+}
+
+// Streams a checkpoint's snapshot out a chunk at a time, the device is free to change underneath it
+static void *block_store_checkpoint_run(void *arg)
+{
+	block_store_checkpoint_t *const checkpoint = (block_store_checkpoint_t*)arg;
+	const block_store_snapshot_t *const snapshot = checkpoint->snapshot;
+	const block_store_t *const bs = snapshot->bs;
+	size_t result = 0;
+
+	uint8_t *buffer = (uint8_t*)malloc(bs->chunk_blocks * bs->block_size);
+	int fd = open(checkpoint->temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (buffer == NULL || fd == -1)
+	{
+		perror("Error opening file for writing");
+	}
+	else
+	{
+		// chunks with nothing allocated in them are left as holes, like block_store_serialize_sparse does
+		bool ok = ftruncate(fd, (off_t)checkpoint->total) == 0;
+		for (size_t chunk = 0; ok && chunk < bs->chunk_count; chunk++)
+		{
+			const size_t first = chunk * bs->chunk_blocks;
+			const size_t bytes = block_store_chunk_bytes(bs, chunk);
+			if (block_store_snapshot_allocated(snapshot, first, bytes / bs->block_size) == false)
+			{
+				__atomic_fetch_add(&checkpoint->written, bytes, __ATOMIC_RELAXED);
+				continue;
+			}
+			ok = block_store_snapshot_copy(snapshot, first, bytes / bs->block_size, buffer);
+			for (size_t done = 0; ok && done < bytes;)
+			{
+				ssize_t bytesWritten = pwrite(fd, buffer + done, bytes - done, (off_t)(first * bs->block_size + done));
+				if (bytesWritten <= 0)
+				{
+					perror("Error writing to file");
+					ok = false;
+					break;
+				}
+				done += bytesWritten;
+				__atomic_fetch_add(&checkpoint->written, (size_t)bytesWritten, __ATOMIC_RELAXED);
+			}
+		}
+
+		// the image has to be on disk before it replaces the old one, and the old one before the log can let go
+		if (ok && fsync(fd) != 0)
+		{
+			perror("Error syncing the file");
+			ok = false;
+		}
+		if (ok && rename(checkpoint->temporary, checkpoint->filename) != 0)
+		{
+			perror("Error renaming the file");
+			ok = false;
+		}
+		// and so does the rename, or a crash could bring the old image back after the log let go of what it lacks
+		if (ok && wal_sync_directory(checkpoint->filename) == false)
+		{
+			ok = false;
+		}
+		if (ok && block_store_image_written(bs, checkpoint->filename, fd, checkpoint->logged) == false)
+		{
+			ok = false;
+		}
+		if (close(fd) != 0)
+		{
+			perror("Error closing the file");
+			ok = false;
+		}
+		if (ok == false)
+		{
+			unlink(checkpoint->temporary);
+		}
+		result = ok ? checkpoint->total : 0;
+	}
+	free(buffer);
+
+	checkpoint->result = result;
+	__atomic_store_n(&checkpoint->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+///
+/// Starts writing the entirety of the BS device to file in the background, overwriting it if it exists
+///  The image is of the device as it was when this was called: it works from a snapshot, so
+///  the device stays fully usable (writes included) while the checkpoint runs
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Pointer to the running checkpoint, NULL on error
+///
+block_store_checkpoint_t *block_store_checkpoint_start(block_store_t *const bs, const char *const filename)
+{
+	if (bs == NULL || bs->bitmap == NULL || bs->data == NULL || filename == NULL)
+	{
+		return NULL;
+	}
+
+	block_store_checkpoint_t *checkpoint = (block_store_checkpoint_t*)calloc(1, sizeof(block_store_checkpoint_t));
+	if (checkpoint == NULL)
+	{
+		return NULL;
+	}
+	checkpoint->filename = strdup(filename);
+	checkpoint->temporary = (char*)malloc(strlen(filename) + sizeof(CHECKPOINT_SUFFIX));
+	if (checkpoint->filename == NULL || checkpoint->temporary == NULL)
+	{
+		free(checkpoint->filename);
+		free(checkpoint->temporary);
+		free(checkpoint);
+		return NULL;
+	}
+	strcpy(checkpoint->temporary, filename);
+	strcat(checkpoint->temporary, CHECKPOINT_SUFFIX);
+	checkpoint->total = bs->num_blocks * bs->block_size;
+
+	// everything logged before the snapshot is in it, so the log can drop it once the image is down
+	checkpoint->logged = block_store_wal_position(bs, filename);
+	checkpoint->snapshot = block_store_snapshot(bs);
+	if (checkpoint->snapshot == NULL || pthread_create(&checkpoint->thread, NULL, block_store_checkpoint_run, checkpoint) != 0)
+	{
+		block_store_snapshot_release(checkpoint->snapshot);
+		free(checkpoint->filename);
+		free(checkpoint->temporary);
+		free(checkpoint);
+		return NULL;
+	}
+	return checkpoint;
+}
+
+///
+/// Reports how far along a background checkpoint is
+/// \param checkpoint The checkpoint
+/// \param written Receives the number of bytes of the image done so far (holes left for free blocks count too), may be NULL
+/// \param total Receives the number of bytes the image will have, may be NULL
+/// \return true once the checkpoint has finished (see block_store_checkpoint_wait for how it went), false otherwise
+///
+bool block_store_checkpoint_progress(const block_store_checkpoint_t *const checkpoint, size_t *const written, size_t *const total)
+{
+	if (checkpoint == NULL)
+	{
+		return false;
+	}
+	if (written)
+	{
+		*written = __atomic_load_n(&checkpoint->written, __ATOMIC_RELAXED);
+	}
+	if (total)
+	{
+		*total = checkpoint->total;
+	}
+	return __atomic_load_n(&checkpoint->done, __ATOMIC_ACQUIRE);
+}
+
+///
+/// Waits for a background checkpoint to finish and frees it
+///  Every checkpoint has to be waited for, and before its device is destroyed
+/// \param checkpoint The checkpoint
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_checkpoint_wait(block_store_checkpoint_t *const checkpoint)
+{
+	if (checkpoint == NULL)
+	{
+		return 0;
+	}
+
+	pthread_join(checkpoint->thread, NULL);
+	const size_t result = checkpoint->result;
+	block_store_snapshot_release(checkpoint->snapshot);
+	free(checkpoint->filename);
+	free(checkpoint->temporary);
+	free(checkpoint);
+	return result;
+}
+
+// Reads blocks first to first + count - 1 of an image straight into the data arena
+static bool block_store_read_image(block_store_t *const bs, const int fd, const size_t first, const size_t count)
+{
+	const size_t bytes = count * bs->block_size;
+	const size_t offset = first * bs->block_size;
+	size_t done = 0;
+	while (done < bytes)
+	{
+		ssize_t bytesRead = pread(fd, bs->data + offset + done, bytes - done, (off_t)(offset + done));
+		if (bytesRead <= 0) // EOF or read failed, either way we're done
+		{
+			return false;
+		}
+		done += bytesRead;
+	}
+	return true;
+}
+
+// Applies one record of a log to a device that was just read from the log's image
+static void block_store_replay(void *context, const uint32_t type, const uint64_t first, const uint64_t count, const void *payload, const size_t size)
+{
+	block_store_t *const bs = (block_store_t*)context;
+	if (first >= bs->num_blocks || count > bs->num_blocks - first)
+	{
+		return;
+	}
+
+	switch (type)
+	{
+		case WAL_WRITE:
+			if (size == count * bs->block_size && block_store_fault(bs, first, count))
+			{
+				memcpy(bs->data + (first * bs->block_size), payload, size);
+				block_store_data_changed(bs, first, count);
+			}
+			break;
+		case WAL_ALLOCATE:
+		case WAL_RELEASE:
+			if (type == WAL_ALLOCATE)
+			{
+				bitmap_set_range(bs->bitmap, first, count);
+			}
+			else
+			{
+				bitmap_reset_range(bs->bitmap, first, count);
+			}
+			// the count is rebuilt once the whole log is in
+			block_store_allocation_logged(bs, first, count, type == WAL_ALLOCATE);
+			break;
+		case WAL_ALLOCATE_MANY:
+		case WAL_RELEASE_MANY:
+		{
+			const size_t *const block_ids = (const size_t*)payload;
+			if (size != count * sizeof(size_t))
+			{
+				break;
+			}
+			for (size_t i = 0; i < count; i++)
+			{
+				if (block_ids[i] >= bs->num_blocks)
+				{
+					return;
+				}
+			}
+			if (type == WAL_ALLOCATE_MANY)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					bitmap_test_and_set(bs->bitmap, block_ids[i]);
+				}
+			}
+			else
+			{
+				bitmap_reset_many(bs->bitmap, block_ids, count, NULL);
+			}
+			block_store_allocation_listed(bs, block_ids, count, type == WAL_ALLOCATE_MANY);
+			break;
+		}
+	}
+}
+
+// Replays "<filename>.wal" onto a device that was just read from filename, then brings the bitmap summary up to date
+// (the image went straight into the overlay, so the summary is stale either way)
+// A log that was replayed is folded into the image and removed: the loaded device doesn't log, so nothing would
+// ever trim it, and the next deserialize would replay it over whatever got serialized to the image since
+static bool block_store_replay_log(block_store_t *const bs, const char *const filename)
+{
+	char *logname = (char*)malloc(strlen(filename) + sizeof(WAL_SUFFIX));
+	if (logname == NULL)
+	{
+		return false;
+	}
+	strcpy(logname, filename);
+	strcat(logname, WAL_SUFFIX);
+	const block_store_wal_header_t header = {"BSWAL01", bs->num_blocks, bs->block_size};
+	const size_t replayed = wal_replay(logname, &header, sizeof(header), block_store_replay, bs);
+
+	bool ok = block_store_summarize(bs);
+	if (ok && replayed != SIZE_MAX)
+	{
+		// the replayed changes are exactly the dirty blocks, and they have to be on disk before the log goes
+		ok = block_store_serialize_incremental(bs, filename) != SIZE_MAX;
+		int fd = ok ? open(filename, O_WRONLY) : -1;
+		if (ok && (fd == -1 || fsync(fd) != 0))
+		{
+			perror("Error syncing the file");
+			ok = false;
+		}
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		if (ok && unlink(logname) != 0)
+		{
+			perror("Error removing the log");
+			ok = false;
+		}
+	}
+	free(logname);
+	return ok;
+}
+
+// Reads in the rest of a lazily deserialized device, a chunk at a time, until it's all there or destroy says stop
+static void *block_store_prefetch(void *arg)
+{
+	const block_store_t *const bs = (const block_store_t*)arg;
+	for (size_t chunk = 0; chunk < bs->chunk_count && __atomic_load_n(&bs->stop_prefetch, __ATOMIC_RELAXED) == false; chunk++)
+	{
+		if (block_store_fault(bs, chunk * bs->chunk_blocks, 1) == false)
+		{
+			break;  // whoever needs the chunk will see the error for themselves
+		}
+	}
+	return NULL;
+}
+
+///
+/// Imports BS device with the given geometry from the given file, without reading in its data blocks up front
+///  Only the bitmap is read before this returns; every other block is read from the file the first time
+///  something needs it (or sooner, by a background thread, if prefetch is set). The file has to stay put
+///  until the device is destroyed, and changes to the device don't go back to it
+/// \param filename The file to load
+/// \param num_blocks Total number of blocks the image was created with
+/// \param block_size Number of bytes per block the image was created with
+/// \param prefetch Whether to read in the rest of the image in the background
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_lazy(const char *const filename, const size_t num_blocks, const size_t block_size, const bool prefetch)
+{
+	if (filename == NULL)
+	{
+		return NULL;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+	{
+		perror("Error opening file for reading");
+		return NULL;
+	}
+
+	block_store_t* bs = block_store_create_ex(num_blocks, block_size);
+	struct stat st;
+	if (bs == NULL || fstat(fd, &st) != 0 || (size_t)st.st_size != num_blocks * block_size)
+	{
+		close(fd);
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bs->loaded = (uint8_t*)calloc(bs->chunk_count, sizeof(uint8_t));
+	if (bs->loaded == NULL)
+	{
+		close(fd);
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bs->fd = fd;
+
+	// the bitmap is the only thing needed right away
+	if (block_store_fault(bs, bs->bitmap_start_block, bs->bitmap_num_blocks) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	// the device now matches the image
+	bitmap_format(bs->dirty, 0x00);
+	if (block_store_replay_log(bs, filename) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	if (prefetch)
+	{
+		if (pthread_create(&bs->prefetcher, NULL, block_store_prefetch, bs) != 0)
+		{
+			block_store_destroy(bs);
+			return NULL;
+		}
+		bs->prefetching = true;
+	}
+	return bs;
+}
+
+/*
+
+Implementation Guidelines for block_store_deserialize
+
+block_store_deserialize(const char *const filename): This function deserializes a block store 
+from a file. It returns a pointer to the resulting block_store_t struct.
+
+*/
+
+///
+/// Imports BS device from the given file - for grads/bonus
+/// \param filename The file to load
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize(const char *const filename)
+{
+	return block_store_deserialize_ex(filename, BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+///
+/// Imports BS device with the given geometry from the given file
+/// \param filename The file to load
+/// \param num_blocks Total number of blocks the image was created with
+/// \param block_size Number of bytes per block the image was created with
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t num_blocks, const size_t block_size)
+{
+	if (filename == NULL) // check for invalid parameters
+    {
+        return NULL;
+    }
+
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) // if open failed
+    {
+		perror("Error opening file for reading");
+        return NULL;
+    }
+
+	block_store_t* bs = block_store_create_ex(num_blocks, block_size);
+	if (bs == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	// the image has to be the whole device, anything shorter (or longer) is something else
+	size_t numBytesTotal = bs->num_blocks * bs->block_size;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size == numBytesTotal;
+
+	// only the blocks in use are worth reading: the bitmap's own blocks first, then every run of allocated ones
+	// (free blocks stay zeroed, which is also what a hole in a sparse image holds)
+	ok = ok && block_store_read_image(bs, fd, bs->bitmap_start_block, bs->bitmap_num_blocks);
+	// the read went straight into the overlay, the summary has to catch up before it can skip anything
+	ok = ok && block_store_summarize(bs);
+	for (size_t block = bitmap_next_set(bs->bitmap, 0); ok && block != SIZE_MAX; block = bitmap_next_set(bs->bitmap, block))
+	{
+		size_t end = bitmap_next_clear(bs->bitmap, block);
+		end = end == SIZE_MAX ? bs->num_blocks : end;
+		// the bitmap's own blocks are in already
+		if (block < bs->bitmap_start_block && end > bs->bitmap_start_block)
+		{
+			end = bs->bitmap_start_block;
+		}
+		if (block_store_is_bitmap(bs, block) == false)
+		{
+			ok = block_store_read_image(bs, fd, block, end - block);
+		}
+		else
+		{
+			end = bs->bitmap_start_block + bs->bitmap_num_blocks;
+		}
+		block = end;
+	}
+
+	if (close(fd) != 0) // ensures all data is read before checking if the read was successful
+	{
+		perror("Error closing the file");
+		block_store_destroy(bs);
+        return NULL;
+	}
+	
+	// deserializing is only successful if every block in use was read
+    if (ok == false)
+    {
+		perror("Error reading from file"); // we didn't read the entire block store from the file, deserializing is only successful if we read the entire block store
+		block_store_destroy(bs);
+        return NULL;
+    }
+	// the device now matches the image
+	bitmap_format(bs->dirty, 0x00);
+
+	// then whatever made it into the log goes on top (and is dirty, as far as the image is concerned)
+	if (block_store_replay_log(bs, filename) == false)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	//else statement not required
+    return bs;
+}
+
+/*
+
+Implementation Guidelines for block_store_serialize
+
+block_store_serialize(const block_store_t *const bs, const char *const filename): This function serializes 
+a block store to a file. It returns the size of the resulting file in bytes. 
+
+Note: If a test case 
+expects a specific number of bytes to be written but your file is smaller, pad the rest of the file 
+with zeros until the file is of the expected size. Modify your block_store_deserialize function accordingly 
+to accept padding if present.
+
+*/
+
+///
+/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+	if (bs == NULL || bs->bitmap  == NULL|| bs->data == NULL || filename == NULL) // check for invalid parameters
+    {
+        return 0;
+    }
+
+	const uint64_t started = block_store_stats_clock(bs);
+	block_store_drain_magazines((block_store_t*)bs);
+	if (block_store_fault(bs, 0, bs->num_blocks) == false)
+	{
+		return 0;
+	}
+	const uint64_t logged = block_store_wal_position(bs, filename);
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666); // need comment here
+    
+	if (fd == -1) // if open failed
+    {
+		perror("Error opening file for writing");
+        return 0;
+    }
+	
+    // looping structure is more robust than using write() of for the whole block_store
+    size_t numBytesTotal = bs->num_blocks * bs->block_size;
+    size_t numBytesWritten = 0;
+	while(numBytesWritten < numBytesTotal){
+		ssize_t bytesWritten = write(fd, bs->data + numBytesWritten, numBytesTotal - numBytesWritten);
+		if(bytesWritten <= 0){ //Check for write failed
+			perror("Error writing to file");
+			close(fd);
+			return 0;
+		}
+		numBytesWritten += bytesWritten;
+	}
+	// writing the full bs->data array already covers the padding issue described above, padding not implemented here
+
+	if (numBytesWritten == numBytesTotal && block_store_image_written(bs, filename, fd, logged) == false)
+	{
+		close(fd);
+		return 0;
+	}
+	if (close(fd) != 0) // ensures all data is written before checking if the write was successful
+	{
+		perror("Error closing the file");
+        return 0;
+	}
+
+	// serialize is only successful if the entire block store was written
+    if (numBytesWritten != numBytesTotal)
+    {
+		perror("Error writing to file"); // we didn't write the entire block store, serializing is only successful if we read the entire block store
+        return 0;
+    }
+    else
+    {
+        bitmap_format(bs->dirty, 0x00); // the image is now the device
+        return block_store_stats_done(bs, BLOCK_STORE_STAT_SERIALIZE, started, numBytesWritten); // This should always be the full device size since we are assuming serialize is only successful if the entire block store was written
+	}
+}
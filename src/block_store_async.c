@@ -0,0 +1,333 @@
+#include <pthread.h>
+#include <stdint.h>
+#include "block_store_async.h"
+
+// Most ops a worker takes off the submission queue at once
+#define ASYNC_BATCH 32
+
+struct block_store_async {
+	block_store_t *bs;
+
+	pthread_mutex_t lock;       // Guards everything below
+	pthread_cond_t submitted;   // Workers wait here for ops
+	pthread_cond_t completed;   // Reapers (and destroy) wait here for completions
+
+	size_t depth;               // Size of both queues, in_flight never goes over it
+	block_store_sqe_t *sq;      // Circular, sq_count entries from sq_head
+	size_t sq_head;
+	size_t sq_count;
+	block_store_cqe_t *cq;      // Circular, cq_count entries from cq_head
+	size_t cq_head;
+	size_t cq_count;
+	size_t in_flight;           // Submitted and not yet reaped, so queued + running + waiting to be reaped
+
+	bool stopping;
+	pthread_t *workers;
+	size_t worker_count;
+};
+
+static bool block_store_async_valid(const block_store_op_t op)
+{
+	switch (op)
+	{
+		case BLOCK_STORE_OP_READ:
+		case BLOCK_STORE_OP_WRITE:
+		case BLOCK_STORE_OP_ALLOCATE:
+		case BLOCK_STORE_OP_RELEASE:
+			return true;
+	}
+	return false;
+}
+
+// Runs a batch of ops against the device, runs of the same op go together where there's a batched call for it
+static void block_store_async_run(block_store_t *const bs, const block_store_sqe_t *const sqes, const size_t count, block_store_cqe_t *const cqes)
+{
+	size_t ids[ASYNC_BATCH];
+	for (size_t i = 0; i < count;)
+	{
+		size_t run = 1;
+		while (i + run < count && sqes[i + run].op == sqes[i].op)
+		{
+			run++;
+		}
+
+		switch (sqes[i].op)
+		{
+			case BLOCK_STORE_OP_ALLOCATE:
+			{
+				const size_t allocated = block_store_allocate_many(bs, run, ids);
+				for (size_t j = 0; j < run; j++)
+				{
+					cqes[i + j].result = j < allocated ? ids[j] : SIZE_MAX;
+				}
+				break;
+			}
+			case BLOCK_STORE_OP_RELEASE:
+				for (size_t j = 0; j < run; j++)
+				{
+					ids[j] = sqes[i + j].block_id;
+					cqes[i + j].result = 0;
+				}
+				block_store_release_many(bs, ids, run);
+				break;
+			case BLOCK_STORE_OP_READ:
+				for (size_t j = i; j < i + run; j++)
+				{
+					cqes[j].result = block_store_read(bs, sqes[j].block_id, sqes[j].buffer);
+				}
+				break;
+			case BLOCK_STORE_OP_WRITE:
+				for (size_t j = i; j < i + run; j++)
+				{
+					cqes[j].result = block_store_write(bs, sqes[j].block_id, sqes[j].buffer);
+				}
+				break;
+		}
+
+		for (size_t j = i; j < i + run; j++)
+		{
+			cqes[j].user_data = sqes[j].user_data;
+		}
+		i += run;
+	}
+}
+
+static void *block_store_async_worker(void *arg)
+{
+	block_store_async_t *const ring = (block_store_async_t*)arg;
+	block_store_sqe_t batch[ASYNC_BATCH];
+	block_store_cqe_t results[ASYNC_BATCH];
+
+	pthread_mutex_lock(&ring->lock);
+	for (;;)
+	{
+		while (ring->sq_count == 0 && ring->stopping == false)
+		{
+			pthread_cond_wait(&ring->submitted, &ring->lock);
+		}
+		if (ring->sq_count == 0)
+		{
+			break;  // stopping, and there's nothing left to do
+		}
+
+		size_t count = ring->sq_count < ASYNC_BATCH ? ring->sq_count : ASYNC_BATCH;
+		for (size_t i = 0; i < count; i++)
+		{
+			batch[i] = ring->sq[(ring->sq_head + i) % ring->depth];
+		}
+		ring->sq_head = (ring->sq_head + count) % ring->depth;
+		ring->sq_count -= count;
+
+		// the device does its own locking, the ring's lock only has to cover the queues
+		pthread_mutex_unlock(&ring->lock);
+		block_store_async_run(ring->bs, batch, count, results);
+		pthread_mutex_lock(&ring->lock);
+
+		// in_flight never goes over depth, so there's always room
+		for (size_t i = 0; i < count; i++)
+		{
+			ring->cq[(ring->cq_head + ring->cq_count + i) % ring->depth] = results[i];
+		}
+		ring->cq_count += count;
+		pthread_cond_broadcast(&ring->completed);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+///
+/// Starts a ring and its workers in front of a BS device
+/// \param bs BS device, it has to outlive the ring
+/// \param queue_depth Most ops that can be in flight (submitted but not yet reaped) at once
+/// \param workers Number of worker threads
+/// \return Pointer to a new ring, NULL on error
+///
+block_store_async_t *block_store_async_create(block_store_t *const bs, const size_t queue_depth, const size_t workers)
+{
+	if (bs == NULL || queue_depth == 0 || workers == 0)
+	{
+		return NULL;
+	}
+
+	block_store_async_t *ring = (block_store_async_t*)calloc(1, sizeof(block_store_async_t));
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+	ring->bs = bs;
+	ring->depth = queue_depth;
+	ring->sq = (block_store_sqe_t*)calloc(queue_depth, sizeof(block_store_sqe_t));
+	ring->cq = (block_store_cqe_t*)calloc(queue_depth, sizeof(block_store_cqe_t));
+	ring->workers = (pthread_t*)calloc(workers, sizeof(pthread_t));
+	if (ring->sq == NULL || ring->cq == NULL || ring->workers == NULL)
+	{
+		free(ring->sq);
+		free(ring->cq);
+		free(ring->workers);
+		free(ring);
+		return NULL;
+	}
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->submitted, NULL);
+	pthread_cond_init(&ring->completed, NULL);
+
+	for (; ring->worker_count < workers; ring->worker_count++)
+	{
+		if (pthread_create(&ring->workers[ring->worker_count], NULL, block_store_async_worker, ring) != 0)
+		{
+			// whatever workers did start get stopped again by destroy
+			block_store_async_destroy(ring);
+			return NULL;
+		}
+	}
+	return ring;
+}
+
+///
+/// Waits for every submitted op to finish, then stops the workers and frees the ring
+///  Completions that were never reaped are dropped
+/// \param ring The ring
+///
+void block_store_async_destroy(block_store_async_t *const ring)
+{
+	if (ring == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	ring->stopping = true;
+	pthread_cond_broadcast(&ring->submitted);
+	pthread_mutex_unlock(&ring->lock);
+
+	// workers only quit once the submission queue is empty, so everything submitted has run by now
+	for (size_t i = 0; i < ring->worker_count; i++)
+	{
+		pthread_join(ring->workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&ring->completed);
+	pthread_cond_destroy(&ring->submitted);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->workers);
+	free(ring->cq);
+	free(ring->sq);
+	free(ring);
+}
+
+///
+/// Queues a batch of ops, as many as there's room for
+/// \param ring The ring
+/// \param sqes The ops to run
+/// \param count Number of entries in sqes
+/// \return Number of ops queued, 0 on error
+///  Queuing stops when the ring is full (submit the rest once some completions are reaped)
+///  or at the first entry that isn't a known op
+///
+size_t block_store_async_submit(block_store_async_t *const ring, const block_store_sqe_t *const sqes, const size_t count)
+{
+	if (ring == NULL || sqes == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	size_t queued = 0;
+	// stop at anything that isn't an op, so the caller can tell which one it was
+	while (queued < count && ring->in_flight < ring->depth && ring->stopping == false && block_store_async_valid(sqes[queued].op))
+	{
+		ring->sq[(ring->sq_head + ring->sq_count) % ring->depth] = sqes[queued];
+		ring->sq_count++;
+		ring->in_flight++;
+		queued++;
+	}
+	if (queued)
+	{
+		pthread_cond_broadcast(&ring->submitted);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return queued;
+}
+
+// Moves up to max completions out of the queue, the lock has to be held
+static size_t block_store_async_reap(block_store_async_t *const ring, block_store_cqe_t *const cqes, const size_t max)
+{
+	size_t count = ring->cq_count < max ? ring->cq_count : max;
+	for (size_t i = 0; i < count; i++)
+	{
+		cqes[i] = ring->cq[(ring->cq_head + i) % ring->depth];
+	}
+	ring->cq_head = (ring->cq_head + count) % ring->depth;
+	ring->cq_count -= count;
+	ring->in_flight -= count;
+	return count;
+}
+
+///
+/// Reaps whatever completions are ready, without waiting
+/// \param ring The ring
+/// \param cqes Array to receive the completions
+/// \param max Number of entries cqes can hold
+/// \return Number of completions reaped, 0 on error
+///
+size_t block_store_async_poll(block_store_async_t *const ring, block_store_cqe_t *const cqes, const size_t max)
+{
+	if (ring == NULL || cqes == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	size_t count = block_store_async_reap(ring, cqes, max);
+	pthread_mutex_unlock(&ring->lock);
+	return count;
+}
+
+///
+/// Reaps completions, waiting until at least min of them are ready
+///  (or everything in flight, if that's fewer)
+/// \param ring The ring
+/// \param cqes Array to receive the completions
+/// \param max Number of entries cqes can hold
+/// \param min Number of completions to wait for
+/// \return Number of completions reaped, 0 on error
+///
+size_t block_store_async_wait(block_store_async_t *const ring, block_store_cqe_t *const cqes, const size_t max, const size_t min)
+{
+	if (ring == NULL || cqes == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	size_t wanted = min < max ? min : max;
+	if (wanted > ring->in_flight)
+	{
+		wanted = ring->in_flight;
+	}
+	while (ring->cq_count < wanted)
+	{
+		pthread_cond_wait(&ring->completed, &ring->lock);
+	}
+	size_t count = block_store_async_reap(ring, cqes, max);
+	pthread_mutex_unlock(&ring->lock);
+	return count;
+}
+
+///
+/// Number of ops submitted but not yet reaped
+/// \param ring The ring
+/// \return Ops in flight, SIZE_MAX on error
+///
+size_t block_store_async_in_flight(const block_store_async_t *const ring)
+{
+	if (ring == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	pthread_mutex_lock((pthread_mutex_t*)&ring->lock);
+	size_t in_flight = ring->in_flight;
+	pthread_mutex_unlock((pthread_mutex_t*)&ring->lock);
+	return in_flight;
+}
@@ -0,0 +1,538 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+// Every record starts with one of these, the payload follows right after it
+#define WAL_RECORD_MAGIC 0x524C4157u  // "WALR"
+
+// wal_truncate writes the records it keeps to "<log>.tmp" and renames that over the log once it's on disk
+#define WAL_TEMPORARY_SUFFIX ".tmp"
+
+typedef struct wal_record {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t arg0;
+	uint64_t arg1;
+	uint64_t size;      // of the payload
+	uint64_t checksum;  // of the record with this field zeroed, then the payload
+} wal_record_t;
+
+struct wal {
+	int fd;
+	size_t header_size;
+	char *filename;
+	char *temporary;    // filename + WAL_TEMPORARY_SUFFIX
+
+	pthread_mutex_t lock;   // Guards everything below
+	pthread_cond_t synced;  // Committers wait here for whoever is flushing
+
+	// Appends go into buffer while a flush writes out what used to be in it, then the two swap
+	uint8_t *buffer;
+	size_t used;
+	size_t capacity;
+	uint8_t *spare;
+	size_t spare_capacity;
+
+	uint64_t base;      // LSN of the first record still in the file
+	uint64_t appended;  // LSN just past the last record appended
+	uint64_t durable;   // LSN just past the last record known to be on disk
+	bool flushing;      // Someone is writing and syncing right now
+	bool failed;        // A write or sync failed, nothing after durable can be promised anymore
+
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t commits;
+	uint64_t syncs;
+};
+
+// 64 bit FNV-1a, plenty to tell a record that made it to disk from one a crash cut short
+static uint64_t wal_checksum(uint64_t hash, const void *const data, const size_t size)
+{
+	const uint8_t *bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * UINT64_C(0x100000001B3);
+	}
+	return hash;
+}
+
+static uint64_t wal_record_checksum(const wal_record_t *const record, const void *const payload)
+{
+	wal_record_t copy = *record;
+	copy.checksum = 0;
+	return wal_checksum(wal_checksum(UINT64_C(0xCBF29CE484222325), &copy, sizeof(copy)), payload, record->size);
+}
+
+static bool wal_write_all(const int fd, const uint8_t *data, size_t size, off_t offset)
+{
+	while (size)
+	{
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written <= 0)
+		{
+			perror("Error writing to log");
+			return false;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+	return true;
+}
+
+// Copies bytes from through end - 1 of one file to another, starting at to
+static bool wal_copy(const int from_fd, const int to_fd, off_t from, const off_t end, off_t to)
+{
+	uint8_t chunk[65536];
+	while (from < end)
+	{
+		ssize_t bytesRead = pread(from_fd, chunk, (size_t)(end - from) < sizeof(chunk) ? (size_t)(end - from) : sizeof(chunk), from);
+		if (bytesRead <= 0 || wal_write_all(to_fd, chunk, bytesRead, to) == false)
+		{
+			return false;
+		}
+		from += bytesRead;
+		to += bytesRead;
+	}
+	return true;
+}
+
+static bool wal_read_all(const int fd, void *const data, const size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t bytesRead = read(fd, (uint8_t*)data + done, size - done);
+		if (bytesRead <= 0)
+		{
+			return false;
+		}
+		done += bytesRead;
+	}
+	return true;
+}
+
+// Writes out and syncs everything appended so far, the lock has to be held and nobody else flushing
+// The lock is dropped for the write itself, so appends can carry on into the other buffer
+static bool wal_flush(wal_t *const wal)
+{
+	wal->flushing = true;
+	uint8_t *const data = wal->buffer;
+	const size_t size = wal->used;
+	const size_t capacity = wal->capacity;
+	const uint64_t end = wal->appended;
+	const off_t offset = wal->header_size + (end - size - wal->base);
+	wal->buffer = wal->spare;
+	wal->capacity = wal->spare_capacity;
+	wal->used = 0;
+	wal->spare = data;
+	wal->spare_capacity = capacity;
+
+	pthread_mutex_unlock(&wal->lock);
+	bool ok = wal_write_all(wal->fd, data, size, offset) && fdatasync(wal->fd) == 0;
+	pthread_mutex_lock(&wal->lock);
+
+	if (ok)
+	{
+		wal->durable = end;
+		wal->syncs++;
+	}
+	else
+	{
+		wal->failed = true;
+	}
+	wal->flushing = false;
+	pthread_cond_broadcast(&wal->synced);
+	return ok;
+}
+
+///
+/// Creates a new, empty log, overwriting the file if it exists
+/// \param filename The log file
+/// \param header Bytes stored at the front of the log, wal_replay only replays logs with the same header
+/// \param header_size Size of the header
+/// \return Pointer to the new log, NULL on error
+///
+wal_t *wal_create(const char *const filename, const void *const header, const size_t header_size)
+{
+	if (filename == NULL || (header == NULL && header_size))
+	{
+		return NULL;
+	}
+
+	wal_t *wal = (wal_t*)calloc(1, sizeof(wal_t));
+	if (wal == NULL)
+	{
+		return NULL;
+	}
+
+	wal->filename = strdup(filename);
+	wal->temporary = (char*)malloc(strlen(filename) + sizeof(WAL_TEMPORARY_SUFFIX));
+	if (wal->filename == NULL || wal->temporary == NULL)
+	{
+		free(wal->filename);
+		free(wal->temporary);
+		free(wal);
+		return NULL;
+	}
+	strcpy(wal->temporary, filename);
+	strcat(wal->temporary, WAL_TEMPORARY_SUFFIX);
+
+	wal->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (wal->fd == -1)
+	{
+		perror("Error creating log");
+		free(wal->filename);
+		free(wal->temporary);
+		free(wal);
+		return NULL;
+	}
+	// the empty log has to be on disk before anything starts relying on it
+	if (wal_write_all(wal->fd, (const uint8_t*)header, header_size, 0) == false || fsync(wal->fd) != 0 || wal_sync_directory(filename) == false)
+	{
+		close(wal->fd);
+		free(wal->filename);
+		free(wal->temporary);
+		free(wal);
+		return NULL;
+	}
+
+	wal->header_size = header_size;
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->synced, NULL);
+	return wal;
+}
+
+///
+/// Writes out anything still buffered (without syncing it) and closes the log
+/// \param wal The log
+///
+void wal_destroy(wal_t *const wal)
+{
+	if (wal == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&wal->lock);
+	while (wal->flushing)
+	{
+		pthread_cond_wait(&wal->synced, &wal->lock);
+	}
+	if (wal->failed == false)
+	{
+		wal_write_all(wal->fd, wal->buffer, wal->used, wal->header_size + (wal->appended - wal->used - wal->base));
+	}
+	pthread_mutex_unlock(&wal->lock);
+
+	close(wal->fd);
+	pthread_cond_destroy(&wal->synced);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal->buffer);
+	free(wal->spare);
+	free(wal->filename);
+	free(wal->temporary);
+	free(wal);
+}
+
+///
+/// Appends a record to the log's buffer, it's durable once a commit covers its LSN
+/// \param wal The log
+/// \param type, arg0, arg1 Whatever the caller wants to know about the record at replay
+/// \param payload The record's data, may be NULL if size is 0
+/// \param size Size of the payload
+/// \return The LSN just past the record, 0 on error
+///
+uint64_t wal_append(wal_t *const wal, const uint32_t type, const uint64_t arg0, const uint64_t arg1, const void *const payload, const size_t size)
+{
+	if (wal == NULL || (payload == NULL && size))
+	{
+		return 0;
+	}
+
+	wal_record_t record = {WAL_RECORD_MAGIC, type, arg0, arg1, size, 0};
+	record.checksum = wal_record_checksum(&record, payload);
+
+	pthread_mutex_lock(&wal->lock);
+	const size_t needed = wal->used + sizeof(record) + size;
+	if (needed > wal->capacity)
+	{
+		size_t capacity = wal->capacity ? wal->capacity : 4096;
+		while (capacity < needed)
+		{
+			capacity *= 2;
+		}
+		uint8_t *buffer = (uint8_t*)realloc(wal->buffer, capacity);
+		if (buffer == NULL)
+		{
+			pthread_mutex_unlock(&wal->lock);
+			return 0;
+		}
+		wal->buffer = buffer;
+		wal->capacity = capacity;
+	}
+	memcpy(wal->buffer + wal->used, &record, sizeof(record));
+	if (size)
+	{
+		memcpy(wal->buffer + wal->used + sizeof(record), payload, size);
+	}
+	wal->used = needed;
+	wal->appended += sizeof(record) + size;
+	wal->records++;
+	wal->bytes += sizeof(record) + size;
+	const uint64_t lsn = wal->appended;
+	pthread_mutex_unlock(&wal->lock);
+	return lsn;
+}
+
+///
+/// Makes every record up to the given LSN durable
+/// \param wal The log
+/// \param lsn The LSN to commit up to, or 0 for everything appended so far
+/// \return true once it's all on disk, false on error
+///
+bool wal_commit(wal_t *const wal, const uint64_t lsn)
+{
+	if (wal == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&wal->lock);
+	wal->commits++;
+	const uint64_t target = lsn && lsn < wal->appended ? lsn : wal->appended;
+	while (wal->durable < target && wal->failed == false)
+	{
+		// whoever is flushing may not have our records, but the next one to go will
+		if (wal->flushing)
+		{
+			pthread_cond_wait(&wal->synced, &wal->lock);
+		}
+		else
+		{
+			wal_flush(wal);
+		}
+	}
+	const bool ok = wal->durable >= target;
+	pthread_mutex_unlock(&wal->lock);
+	return ok;
+}
+
+///
+/// LSN just past the last record appended
+/// \param wal The log
+/// \return The LSN, 0 on error
+///
+uint64_t wal_position(const wal_t *const wal)
+{
+	if (wal == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock((pthread_mutex_t*)&wal->lock);
+	const uint64_t lsn = wal->appended;
+	pthread_mutex_unlock((pthread_mutex_t*)&wal->lock);
+	return lsn;
+}
+
+///
+/// Drops every record before the given LSN, once whatever they describe is safely stored elsewhere
+///  The records after it are kept, and the log is synced before this returns
+///  The kept records go into a new file that replaces the log with a rename, so a crash part way
+///  through leaves either the old log or the new one, never a torn mix of the two
+/// \param wal The log
+/// \param lsn The first LSN to keep
+/// \return true on success, false on error
+///
+bool wal_truncate(wal_t *const wal, const uint64_t lsn)
+{
+	if (wal == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&wal->lock);
+	// get everything into the file first, then copy the part we're keeping out of it
+	while (wal->flushing || (wal->durable < wal->appended && wal->failed == false))
+	{
+		if (wal->flushing)
+		{
+			pthread_cond_wait(&wal->synced, &wal->lock);
+		}
+		else
+		{
+			wal_flush(wal);
+		}
+	}
+	bool ok = wal->failed == false;
+	if (ok && lsn > wal->base)
+	{
+		// the old log is left alone until the new one is on disk, a failure before the rename only costs the new file
+		const uint64_t keep_from = lsn < wal->durable ? lsn : wal->durable;
+		const int fd = open(wal->temporary, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		ok = fd != -1
+			&& wal_copy(wal->fd, fd, 0, wal->header_size, 0)
+			&& wal_copy(wal->fd, fd, wal->header_size + (keep_from - wal->base), wal->header_size + (wal->durable - wal->base), wal->header_size)
+			&& fdatasync(fd) == 0
+			&& rename(wal->temporary, wal->filename) == 0;
+		if (ok)
+		{
+			close(wal->fd);
+			wal->fd = fd;
+			wal->base = keep_from;
+			// the rename itself has to stick before the caller lets go of anything the old records covered
+			ok = wal_sync_directory(wal->filename);
+		}
+		else
+		{
+			perror("Error trimming log");
+			if (fd != -1)
+			{
+				close(fd);
+			}
+			unlink(wal->temporary);
+		}
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return ok;
+}
+
+///
+/// Syncs the directory a file is in, so the file's creation (or a rename onto it) survives a crash
+/// \param filename The file
+/// \return true on success, false on error
+///
+bool wal_sync_directory(const char *const filename)
+{
+	if (filename == NULL)
+	{
+		return false;
+	}
+
+	char *directory = strdup(filename);
+	if (directory == NULL)
+	{
+		return false;
+	}
+	char *slash = strrchr(directory, '/');
+	if (slash == NULL)
+	{
+		strcpy(directory, ".");
+	}
+	else
+	{
+		slash[slash == directory] = '\0';  // keep the root's slash
+	}
+
+	const int fd = open(directory, O_RDONLY);
+	free(directory);
+	bool ok = fd != -1 && fsync(fd) == 0;
+	if (ok == false)
+	{
+		perror("Error syncing the directory");
+	}
+	if (fd != -1)
+	{
+		close(fd);
+	}
+	return ok;
+}
+
+///
+/// Counts of what the log has done since it was created
+/// \param wal The log
+/// \param records Receives the number of records appended
+/// \param bytes Receives the number of bytes appended, record headers included
+/// \param commits Receives the number of wal_commit calls
+/// \param syncs Receives the number of fsyncs the commits actually took
+/// \return true on success, false on error
+///
+bool wal_stats(const wal_t *const wal, uint64_t *const records, uint64_t *const bytes, uint64_t *const commits, uint64_t *const syncs)
+{
+	if (wal == NULL || records == NULL || bytes == NULL || commits == NULL || syncs == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock((pthread_mutex_t*)&wal->lock);
+	*records = wal->records;
+	*bytes = wal->bytes;
+	*commits = wal->commits;
+	*syncs = wal->syncs;
+	pthread_mutex_unlock((pthread_mutex_t*)&wal->lock);
+	return true;
+}
+
+///
+/// Feeds every intact record of a log file to a callback, stopping at the first torn or corrupt one
+///  (that's where a crash cut the log off)
+/// \param filename The log file
+/// \param header The header the log has to start with
+/// \param header_size Size of the header
+/// \param callback Called for each record
+/// \param context Passed through to the callback
+/// \return Number of records replayed, SIZE_MAX if there's no log or it has a different header
+///
+size_t wal_replay(const char *const filename, const void *const header, const size_t header_size, wal_replay_fn callback, void *const context)
+{
+	if (filename == NULL || (header == NULL && header_size) || callback == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+	{
+		return SIZE_MAX;
+	}
+
+	struct stat st;
+	uint8_t *found = (uint8_t*)malloc(header_size ? header_size : 1);
+	if (found == NULL || fstat(fd, &st) != 0 || wal_read_all(fd, found, header_size) == false || memcmp(found, header, header_size) != 0)
+	{
+		free(found);
+		close(fd);
+		return SIZE_MAX;
+	}
+	free(found);
+
+	size_t replayed = 0;
+	size_t left = st.st_size - header_size;
+	uint8_t *payload = NULL;
+	size_t payload_capacity = 0;
+	wal_record_t record;
+	while (left >= sizeof(record) && wal_read_all(fd, &record, sizeof(record)))
+	{
+		left -= sizeof(record);
+		if (record.magic != WAL_RECORD_MAGIC || record.size > left)
+		{
+			break;
+		}
+		if (record.size > payload_capacity)
+		{
+			uint8_t *grown = (uint8_t*)realloc(payload, record.size);
+			if (grown == NULL)
+			{
+				break;
+			}
+			payload = grown;
+			payload_capacity = record.size;
+		}
+		if (wal_read_all(fd, payload, record.size) == false || wal_record_checksum(&record, payload) != record.checksum)
+		{
+			break;
+		}
+		left -= record.size;
+		callback(context, record.type, record.arg0, record.arg1, payload, record.size);
+		replayed++;
+	}
+
+	free(payload);
+	close(fd);
+	return replayed;
+}
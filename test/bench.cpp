@@ -0,0 +1,179 @@
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "block_store.h"
+#include "bitmap.h"
+#include <string>
+#include <vector>
+
+// Benchmarks for the allocator, the bitmap and the I/O paths
+// Prints JSON unless asked for another format, e.g. --benchmark_format=console
+// Arguments are named in the output, so runs can be lined up across releases
+
+// Allocates blocks until fill_percent of the store's blocks are in use
+static void fill_store(block_store_t *const bs, const int64_t fill_percent)
+{
+	const size_t target = block_store_get_total_blocks_ex(bs) * fill_percent / 100;
+	while (block_store_get_used_blocks(bs) < target && block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+}
+
+static std::string bench_filename(const char *const name)
+{
+	return std::string("bench_") + name + "_" + std::to_string(getpid()) + ".bs";
+}
+
+// ffz with everything below fill_percent set, the scan has to get past all of it
+static void BM_bitmap_ffz(benchmark::State &state)
+{
+	const size_t bits = state.range(0);
+	bitmap_t *bitmap = bitmap_create(bits);
+	bitmap_set_range(bitmap, 0, bits * state.range(1) / 100);
+	bitmap_summarize(bitmap);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+	}
+	bitmap_destroy(bitmap);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_bitmap_ffz)->ArgNames({"bits", "fill"})->ArgsProduct({{1 << 12, 1 << 16, 1 << 20}, {0, 50, 90, 99}});
+
+static void BM_bitmap_total_set(benchmark::State &state)
+{
+	const size_t bits = state.range(0);
+	bitmap_t *bitmap = bitmap_create(bits);
+	bitmap_set_range(bitmap, 0, bits / 2);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+	}
+	state.SetBytesProcessed(state.iterations() * bitmap_get_bytes(bitmap));
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_total_set)->ArgName("bits")->Range(1 << 12, 1 << 22);
+
+// One allocate and one release per iteration, all threads share one store
+static block_store_t *allocate_store;
+
+static void BM_block_store_allocate(benchmark::State &state)
+{
+	if (state.thread_index() == 0)
+	{
+		allocate_store = block_store_create_ex(state.range(0), BLOCK_SIZE_BYTES);
+		fill_store(allocate_store, state.range(1));
+	}
+	for (auto _ : state)
+	{
+		const size_t id = block_store_allocate(allocate_store);
+		if (id == SIZE_MAX)
+		{
+			state.SkipWithError("store filled up");
+			break;
+		}
+		block_store_release(allocate_store, id);
+	}
+	if (state.thread_index() == 0)
+	{
+		block_store_destroy(allocate_store);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_block_store_allocate)->ArgNames({"blocks", "fill"})->ArgsProduct({{1 << 12, 1 << 16}, {0, 50, 90, 99}})->ThreadRange(1, 8)->UseRealTime();
+
+// Each thread reads or writes its own block so they only meet on the store's locks
+static block_store_t *io_store;
+
+static void block_store_io(benchmark::State &state, const bool writing)
+{
+	const size_t block_size = state.range(0);
+	// well past the in-band bitmap, which starts at BITMAP_START_BLOCK
+	const size_t id = 1024 + state.thread_index() * 64;
+	if (state.thread_index() == 0)
+	{
+		// only allocated blocks can be read or written, the other threads can't touch the store until the loop starts
+		io_store = block_store_create_ex(1 << 12, block_size);
+		for (int thread = 0; thread < state.threads(); thread++)
+		{
+			block_store_request(io_store, 1024 + thread * 64);
+		}
+	}
+	std::vector<uint8_t> buffer(block_size, 0xA5);
+	for (auto _ : state)
+	{
+		const size_t done = writing ? block_store_write(io_store, id, buffer.data()) : block_store_read(io_store, id, buffer.data());
+		if (done != block_size)
+		{
+			state.SkipWithError(writing ? "write failed" : "read failed");
+			break;
+		}
+	}
+	if (state.thread_index() == 0)
+	{
+		block_store_destroy(io_store);
+	}
+	state.SetBytesProcessed(state.iterations() * block_size);
+}
+
+static void BM_block_store_read(benchmark::State &state)
+{
+	block_store_io(state, false);
+}
+BENCHMARK(BM_block_store_read)->ArgName("block_size")->RangeMultiplier(8)->Range(32, 32 << 9)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_block_store_write(benchmark::State &state)
+{
+	block_store_io(state, true);
+}
+BENCHMARK(BM_block_store_write)->ArgName("block_size")->RangeMultiplier(8)->Range(32, 32 << 9)->ThreadRange(1, 8)->UseRealTime();
+
+// Whole-file and sparse images of a store that's fill_percent allocated
+static void block_store_save(benchmark::State &state, const bool sparse)
+{
+	block_store_t *bs = block_store_create_ex(state.range(0), 4096);
+	fill_store(bs, state.range(1));
+	const std::string filename = bench_filename(sparse ? "sparse" : "serialize");
+	size_t written = 0;
+	for (auto _ : state)
+	{
+		written = sparse ? block_store_serialize_sparse(bs, filename.c_str()) : block_store_serialize(bs, filename.c_str());
+		if (written == 0)
+		{
+			state.SkipWithError("serialize failed");
+			break;
+		}
+	}
+	unlink(filename.c_str());
+	block_store_destroy(bs);
+	state.SetBytesProcessed(state.iterations() * written);
+}
+
+static void BM_block_store_serialize(benchmark::State &state)
+{
+	block_store_save(state, false);
+}
+BENCHMARK(BM_block_store_serialize)->ArgNames({"blocks", "fill"})->ArgsProduct({{1 << 10, 1 << 14}, {10, 50, 100}})->Unit(benchmark::kMicrosecond);
+
+static void BM_block_store_serialize_sparse(benchmark::State &state)
+{
+	block_store_save(state, true);
+}
+BENCHMARK(BM_block_store_serialize_sparse)->ArgNames({"blocks", "fill"})->ArgsProduct({{1 << 10, 1 << 14}, {10, 50, 100}})->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv)
+{
+	// JSON by default, an explicit --benchmark_format still wins since the last flag is the one that sticks
+	std::vector<char*> args(argv, argv + argc);
+	char json[] = "--benchmark_format=json";
+	args.insert(args.begin() + 1, json);
+	int count = (int)args.size();
+	benchmark::Initialize(&count, args.data());
+	if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+	{
+		return 1;
+	}
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
 #include <sys/stat.h>
 #include "block_store.h"
+#include "bitmap.h"
+#include "block_store_async.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 // The object is opaque, so we can't really test things directly....
 
@@ -30,6 +35,223 @@ int main(int argc, char **argv) {
 
 
 
+TEST(bitmap_find, ffs_ffz_words) {
+	// 200 bits is three full words and a partial one, make sure the tail is handled
+	bitmap_t *bitmap = bitmap_create(200);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+	ASSERT_EQ(0, bitmap_ffz(bitmap));
+
+	bitmap_set(bitmap, 130);
+	ASSERT_EQ(130, bitmap_ffs(bitmap));
+	bitmap_set(bitmap, 64);
+	ASSERT_EQ(64, bitmap_ffs(bitmap));
+
+	// Fill everything but the last bit, the padding past it must not count as free
+	bitmap_format(bitmap, 0xFF);
+	bitmap_reset(bitmap, 199);
+	ASSERT_EQ(199, bitmap_ffz(bitmap));
+	bitmap_set(bitmap, 199);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+	bitmap_reset(bitmap, 63);
+	ASSERT_EQ(63, bitmap_ffz(bitmap));
+
+	// and the padding must not count as set either
+	bitmap_format(bitmap, 0x00);
+	bitmap_set(bitmap, 199);
+	ASSERT_EQ(199, bitmap_ffs(bitmap));
+	bitmap_destroy(bitmap);
+
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs(NULL));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(NULL));
+
+	score += 3;
+}
+
+TEST(bitmap_find, overlay_unaligned) {
+	// Overlays don't have to be word aligned or a whole number of words long
+	uint8_t buffer[16] = {0};
+	memset(buffer + 1, 0xFF, 12);
+	bitmap_t *bitmap = bitmap_overlay(100, buffer + 1);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(96, bitmap_ffz(bitmap));
+	buffer[5] = 0xEF;
+	ASSERT_EQ(36, bitmap_ffz(bitmap));
+	ASSERT_EQ(0, bitmap_ffs(bitmap));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_find, summary_matches_plain) {
+	// Big enough for three summary levels
+	const size_t bits = 300001;
+	bitmap_t *plain = bitmap_create(bits);
+	bitmap_t *summarized = bitmap_create(bits);
+	ASSERT_NE(nullptr, plain);
+	ASSERT_NE(nullptr, summarized);
+	ASSERT_EQ(true, bitmap_summarize(summarized));
+	ASSERT_EQ(false, bitmap_summarize(NULL));
+
+	bitmap_format(plain, 0xFF);
+	bitmap_format(summarized, 0xFF);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(summarized));
+
+	srand(3);
+	for (int i = 0; i < 20000; i++)
+	{
+		size_t bit = (size_t) rand() % bits;
+		if (rand() % 2)
+		{
+			bitmap_set(plain, bit);
+			bitmap_set(summarized, bit);
+		}
+		else
+		{
+			bitmap_reset(plain, bit);
+			bitmap_reset(summarized, bit);
+		}
+		ASSERT_EQ(bitmap_ffz(plain), bitmap_ffz(summarized));
+		ASSERT_EQ(bitmap_ffs(plain), bitmap_ffs(summarized));
+		if (i == 10000)
+		{
+			bitmap_invert(plain);
+			bitmap_invert(summarized);
+		}
+	}
+
+	bitmap_destroy(plain);
+	bitmap_destroy(summarized);
+
+	score += 3;
+}
+
+TEST(bitmap_total_set, matches_bit_by_bit) {
+	// big enough for the wide paths, with leftover bits and a tail that isn't a whole word
+	bitmap_t *bitmap = bitmap_create(4099);
+	ASSERT_NE(nullptr, bitmap);
+	size_t expected = 0;
+	for (size_t i = 0; i < 4099; i++)
+	{
+		if ((i * 2654435761u) % 7 < 3)
+		{
+			bitmap_set(bitmap, i);
+			expected++;
+		}
+	}
+	ASSERT_EQ(expected, bitmap_total_set(bitmap));
+	bitmap_format(bitmap, 0xFF);
+	ASSERT_EQ(4099, bitmap_total_set(bitmap));
+	bitmap_destroy(bitmap);
+	ASSERT_EQ(0, bitmap_total_set(NULL));
+
+	score += 2;
+}
+
+TEST(bitmap_next, set_and_clear) {
+	bitmap_t *bitmap = bitmap_create(1000);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(bitmap, 0));
+	bitmap_set(bitmap, 3);
+	bitmap_set(bitmap, 700);
+	bitmap_set(bitmap, 999);
+	ASSERT_EQ(3, bitmap_next_set(bitmap, 0));
+	ASSERT_EQ(3, bitmap_next_set(bitmap, 3));
+	ASSERT_EQ(700, bitmap_next_set(bitmap, 4));
+	ASSERT_EQ(999, bitmap_next_set(bitmap, 701));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(bitmap, 1000));
+
+	bitmap_format(bitmap, 0xFF);
+	bitmap_reset(bitmap, 512);
+	ASSERT_EQ(512, bitmap_next_clear(bitmap, 0));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_clear(bitmap, 513));
+	ASSERT_EQ(true, bitmap_summarize(bitmap));
+	ASSERT_EQ(512, bitmap_next_clear(bitmap, 100));
+	ASSERT_EQ(513, bitmap_next_set(bitmap, 512));
+	bitmap_destroy(bitmap);
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(NULL, 0));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_clear(NULL, 0));
+
+	score += 2;
+}
+
+TEST(bitmap_range, set_reset_test_count) {
+	bitmap_t *bitmap = bitmap_create(1000);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(true, bitmap_summarize(bitmap));
+
+	// Head and tail in partial words, whole words in between
+	ASSERT_EQ(300, bitmap_set_range(bitmap, 50, 300));
+	ASSERT_EQ(true, bitmap_test_range_all(bitmap, 50, 300));
+	ASSERT_EQ(false, bitmap_test_range_all(bitmap, 49, 300));
+	ASSERT_EQ(300, bitmap_count_range(bitmap, 0, 1000));
+	ASSERT_EQ(50, bitmap_ffs(bitmap));
+	// Only the bits that weren't already set count
+	ASSERT_EQ(5, bitmap_set_range(bitmap, 345, 10));
+	ASSERT_EQ(100, bitmap_reset_range(bitmap, 100, 100));
+	ASSERT_EQ(205, bitmap_count_range(bitmap, 0, 1000));
+	ASSERT_EQ(100, bitmap_next_clear(bitmap, 50));
+	ASSERT_EQ(0, bitmap_reset_range(bitmap, 100, 100));
+
+	// The end of the bitmap, and ranges that run off it
+	ASSERT_EQ(8, bitmap_set_range(bitmap, 992, 8));
+	ASSERT_EQ(true, bitmap_test(bitmap, 999));
+	ASSERT_EQ(0, bitmap_set_range(bitmap, 992, 9));
+	ASSERT_EQ(0, bitmap_reset_range(bitmap, 1000, 1));
+	ASSERT_EQ(false, bitmap_test_range_all(bitmap, 0, 0));
+	ASSERT_EQ(0, bitmap_count_range(bitmap, 999, 2));
+	ASSERT_EQ(0, bitmap_set_range(NULL, 0, 1));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_atomic, claim_and_release) {
+	bitmap_t *bitmap = bitmap_create(200);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(true, bitmap_summarize(bitmap));
+
+	ASSERT_EQ(false, bitmap_test_and_set(bitmap, 5));
+	ASSERT_EQ(true, bitmap_test_and_set(bitmap, 5));
+	ASSERT_EQ(true, bitmap_test_and_reset(bitmap, 5));
+	ASSERT_EQ(false, bitmap_test_and_reset(bitmap, 5));
+
+	// Across a word boundary, and all or nothing
+	ASSERT_EQ(true, bitmap_claim_range(bitmap, 60, 70));
+	ASSERT_EQ(70, bitmap_total_set(bitmap));
+	ASSERT_EQ(false, bitmap_claim_range(bitmap, 10, 51));
+	ASSERT_EQ(70, bitmap_total_set(bitmap));
+	ASSERT_EQ(false, bitmap_test_and_set(bitmap, 190));
+	ASSERT_EQ(false, bitmap_claim_range(bitmap, 131, 69));
+	ASSERT_EQ(71, bitmap_total_set(bitmap));
+	ASSERT_EQ(0, bitmap_ffz(bitmap));
+	ASSERT_EQ(130, bitmap_find_zero_run(bitmap, 60, 10));
+	ASSERT_EQ(false, bitmap_claim_range(bitmap, 150, 51));
+	ASSERT_EQ(false, bitmap_claim_range(NULL, 0, 1));
+
+	size_t bits[3] = {60, 61, 500};
+	size_t cleared[3] = {0};
+	ASSERT_EQ(1, bitmap_reset_many(bitmap, bits + 1, 1, NULL));
+	ASSERT_EQ(1, bitmap_reset_many(bitmap, bits, 3, cleared));
+	ASSERT_EQ(60, cleared[0]);
+	ASSERT_EQ(0, bitmap_reset_many(bitmap, bits, 3, cleared));
+	ASSERT_EQ(69, bitmap_total_set(bitmap));
+
+	// Range claims stop at the end of their range, even with free bits right after it
+	size_t claimed[20];
+	ASSERT_EQ(10, bitmap_claim_zeros_range(bitmap, 130, 10, 20, claimed, NULL));
+	ASSERT_EQ(130, claimed[0]);
+	ASSERT_EQ(139, claimed[9]);
+	size_t scanned = 0;
+	ASSERT_EQ(0, bitmap_claim_zeros_range(bitmap, 62, 68, 1, claimed, &scanned));
+	ASSERT_EQ(128, scanned);
+	ASSERT_EQ(false, bitmap_test(bitmap, 140));
+
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
 TEST(block_store_create, create) {
 	block_store_t *bs = NULL;
 	bs = block_store_create();
@@ -54,6 +276,57 @@ TEST(block_store_get_total_blocks, num_blocks) {
 	score += 2;
 }
 
+TEST(block_store_create_ex, geometry) {
+	block_store_t *bs = NULL;
+	bs = block_store_create_ex(4096, 4096);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(4096, block_store_get_total_blocks_ex(bs));
+	ASSERT_EQ(4096, block_store_get_block_size(bs));
+	// 4096 bits of bitmap fit in a single 4KiB block
+	ASSERT_EQ(1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(4095, block_store_get_free_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, BITMAP_START_BLOCK));
+	block_store_destroy(bs);
+
+	// The default device and the wrapper should agree
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_total_blocks_ex(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_get_block_size(bs));
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_create_ex, bad_geometry) {
+	ASSERT_EQ(nullptr, block_store_create_ex(0, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(nullptr, block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, 0));
+	ASSERT_EQ(nullptr, block_store_create_ex(SIZE_MAX, 2));
+	// A single block would be nothing but bitmap
+	ASSERT_EQ(nullptr, block_store_create_ex(1, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(SIZE_MAX, block_store_get_total_blocks_ex(NULL));
+	ASSERT_EQ(0, block_store_get_block_size(NULL));
+
+	score += 2;
+}
+
+TEST(block_store_create_ex, small_device) {
+	// Too small for the bitmap to sit at BITMAP_START_BLOCK, it gets pushed to the last block
+	block_store_t *bs = NULL;
+	bs = block_store_create_ex(64, 16);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(false, block_store_request(bs, 63));
+	for (size_t i = 0; i < 63; i++)
+	{
+		ASSERT_EQ(i, block_store_allocate(bs));
+	}
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
 TEST(block_store_alloc_free_req, allocate_null) {
 	size_t id;
 	id = block_store_allocate(nullptr);
@@ -197,6 +470,422 @@ TEST(block_store_alloc_free_req, request_same_twice) {
 	score += 2;
 }
 
+TEST(block_store_many, allocate_and_release) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	ASSERT_EQ(true, block_store_request(bs, 2));
+	size_t ids[BLOCK_STORE_NUM_BLOCKS];
+	ASSERT_EQ(70, block_store_allocate_many(bs, 70, ids));
+	// Lowest first, skipping the one already in use
+	ASSERT_EQ(0, ids[0]);
+	ASSERT_EQ(1, ids[1]);
+	ASSERT_EQ(3, ids[2]);
+	ASSERT_EQ(70, ids[69]);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 71, block_store_get_used_blocks(bs));
+
+	// Free every other one, plus one that's out of range
+	size_t evens[36];
+	for (size_t i = 0; i < 35; i++)
+	{
+		evens[i] = ids[2 * i];
+	}
+	evens[35] = 5000;
+	block_store_release_many(bs, evens, 36);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 36, block_store_get_used_blocks(bs));
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(3, block_store_allocate(bs));
+
+	// Ask for more than is left
+	size_t left = block_store_get_free_blocks(bs);
+	ASSERT_EQ(left, block_store_allocate_many(bs, BLOCK_STORE_NUM_BLOCKS, ids));
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	ASSERT_EQ(0, block_store_allocate_many(bs, 1, ids));
+
+	ASSERT_EQ(0, block_store_allocate_many(NULL, 1, ids));
+	ASSERT_EQ(0, block_store_allocate_many(bs, 1, NULL));
+	block_store_release_many(NULL, ids, 1);
+	block_store_destroy(bs);
+
+	score += 4;
+}
+
+TEST(block_store_threads, no_double_allocation) {
+	const size_t num_blocks = 1 << 16;
+	block_store_t *bs = block_store_create_ex(num_blocks, 32);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	const size_t bitmap_blocks = block_store_get_used_blocks(bs);
+	// Single blocks come and go through magazines, batches from the shards and extents straight from the bitmap
+	ASSERT_EQ(true, block_store_enable_magazines(bs, 16));
+	ASSERT_EQ(true, block_store_enable_shards(bs, 4));
+
+	// Every thread grabs blocks every way it can and gives some back, keeping what it ends up with
+	const size_t num_threads = 8;
+	std::vector<std::vector<size_t>> held(num_threads);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < num_threads; t++)
+	{
+		threads.emplace_back([bs, t, &held]() {
+			std::vector<size_t> &mine = held[t];
+			size_t ids[16];
+			for (size_t round = 0; round < 400; round++)
+			{
+				size_t id = block_store_allocate(bs);
+				if (id != SIZE_MAX)
+				{
+					mine.push_back(id);
+				}
+				size_t got = block_store_allocate_many(bs, 16, ids);
+				mine.insert(mine.end(), ids, ids + got);
+				size_t extent = block_store_allocate_extent(bs, 3);
+				if (extent != SIZE_MAX)
+				{
+					mine.insert(mine.end(), {extent, extent + 1, extent + 2});
+				}
+				// everyone fights over the same few ids
+				if (block_store_request(bs, 60000 + round % 64))
+				{
+					mine.push_back(60000 + round % 64);
+				}
+				if (round % 3 == 0)
+				{
+					block_store_release_many(bs, &mine[mine.size() - 8], 8);
+					mine.resize(mine.size() - 8);
+					block_store_release(bs, mine.back());
+					mine.pop_back();
+				}
+			}
+		});
+	}
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	std::vector<size_t> all;
+	for (const std::vector<size_t> &mine : held)
+	{
+		all.insert(all.end(), mine.begin(), mine.end());
+	}
+	std::sort(all.begin(), all.end());
+	ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "a block was handed out twice\n";
+	ASSERT_EQ(all.size() + bitmap_blocks, block_store_get_used_blocks(bs));
+	ASSERT_EQ(num_blocks - all.size() - bitmap_blocks, block_store_get_free_blocks(bs));
+	block_store_release_many(bs, all.data(), all.size());
+	ASSERT_EQ(bitmap_blocks, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_threads, reads_never_torn) {
+	const size_t block_size = 4096;
+	block_store_t *bs = block_store_create_ex(256, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_request(bs, 10));
+	ASSERT_EQ(true, block_store_request(bs, 11));
+
+	// Writers fill whole blocks with one byte value at a time, so any mix of values in a block is a torn read
+	const size_t ids[2] = {10, 11};
+	bool stop = false;
+	std::vector<std::thread> writers;
+	for (int w = 0; w < 2; w++)
+	{
+		writers.emplace_back([bs, w, block_size, &ids, &stop]() {
+			std::vector<uint8_t> pattern(2 * block_size);
+			for (int round = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); round++)
+			{
+				std::fill(pattern.begin(), pattern.end(), (uint8_t)(2 * round + w));
+				struct iovec vec = {pattern.data(), pattern.size()};
+				block_store_writev(bs, ids, 2, &vec, 1);
+				block_store_write(bs, 10, pattern.data());
+			}
+		});
+	}
+
+	std::vector<std::thread> readers;
+	std::vector<size_t> torn(4, 0);
+	for (int r = 0; r < 4; r++)
+	{
+		readers.emplace_back([bs, r, block_size, &ids, &torn]() {
+			std::vector<uint8_t> buffer(2 * block_size);
+			for (int round = 0; round < 2000; round++)
+			{
+				if (r % 2)
+				{
+					struct iovec vec[2] = {{buffer.data(), 100}, {buffer.data() + 100, buffer.size() - 100}};
+					ASSERT_EQ(2 * block_size, block_store_readv(bs, ids, 2, vec, 2));
+					torn[r] += std::count(buffer.begin(), buffer.begin() + block_size, buffer[0]) != (long)block_size
+						|| std::count(buffer.begin() + block_size, buffer.end(), buffer[block_size]) != (long)block_size;
+				}
+				else
+				{
+					ASSERT_EQ(block_size, block_store_read(bs, 10, buffer.data()));
+					torn[r] += std::count(buffer.begin(), buffer.begin() + block_size, buffer[0]) != (long)block_size;
+				}
+			}
+		});
+	}
+	for (std::thread &reader : readers)
+	{
+		reader.join();
+	}
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (std::thread &writer : writers)
+	{
+		writer.join();
+	}
+
+	for (size_t count : torn)
+	{
+		ASSERT_EQ(0, count) << "a read saw parts of two different writes\n";
+	}
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_get_used_blocks, counter_tracks_bitmap) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	size_t ids[10];
+	ASSERT_EQ(10, block_store_allocate_many(bs, 10, ids));
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	size_t extent = block_store_allocate_extent(bs, 5);
+	ASSERT_NE(SIZE_MAX, extent);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 16, block_store_get_used_blocks(bs));
+
+	// Releasing something twice, or something that's already free, only counts once
+	size_t twice[] = {ids[0], ids[0], ids[1], 400};
+	block_store_release_many(bs, twice, 4);
+	block_store_release(bs, ids[1]);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 14, block_store_get_used_blocks(bs));
+	block_store_release_extent(bs, extent, 5);
+	block_store_release_extent(bs, extent, 5);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 9, block_store_get_used_blocks(bs));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS - 9, block_store_get_free_blocks(bs));
+
+	// And it comes back right from an image
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_used.bs"));
+	block_store_t *copy = block_store_deserialize("test_used.bs");
+	ASSERT_NE(nullptr, copy);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 9, block_store_get_used_blocks(copy));
+	block_store_destroy(copy);
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+static void collect_block(size_t block_id, void *arg)
+{
+	static_cast<std::vector<size_t> *>(arg)->push_back(block_id);
+}
+
+TEST(block_store_for_each_allocated, live_blocks_only) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_enable_magazines(bs, 8));
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(true, block_store_request(bs, 400));
+
+	// The rest of the magazine's blocks are parked, so they don't show up
+	std::vector<size_t> blocks;
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_for_each_allocated(bs, collect_block, &blocks));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, blocks.size());
+	ASSERT_EQ(0, blocks.front());
+	ASSERT_EQ(BITMAP_START_BLOCK, blocks[1]);
+	ASSERT_EQ(400, blocks.back());
+	ASSERT_EQ(SIZE_MAX, block_store_for_each_allocated(NULL, collect_block, &blocks));
+	ASSERT_EQ(SIZE_MAX, block_store_for_each_allocated(bs, NULL, &blocks));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_range, request_and_release) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_request_range(bs, 200, 100));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 100, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 250));
+
+	// All or nothing
+	ASSERT_EQ(false, block_store_request_range(bs, 150, 51));
+	ASSERT_EQ(true, block_store_request(bs, 150));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 101, block_store_get_used_blocks(bs));
+
+	// Releasing counts what was actually in use, and stays away from the bitmap
+	ASSERT_EQ(101, block_store_release_range(bs, 150, 200));
+	ASSERT_EQ(0, block_store_release_range(bs, 150, 200));
+	ASSERT_EQ(0, block_store_release_range(bs, BITMAP_START_BLOCK, 1));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+	ASSERT_EQ(false, block_store_request_range(bs, BLOCK_STORE_NUM_BLOCKS - 1, 2));
+	ASSERT_EQ(false, block_store_request_range(NULL, 0, 1));
+	ASSERT_EQ(false, block_store_request_range(bs, 0, 0));
+	ASSERT_EQ(0, block_store_release_range(NULL, 0, 1));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_magazine, allocate_and_release) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(false, block_store_enable_magazines(bs, 0));
+	ASSERT_EQ(false, block_store_enable_magazines(bs, BLOCK_STORE_MAGAZINE_MAX + 1));
+	ASSERT_EQ(false, block_store_enable_magazines(NULL, 8));
+	ASSERT_EQ(true, block_store_enable_magazines(bs, 8));
+	ASSERT_EQ(false, block_store_enable_magazines(bs, 8));
+
+	// The first allocate parks half a magazine, which still counts as free
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS - 1, block_store_get_free_blocks(bs));
+	ASSERT_EQ(1, block_store_allocate(bs));
+
+	// Parked blocks can't be read, released twice, or kept from request
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(0, block_store_read(bs, 2, buffer));
+	ASSERT_EQ(true, block_store_request(bs, 2));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 3, block_store_get_used_blocks(bs));
+	block_store_release(bs, 1);
+	block_store_release(bs, 1);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_used_blocks(bs));
+	ASSERT_EQ(1, block_store_allocate(bs));
+	ASSERT_EQ(3, block_store_allocate(bs));
+
+	// Overflowing the magazine spills back to the bitmap without losing anything
+	size_t ids[40];
+	ASSERT_EQ(40, block_store_allocate_many(bs, 40, ids));
+	block_store_release_many(bs, ids, 40);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 4, block_store_get_used_blocks(bs));
+
+	// Serializing drains the magazines so the image only has what's really in use
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_mag.bs"));
+	block_store_t *copy = block_store_deserialize("test_mag.bs");
+	ASSERT_NE(nullptr, copy) << "block_store_deserialize returned NULL when it should not have\n";
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 4, block_store_get_used_blocks(copy));
+	block_store_destroy(copy);
+
+	block_store_drain_magazines(bs);
+	block_store_drain_magazines(NULL);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 4, block_store_get_used_blocks(bs));
+	ASSERT_EQ(4, block_store_allocate(bs));
+	block_store_destroy(bs);
+
+	score += 4;
+}
+
+TEST(block_store_shard, allocate_and_steal) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	// Shards are at least 512 blocks, so the default device only gets one
+	ASSERT_EQ(1, block_store_get_shard_count(bs));
+	ASSERT_EQ(true, block_store_enable_shards(bs, 8));
+	ASSERT_EQ(1, block_store_get_shard_count(bs));
+	ASSERT_EQ(false, block_store_enable_shards(bs, 8));
+	ASSERT_EQ(0, block_store_allocate(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_create_ex(4096, 32);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(false, block_store_enable_shards(bs, 0));
+	ASSERT_EQ(false, block_store_enable_shards(NULL, 4));
+	ASSERT_EQ(true, block_store_enable_shards(bs, 3));
+	ASSERT_EQ(3, block_store_get_shard_count(bs));
+	ASSERT_EQ(0, block_store_get_shard_count(NULL));
+
+	// The whole home shard is handed out before anything gets stolen from the others
+	size_t first = block_store_allocate(bs);
+	ASSERT_NE(SIZE_MAX, first);
+	const size_t home = first / 1536;
+	size_t ids[4096];
+	size_t free_blocks = block_store_get_free_blocks(bs);
+	ASSERT_EQ(free_blocks, block_store_allocate_many(bs, 4096, ids));
+	size_t i = 0;
+	while (i < free_blocks && ids[i] / 1536 == home)
+	{
+		i++;
+	}
+	for (; i < free_blocks; i++)
+	{
+		ASSERT_NE(home, ids[i] / 1536);
+	}
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+	// Ids mean the same thing to every shard
+	block_store_release(bs, 4000);
+	ASSERT_EQ(4000, block_store_allocate(bs));
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_extent, allocate_and_release) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// Poke a hole in the front so the first fit has to skip it
+	ASSERT_EQ(true, block_store_request(bs, 3));
+	size_t id = block_store_allocate_extent(bs, 10);
+	ASSERT_EQ(4, id);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 11, block_store_get_used_blocks(bs));
+	for (size_t i = id; i < id + 10; i++)
+	{
+		ASSERT_EQ(false, block_store_request(bs, i));
+	}
+
+	// The small run in front of it still works for small extents
+	ASSERT_EQ(0, block_store_allocate_extent(bs, 3));
+	ASSERT_EQ(14, block_store_allocate_extent(bs, 1));
+
+	block_store_release_extent(bs, id, 10);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 5, block_store_get_used_blocks(bs));
+	ASSERT_EQ(id, block_store_allocate_extent(bs, 10));
+
+	// Too big, and bad parameters
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, BLOCK_STORE_NUM_BLOCKS));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 0));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(NULL, 1));
+	block_store_release_extent(NULL, 0, 1);
+	block_store_release_extent(bs, BLOCK_STORE_NUM_BLOCKS - 1, 2);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 15, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 4;
+}
+
+TEST(block_store_extent, bitmap_boundary) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// Exactly fits in front of the bitmap
+	ASSERT_EQ(0, block_store_allocate_extent(bs, BITMAP_START_BLOCK));
+	block_store_release_extent(bs, 0, BITMAP_START_BLOCK);
+
+	// Too long to fit in front, so it goes after
+	ASSERT_EQ(BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS, block_store_allocate_extent(bs, BITMAP_START_BLOCK + 1));
+
+	// Releasing across the bitmap is refused outright
+	block_store_release_extent(bs, BITMAP_START_BLOCK - 1, 4);
+	ASSERT_EQ(false, block_store_request(bs, BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS));
+	block_store_destroy(bs);
+
+	// Even if the bitmap's blocks get released, extents still can't cross them
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	for (size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++)
+	{
+		block_store_release(bs, i);
+	}
+	ASSERT_EQ(BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS, block_store_allocate_extent(bs, 200));
+	block_store_destroy(bs);
+
+	score += 4;
+}
+
 TEST(block_store, count_free_and_used) {
 	block_store_t *bs = NULL;
 	bs = block_store_create();
@@ -342,6 +1031,309 @@ TEST(block_store_write_read, valid_write_and_read) {
 }
 
 
+TEST(block_store_write_read, vectored) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// Two runs (10-12 and 40) spread over three uneven buffers
+	size_t ids[4] = {10, 11, 12, 40};
+	for (size_t i = 0; i < 4; i++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, ids[i]));
+	}
+	uint8_t write_buffer[4 * BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < sizeof(write_buffer); i++)
+	{
+		write_buffer[i] = (uint8_t) i;
+	}
+	struct iovec write_iov[3] = {
+		{write_buffer, 5},
+		{write_buffer + 5, 2 * BLOCK_SIZE_BYTES},
+		{write_buffer + 5 + 2 * BLOCK_SIZE_BYTES, 2 * BLOCK_SIZE_BYTES - 5}};
+	ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_writev(bs, ids, 4, write_iov, 3));
+
+	// Each block reads back the same one at a time
+	uint8_t read_buffer[4 * BLOCK_SIZE_BYTES] = {0};
+	for (size_t i = 0; i < 4; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[i], read_buffer + i * BLOCK_SIZE_BYTES));
+	}
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+
+	// and all together in reverse
+	size_t reversed[4] = {40, 12, 11, 10};
+	memset(read_buffer, 0, sizeof(read_buffer));
+	struct iovec read_iov = {read_buffer, sizeof(read_buffer)};
+	ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_readv(bs, reversed, 4, &read_iov, 1));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer + 3 * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(read_buffer + 3 * BLOCK_SIZE_BYTES, write_buffer, BLOCK_SIZE_BYTES));
+	block_store_destroy(bs);
+
+	score += 4;
+}
+
+TEST(block_store_async, submit_and_wait) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(nullptr, block_store_async_create(NULL, 8, 1));
+	ASSERT_EQ(nullptr, block_store_async_create(bs, 0, 1));
+	ASSERT_EQ(nullptr, block_store_async_create(bs, 8, 0));
+	block_store_async_t *ring = block_store_async_create(bs, 8, 2);
+	ASSERT_NE(nullptr, ring) << "block_store_async_create returned NULL when it should not have\n";
+
+	// More allocates than the ring holds, the rest go in once the first ones are reaped
+	block_store_sqe_t sqes[10];
+	for (size_t i = 0; i < 10; i++)
+	{
+		sqes[i] = {BLOCK_STORE_OP_ALLOCATE, 0, NULL, i};
+	}
+	block_store_cqe_t cqes[10];
+	size_t ids[10];
+	ASSERT_EQ(8, block_store_async_submit(ring, sqes, 10));
+	ASSERT_EQ(8, block_store_async_in_flight(ring));
+	ASSERT_EQ(8, block_store_async_wait(ring, cqes, 10, 8));
+	ASSERT_EQ(2, block_store_async_submit(ring, sqes + 8, 2));
+	ASSERT_EQ(2, block_store_async_wait(ring, cqes + 8, 2, 5));
+	ASSERT_EQ(0, block_store_async_in_flight(ring));
+	for (size_t i = 0; i < 10; i++)
+	{
+		ASSERT_NE(SIZE_MAX, cqes[i].result);
+		ids[cqes[i].user_data] = cqes[i].result;
+	}
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 10, block_store_get_used_blocks(bs));
+
+	// Writes then reads, each block gets its own pattern
+	uint8_t out[10][BLOCK_SIZE_BYTES];
+	uint8_t in[10][BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < 10; i++)
+	{
+		memset(out[i], (int)i + 1, BLOCK_SIZE_BYTES);
+		sqes[i] = {BLOCK_STORE_OP_WRITE, ids[i], out[i], i};
+	}
+	ASSERT_EQ(8, block_store_async_submit(ring, sqes, 8));
+	size_t reaped = 0;
+	while (reaped < 8)
+	{
+		reaped += block_store_async_poll(ring, cqes + reaped, 10 - reaped);
+	}
+	ASSERT_EQ(2, block_store_async_submit(ring, sqes + 8, 2));
+	ASSERT_EQ(2, block_store_async_wait(ring, cqes, 10, 2));
+	for (size_t i = 0; i < 10; i++)
+	{
+		sqes[i] = {BLOCK_STORE_OP_READ, ids[i], in[i], i};
+	}
+	ASSERT_EQ(8, block_store_async_submit(ring, sqes, 8));
+	ASSERT_EQ(8, block_store_async_wait(ring, cqes, 10, 8));
+	for (size_t i = 0; i < 8; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, cqes[i].result);
+		ASSERT_EQ(0, memcmp(out[i], in[i], BLOCK_SIZE_BYTES));
+	}
+
+	// Errors come back the same way the synchronous calls report them, a bad op stops the batch
+	sqes[0] = {BLOCK_STORE_OP_READ, 5000, in[0], 42};
+	sqes[1] = {(block_store_op_t)99, 0, NULL, 43};
+	ASSERT_EQ(1, block_store_async_submit(ring, sqes, 2));
+	ASSERT_EQ(1, block_store_async_wait(ring, cqes, 10, 1));
+	ASSERT_EQ(42, cqes[0].user_data);
+	ASSERT_EQ(0, cqes[0].result);
+
+	for (size_t i = 0; i < 10; i++)
+	{
+		sqes[i] = {BLOCK_STORE_OP_RELEASE, ids[i], NULL, i};
+	}
+	ASSERT_EQ(8, block_store_async_submit(ring, sqes, 8));
+	ASSERT_EQ(0, block_store_async_submit(NULL, sqes, 1));
+	ASSERT_EQ(0, block_store_async_poll(ring, NULL, 1));
+	ASSERT_EQ(SIZE_MAX, block_store_async_in_flight(NULL));
+	// destroy lets everything submitted finish first
+	block_store_async_destroy(ring);
+	block_store_async_destroy(NULL);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_write_read, vectored_errors) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_request(bs, 10));
+
+	uint8_t buffer[2 * BLOCK_SIZE_BYTES];
+	memset(buffer, 'x', sizeof(buffer));
+	struct iovec iov = {buffer, sizeof(buffer)};
+
+	// Block 11 isn't allocated, so nothing gets written to block 10 either
+	size_t ids[2] = {10, 11};
+	ASSERT_EQ(0, block_store_writev(bs, ids, 2, &iov, 1));
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, read_buffer));
+	ASSERT_NE('x', read_buffer[0]);
+
+	// Not enough room in the buffers
+	ASSERT_EQ(true, block_store_request(bs, 11));
+	iov.iov_len = 2 * BLOCK_SIZE_BYTES - 1;
+	ASSERT_EQ(0, block_store_readv(bs, ids, 2, &iov, 1));
+
+	ASSERT_EQ(0, block_store_readv(NULL, ids, 2, &iov, 1));
+	ASSERT_EQ(0, block_store_readv(bs, NULL, 2, &iov, 1));
+	ASSERT_EQ(0, block_store_writev(bs, ids, 2, NULL, 1));
+	ASSERT_EQ(0, block_store_writev(bs, ids, 0, &iov, 1));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_pin, read_write) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	size_t id = block_store_allocate_extent(bs, 3);
+	ASSERT_NE(SIZE_MAX, id);
+
+	// Writes through the pointer are what a plain read sees
+	uint8_t *block = (uint8_t *) block_store_pin_write(bs, id, 3);
+	ASSERT_NE(nullptr, block);
+	memset(block, 'p', 3 * BLOCK_SIZE_BYTES);
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id + 2, read_buffer));
+	ASSERT_EQ('p', read_buffer[BLOCK_SIZE_BYTES - 1]);
+
+	// and plain writes are what the pointer sees
+	memset(read_buffer, 'w', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id + 1, read_buffer));
+	const uint8_t *view = (const uint8_t *) block_store_pin_read(bs, id + 1, 1);
+	ASSERT_EQ(block + BLOCK_SIZE_BYTES, view);
+	ASSERT_EQ('w', view[0]);
+	block_store_unpin(bs, id + 1, 1);
+	block_store_unpin(bs, id, 3);
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_pin, racing_release) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	const size_t id = block_store_allocate(bs);
+
+	// One thread keeps freeing the block and taking it back, the other pins it
+	// While a pin holds, the block must stay allocated, so nobody can request it
+	std::thread releaser([bs, id]() {
+		for (int i = 0; i < 20000; i++)
+		{
+			block_store_release(bs, id);
+			block_store_request(bs, id);
+		}
+	});
+	size_t violations = 0;
+	for (int i = 0; i < 20000; i++)
+	{
+		if (block_store_pin_read(bs, id, 1) != nullptr)
+		{
+			if (block_store_request(bs, id))
+			{
+				violations++;
+			}
+			block_store_unpin(bs, id, 1);
+		}
+	}
+	releaser.join();
+	ASSERT_EQ(0, violations);
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_pin, blocks_release) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	size_t id = block_store_allocate(bs);
+
+	// Pinned twice, so it takes two unpins to let it go
+	ASSERT_NE(nullptr, block_store_pin_read(bs, id, 1));
+	ASSERT_NE(nullptr, block_store_pin_read(bs, id, 1));
+	block_store_release(bs, id);
+	block_store_release_extent(bs, id, 1);
+	block_store_release_many(bs, &id, 1);
+	ASSERT_EQ(false, block_store_request(bs, id));
+	block_store_unpin(bs, id, 1);
+	block_store_release(bs, id);
+	ASSERT_EQ(false, block_store_request(bs, id));
+	block_store_unpin(bs, id, 1);
+	block_store_release(bs, id);
+	ASSERT_EQ(true, block_store_request(bs, id));
+
+	// Free blocks, out of range, and writing the bitmap aren't allowed
+	ASSERT_EQ(nullptr, block_store_pin_read(bs, id + 1, 1));
+	ASSERT_EQ(nullptr, block_store_pin_read(bs, id, 2));
+	ASSERT_EQ(nullptr, block_store_pin_read(bs, BLOCK_STORE_NUM_BLOCKS, 1));
+	ASSERT_EQ(nullptr, block_store_pin_read(NULL, id, 1));
+	ASSERT_EQ(nullptr, block_store_pin_write(bs, BITMAP_START_BLOCK, 1));
+	ASSERT_NE(nullptr, block_store_pin_read(bs, BITMAP_START_BLOCK, BITMAP_NUM_BLOCKS));
+	block_store_unpin(bs, BITMAP_START_BLOCK, BITMAP_NUM_BLOCKS);
+	block_store_unpin(NULL, id, 1);
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_snapshot, copy_on_write)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	uint8_t first[BLOCK_SIZE_BYTES], second[BLOCK_SIZE_BYTES], third[BLOCK_SIZE_BYTES], buffer[BLOCK_SIZE_BYTES];
+	memset(first, 1, sizeof(first));
+	memset(second, 2, sizeof(second));
+	memset(third, 3, sizeof(third));
+
+	size_t id = block_store_allocate(bs);
+	size_t other = block_store_allocate(bs);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, first));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, other, first));
+
+	block_store_snapshot_t *older = block_store_snapshot(bs);
+	ASSERT_NE(nullptr, older);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, second));
+	block_store_snapshot_t *newer = block_store_snapshot(bs);
+	ASSERT_NE(nullptr, newer);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, third));
+	size_t later = block_store_allocate(bs);
+	block_store_release(bs, other);
+
+	// Each snapshot sees the device as it was when it was taken
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_snapshot_read(older, id, buffer));
+	ASSERT_EQ(0, memcmp(buffer, first, sizeof(buffer)));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_snapshot_read(newer, id, buffer));
+	ASSERT_EQ(0, memcmp(buffer, second, sizeof(buffer)));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+	ASSERT_EQ(0, memcmp(buffer, third, sizeof(buffer)));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_snapshot_read(older, other, buffer));
+	ASSERT_EQ(0, memcmp(buffer, first, sizeof(buffer)));
+	ASSERT_EQ(0, block_store_snapshot_read(newer, later, buffer));
+	ASSERT_EQ(0, block_store_read(bs, other, buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_snapshot_read(newer, BITMAP_START_BLOCK, buffer));
+
+	// Letting go of the newer one hands its copies down to the older one
+	block_store_snapshot_release(newer);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, second));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_snapshot_read(older, id, buffer));
+	ASSERT_EQ(0, memcmp(buffer, first, sizeof(buffer)));
+
+	ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+	ASSERT_EQ(0, block_store_snapshot_read(NULL, id, buffer));
+	ASSERT_EQ(0, block_store_snapshot_read(older, BLOCK_STORE_NUM_BLOCKS, buffer));
+	ASSERT_EQ(0, block_store_snapshot_read(older, id, NULL));
+	block_store_snapshot_release(NULL);
+
+	// Whatever is still held goes with the device
+	block_store_snapshot(bs);
+	block_store_snapshot_release(older);
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
 TEST(block_store_serialize, valid_serialize)
 {
 	block_store_t *bs = NULL;
@@ -441,6 +1433,346 @@ TEST(block_store_serialize, null_bs)
 	score += 2;
 }
 
+TEST(block_store_serialize, incremental)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	// No image yet
+	remove("test_inc.bs");
+	ASSERT_EQ(SIZE_MAX, block_store_serialize_incremental(bs, "test_inc.bs"));
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_inc.bs"));
+	ASSERT_EQ(0, block_store_serialize_incremental(bs, "test_inc.bs"));
+
+	// Two neighbours and one far away, plus the bitmap block their bits live in
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'i', sizeof(write_buffer));
+	size_t ids[3] = {20, 21, 300};
+	for (size_t i = 0; i < 3; i++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, ids[i]));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, ids[i], write_buffer));
+	}
+	ASSERT_EQ(5 * BLOCK_SIZE_BYTES, block_store_serialize_incremental(bs, "test_inc.bs"));
+	ASSERT_EQ(0, block_store_serialize_incremental(bs, "test_inc.bs"));
+
+	// Release only touches the bitmap
+	block_store_release(bs, 21);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_serialize_incremental(bs, "test_inc.bs"));
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize("test_inc.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_used_blocks(bs));
+	ASSERT_EQ(true, block_store_request(bs, 21));
+	uint8_t read_buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 300, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	ASSERT_EQ(SIZE_MAX, block_store_serialize_incremental(bs, NULL));
+	ASSERT_EQ(SIZE_MAX, block_store_serialize_incremental(NULL, "test_inc.bs"));
+	block_store_destroy(bs);
+
+	// Images of another size are refused
+	bs = block_store_create_ex(1024, BLOCK_SIZE_BYTES);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(SIZE_MAX, block_store_serialize_incremental(bs, "test_inc.bs"));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+static size_t file_size(const char *const filename)
+{
+	struct stat st;
+	return stat(filename, &st) == 0 ? (size_t)st.st_size : SIZE_MAX;
+}
+
+TEST(block_store_serialize, sparse)
+{
+	block_store_t *bs = block_store_create_ex(65536, 64);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	const size_t bitmap_blocks = 65536 / 8 / 64;
+	uint8_t write_buffer[64], read_buffer[64];
+	memset(write_buffer, 's', sizeof(write_buffer));
+	ASSERT_EQ(true, block_store_request(bs, 60000));
+	ASSERT_EQ(64, block_store_write(bs, 60000, write_buffer));
+	ASSERT_EQ(true, block_store_request(bs, 3));
+
+	// Only the allocated blocks get written, the rest of the image is holes
+	ASSERT_EQ((bitmap_blocks + 2) * 64, block_store_serialize_sparse(bs, "test_sparse.bs"));
+	ASSERT_EQ(65536 * 64, file_size("test_sparse.bs"));
+	struct stat st;
+	ASSERT_EQ(0, stat("test_sparse.bs", &st));
+	ASSERT_LT((size_t)st.st_blocks * 512, (size_t)65536 * 64);
+	ASSERT_EQ(0, block_store_serialize_incremental(bs, "test_sparse.bs"));
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize_ex("test_sparse.bs", 65536, 64);
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize_ex returned NULL when it should not have\n";
+	ASSERT_EQ(bitmap_blocks + 2, block_store_get_used_blocks(bs));
+	ASSERT_EQ(64, block_store_read(bs, 60000, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	ASSERT_EQ(0, block_store_serialize_sparse(NULL, "test_sparse.bs"));
+	ASSERT_EQ(0, block_store_serialize_sparse(bs, NULL));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_wal, replay)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(false, block_store_commit(bs));
+	ASSERT_EQ(false, block_store_enable_wal(NULL, "test_wal.bs"));
+	ASSERT_EQ(false, block_store_enable_wal(bs, NULL));
+	ASSERT_EQ(true, block_store_enable_wal(bs, "test_wal.bs"));
+	ASSERT_EQ(false, block_store_enable_wal(bs, "test_wal.bs"));
+	const size_t empty_log = file_size("test_wal.bs.wal");
+	ASSERT_NE(SIZE_MAX, empty_log);
+
+	// None of this makes it into the image, only the log
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'w', sizeof(write_buffer));
+	ASSERT_EQ(true, block_store_request(bs, 40));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 40, write_buffer));
+	ASSERT_EQ(true, block_store_request(bs, 41));
+	block_store_release(bs, 41);
+	ASSERT_EQ(true, block_store_commit(bs));
+	block_store_wal_stats_t stats;
+	ASSERT_EQ(true, block_store_get_wal_stats(bs, &stats));
+	ASSERT_EQ(4, stats.records);
+	ASSERT_EQ(1, stats.commits);
+	ASSERT_EQ(1, stats.syncs);
+	ASSERT_EQ(false, block_store_get_wal_stats(bs, NULL));
+	block_store_destroy(bs);
+
+	// A crash can leave half a record at the end, replay stops in front of it
+	FILE *log = fopen("test_wal.bs.wal", "ab");
+	ASSERT_NE(nullptr, log);
+	fputs("torn", log);
+	fclose(log);
+
+	bs = block_store_deserialize("test_wal.bs");
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize returned NULL when it should not have\n";
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	uint8_t read_buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 40, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	ASSERT_EQ(false, block_store_get_wal_stats(bs, &stats));
+
+	// Serializing to the image makes the log redundant, so it's trimmed
+	ASSERT_EQ(true, block_store_enable_wal(bs, "test_wal.bs"));
+	ASSERT_EQ(empty_log, file_size("test_wal.bs.wal"));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 40, read_buffer));
+	ASSERT_EQ(true, block_store_commit(bs));
+	ASSERT_LT(empty_log, file_size("test_wal.bs.wal"));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_serialize_incremental(bs, "test_wal.bs"));
+	ASSERT_EQ(empty_log, file_size("test_wal.bs.wal"));
+	// the trimmed log was written beside the old one and renamed over it
+	ASSERT_EQ(SIZE_MAX, file_size("test_wal.bs.wal.tmp"));
+	// other files aren't the log's business
+	ASSERT_EQ(true, block_store_request(bs, 41));
+	ASSERT_EQ(true, block_store_commit(bs));
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_wal_other.bs"));
+	ASSERT_LT(empty_log, file_size("test_wal.bs.wal"));
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_wal.bs"));
+	ASSERT_EQ(empty_log, file_size("test_wal.bs.wal"));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_wal, replay_then_serialize)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_enable_wal(bs, "test_wal_fold.bs"));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 'A', sizeof(buffer));
+	ASSERT_EQ(true, block_store_request(bs, 40));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 40, buffer));
+	ASSERT_EQ(true, block_store_commit(bs));
+	block_store_destroy(bs);
+
+	// The replayed log goes into the image, and the log goes away
+	bs = block_store_deserialize("test_wal_fold.bs");
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize returned NULL when it should not have\n";
+	ASSERT_EQ(SIZE_MAX, file_size("test_wal_fold.bs.wal"));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	memset(buffer, 'B', sizeof(buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 40, buffer));
+	block_store_release(bs, 40);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_wal_fold.bs"));
+	block_store_destroy(bs);
+
+	// So the old log can't bring block 40 back
+	bs = block_store_deserialize("test_wal_fold.bs");
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize returned NULL when it should not have\n";
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	ASSERT_EQ(0, block_store_read(bs, 40, buffer));
+	block_store_destroy(bs);
+
+	// Same for a lazy deserialize, which folds the log in without reading the rest of the image
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_enable_wal(bs, "test_wal_fold.bs"));
+	ASSERT_EQ(true, block_store_request(bs, 41));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 41, buffer));
+	ASSERT_EQ(true, block_store_commit(bs));
+	block_store_destroy(bs);
+	bs = block_store_deserialize_lazy("test_wal_fold.bs", BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, false);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(SIZE_MAX, file_size("test_wal_fold.bs.wal"));
+	block_store_release(bs, 41);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_wal_fold.bs"));
+	block_store_destroy(bs);
+	bs = block_store_deserialize("test_wal_fold.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+	unlink("test_wal_fold.bs");
+
+	score += 3;
+}
+
+TEST(block_store_wal, batched_allocation)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_enable_wal(bs, "test_wal_many.bs"));
+	size_t ids[8];
+	ASSERT_EQ(8, block_store_allocate_many(bs, 8, ids));
+	// a repeat and a block that was never allocated don't make it into the record
+	const size_t released[4] = {ids[0], ids[1], ids[1], ids[7] + 100};
+	block_store_release_many(bs, released, 4);
+	ASSERT_EQ(true, block_store_commit(bs));
+	block_store_wal_stats_t stats;
+	ASSERT_EQ(true, block_store_get_wal_stats(bs, &stats));
+	ASSERT_EQ(2, stats.records);
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize("test_wal_many.bs");
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize returned NULL when it should not have\n";
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 6, block_store_get_used_blocks(bs));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(0, block_store_read(bs, ids[0], buffer));
+	ASSERT_EQ(0, block_store_read(bs, ids[1], buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[2], buffer));
+	ASSERT_EQ(0, block_store_read(bs, ids[7] + 100, buffer));
+	block_store_destroy(bs);
+	unlink("test_wal_many.bs");
+
+	score += 2;
+}
+
+TEST(block_store_wal, group_commit)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_enable_wal(bs, "test_wal.bs"));
+
+	// Every thread owns a block and commits each write to it
+	const size_t num_threads = 4;
+	const size_t rounds = 50;
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < num_threads; t++)
+	{
+		threads.emplace_back([bs, t, rounds]() {
+			uint8_t buffer[BLOCK_SIZE_BYTES];
+			ASSERT_EQ(true, block_store_request(bs, 100 + t));
+			for (size_t round = 1; round <= rounds; round++)
+			{
+				memset(buffer, (int)(t * rounds + round), sizeof(buffer));
+				ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 100 + t, buffer));
+				ASSERT_EQ(true, block_store_commit(bs));
+			}
+		});
+	}
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	block_store_wal_stats_t stats;
+	ASSERT_EQ(true, block_store_get_wal_stats(bs, &stats));
+	ASSERT_EQ(num_threads * (rounds + 1), stats.records);
+	ASSERT_EQ(num_threads * rounds, stats.commits);
+	ASSERT_LE(stats.syncs, stats.commits);
+	ASSERT_LT(0, stats.syncs);
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize("test_wal.bs");
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize returned NULL when it should not have\n";
+	for (size_t t = 0; t < num_threads; t++)
+	{
+		uint8_t buffer[BLOCK_SIZE_BYTES];
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 100 + t, buffer));
+		ASSERT_EQ((uint8_t)(t * rounds + rounds), buffer[0]);
+	}
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_checkpoint, writes_keep_going)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	uint8_t before[BLOCK_SIZE_BYTES], after[BLOCK_SIZE_BYTES], buffer[BLOCK_SIZE_BYTES];
+	memset(before, 'b', sizeof(before));
+	memset(after, 'a', sizeof(after));
+	size_t ids[8];
+	ASSERT_EQ(8, block_store_allocate_many(bs, 8, ids));
+	for (size_t i = 0; i < 8; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, ids[i], before));
+	}
+
+	// Everything done after the start is left out of the image, and none of it has to wait
+	block_store_checkpoint_t *checkpoint = block_store_checkpoint_start(bs, "test_ckpt.bs");
+	ASSERT_NE(nullptr, checkpoint);
+	for (size_t i = 0; i < 8; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, ids[i], after));
+	}
+	size_t extra = block_store_allocate(bs);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_checkpoint_wait(checkpoint));
+
+	block_store_t *copy = block_store_deserialize("test_ckpt.bs");
+	ASSERT_NE(nullptr, copy) << "block_store_deserialize returned NULL when it should not have\n";
+	for (size_t i = 0; i < 8; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, ids[i], buffer));
+		ASSERT_EQ(0, memcmp(buffer, before, sizeof(buffer)));
+	}
+	ASSERT_EQ(0, block_store_read(copy, extra, buffer));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 8, block_store_get_used_blocks(copy));
+	block_store_destroy(copy);
+
+	// Progress ends up at the whole image
+	checkpoint = block_store_checkpoint_start(bs, "test_ckpt.bs");
+	ASSERT_NE(nullptr, checkpoint);
+	size_t written = 0, total = 0;
+	while (block_store_checkpoint_progress(checkpoint, &written, &total) == false)
+	{
+		std::this_thread::yield();
+	}
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, written);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, total);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_checkpoint_wait(checkpoint));
+
+	ASSERT_EQ(nullptr, block_store_checkpoint_start(NULL, "test_ckpt.bs"));
+	ASSERT_EQ(nullptr, block_store_checkpoint_start(bs, NULL));
+	ASSERT_EQ(false, block_store_checkpoint_progress(NULL, &written, &total));
+	ASSERT_EQ(0, block_store_checkpoint_wait(NULL));
+	checkpoint = block_store_checkpoint_start(bs, "no_such_dir/test_ckpt.bs");
+	ASSERT_NE(nullptr, checkpoint);
+	ASSERT_EQ(0, block_store_checkpoint_wait(checkpoint));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
 TEST(block_store_deserialize, valid_deserialize)
 {
 	block_store_t *bsWrite = NULL;
@@ -505,6 +1837,217 @@ TEST(block_store_deserialize, valid_deserialize)
 }
 
 
+TEST(block_store_deserialize, valid_deserialize_ex)
+{
+	block_store_t *bsWrite = block_store_create_ex(1024, 512);
+	ASSERT_NE(nullptr, bsWrite) << "block_store_create_ex returned NULL when it should not have\n";
+
+	uint8_t write_buffer[512];
+	memset(write_buffer, 'Q', sizeof(write_buffer));
+	size_t id = 1000;
+	ASSERT_EQ(true, block_store_request(bsWrite, id));
+	ASSERT_EQ(512, block_store_write(bsWrite, id, write_buffer));
+	ASSERT_EQ(1024 * 512, block_store_serialize(bsWrite, "test_ex.bs"));
+	block_store_destroy(bsWrite);
+
+	// Wrong geometry means the image is the wrong size
+	ASSERT_EQ(nullptr, block_store_deserialize_ex("test_ex.bs", 2048, 512));
+
+	block_store_t *bsRead = block_store_deserialize_ex("test_ex.bs", 1024, 512);
+	ASSERT_NE(nullptr, bsRead);
+	ASSERT_EQ(false, block_store_request(bsRead, id));
+	uint8_t read_buffer[512] = {0};
+	ASSERT_EQ(512, block_store_read(bsRead, id, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	block_store_destroy(bsRead);
+
+	score += 4;
+}
+
+TEST(block_store_deserialize, lazy)
+{
+	block_store_t *bs = block_store_create_ex(4096, 64);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	uint8_t write_buffer[64], read_buffer[64];
+	for (size_t id = 1000; id < 1100; id++)
+	{
+		memset(write_buffer, (int)id, sizeof(write_buffer));
+		ASSERT_EQ(true, block_store_request(bs, id));
+		ASSERT_EQ(64, block_store_write(bs, id, write_buffer));
+	}
+	ASSERT_EQ(4096 * 64, block_store_serialize(bs, "test_lazy.bs"));
+	const size_t used = block_store_get_used_blocks(bs);
+	block_store_destroy(bs);
+
+	// Blocks come in from the file as they're read, the allocation state is there from the start
+	bs = block_store_deserialize_lazy("test_lazy.bs", 4096, 64, false);
+	ASSERT_NE(nullptr, bs) << "block_store_deserialize_lazy returned NULL when it should not have\n";
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 1050));
+	memset(write_buffer, 1050 & 0xFF, sizeof(write_buffer));
+	ASSERT_EQ(64, block_store_read(bs, 1050, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+
+	// A write next to blocks that were never read leaves them alone
+	memset(write_buffer, 'z', sizeof(write_buffer));
+	ASSERT_EQ(64, block_store_write(bs, 1001, write_buffer));
+	memset(write_buffer, 1002 & 0xFF, sizeof(write_buffer));
+	ASSERT_EQ(64, block_store_read(bs, 1002, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+
+	// Serializing reads in whatever is left first
+	ASSERT_EQ(4096 * 64, block_store_serialize(bs, "test_lazy_copy.bs"));
+	block_store_destroy(bs);
+	bs = block_store_deserialize_ex("test_lazy_copy.bs", 4096, 64);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(64, block_store_read(bs, 1099, read_buffer));
+	memset(write_buffer, 1099 & 0xFF, sizeof(write_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	ASSERT_EQ(64, block_store_read(bs, 1001, read_buffer));
+	memset(write_buffer, 'z', sizeof(write_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	block_store_destroy(bs);
+
+	// The prefetcher gets stopped by destroy if it isn't done yet
+	bs = block_store_deserialize_lazy("test_lazy.bs", 4096, 64, true);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(64, block_store_read(bs, 1050, read_buffer));
+	block_store_destroy(bs);
+
+	ASSERT_EQ(nullptr, block_store_deserialize_lazy("test_lazy.bs", 2048, 64, false));
+	ASSERT_EQ(nullptr, block_store_deserialize_lazy("no_such_file.bs", 4096, 64, false));
+	ASSERT_EQ(nullptr, block_store_deserialize_lazy(NULL, 4096, 64, false));
+
+	score += 5;
+}
+
+TEST(block_store_alloc_free_req, allocate_nearly_full_large) {
+	// Fill a big device, then free a block near the end and get exactly that one back
+	block_store_t *bs = block_store_create_ex(1 << 20, 64);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	block_store_release(bs, 1000003);
+	ASSERT_EQ(1000003, block_store_allocate(bs));
+	block_store_release(bs, 5);
+	block_store_release(bs, 1000003);
+	ASSERT_EQ(5, block_store_allocate(bs));
+	ASSERT_EQ(1000003, block_store_allocate(bs));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_mmap, open_write_sync)
+{
+	block_store_t *bs = block_store_create_ex(2048, 128);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	size_t id = 1500;
+	ASSERT_EQ(true, block_store_request(bs, id));
+	uint8_t write_buffer[128];
+	memset(write_buffer, 'm', sizeof(write_buffer));
+	ASSERT_EQ(128, block_store_write(bs, id, write_buffer));
+	ASSERT_EQ(2048 * 128, block_store_serialize(bs, "test_mmap.bs"));
+	// Plain devices have nothing to sync to
+	ASSERT_EQ(false, block_store_sync(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_open_mmap_ex("test_mmap.bs", 2048, 128);
+	ASSERT_NE(nullptr, bs);
+	uint8_t read_buffer[128] = {0};
+	ASSERT_EQ(128, block_store_read(bs, id, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	ASSERT_EQ(false, block_store_request(bs, id));
+
+	// Changes land in the file
+	size_t id2 = block_store_allocate(bs);
+	ASSERT_EQ(0, id2);
+	memset(write_buffer, 'n', sizeof(write_buffer));
+	ASSERT_EQ(128, block_store_write(bs, id2, write_buffer));
+	ASSERT_EQ(true, block_store_sync(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize_ex("test_mmap.bs", 2048, 128);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(false, block_store_request(bs, id2));
+	ASSERT_EQ(128, block_store_read(bs, id2, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	block_store_destroy(bs);
+
+	// The geometry has to match the file exactly
+	ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_mmap.bs", 4096, 128));
+	ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap.bs"));
+	ASSERT_EQ(nullptr, block_store_open_mmap(NULL));
+	ASSERT_EQ(false, block_store_sync(NULL));
+
+	score += 5;
+}
+
+TEST(block_store_cached, write_back_and_evict)
+{
+	block_store_t *bs = block_store_create_ex(2048, 128);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(2048 * 128, block_store_serialize(bs, "test_cached.bs"));
+	block_store_destroy(bs);
+
+	// Eight frames for sixty-four blocks means plenty of evictions
+	bs = block_store_open_cached("test_cached.bs", 2048, 128, 8);
+	ASSERT_NE(nullptr, bs);
+	size_t ids[64];
+	ASSERT_EQ(64, block_store_allocate_many(bs, 64, ids));
+	uint8_t write_buffer[128], read_buffer[128];
+	for (size_t i = 0; i < 64; i++)
+	{
+		memset(write_buffer, (int)i, sizeof(write_buffer));
+		ASSERT_EQ(128, block_store_write(bs, ids[i], write_buffer));
+	}
+	for (size_t i = 0; i < 64; i++)
+	{
+		memset(write_buffer, (int)i, sizeof(write_buffer));
+		ASSERT_EQ(128, block_store_read(bs, ids[i], read_buffer));
+		ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	}
+	// The same block again is a hit
+	ASSERT_EQ(128, block_store_read(bs, ids[63], read_buffer));
+	block_store_cache_stats_t stats;
+	ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	ASSERT_EQ(1, stats.hits);
+	ASSERT_EQ(128, stats.misses);
+	ASSERT_EQ(120, stats.evictions);
+	ASSERT_EQ(64, stats.writebacks);
+
+	// Only what's in memory wants the whole device there
+	ASSERT_EQ(nullptr, block_store_pin_read(bs, ids[0], 1));
+	ASSERT_EQ(nullptr, block_store_snapshot(bs));
+	ASSERT_EQ(0, block_store_serialize(bs, "test_cached_other.bs"));
+	ASSERT_EQ(true, block_store_sync(bs));
+	memset(write_buffer, 'w', sizeof(write_buffer));
+	ASSERT_EQ(128, block_store_write(bs, ids[0], write_buffer));
+	block_store_destroy(bs);
+
+	// Destroy writes back whatever was still only cached
+	bs = block_store_deserialize_ex("test_cached.bs", 2048, 128);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(64 + 2048 / 8 / 128, block_store_get_used_blocks(bs));
+	ASSERT_EQ(128, block_store_read(bs, ids[0], read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	memset(write_buffer, 63, sizeof(write_buffer));
+	ASSERT_EQ(128, block_store_read(bs, ids[63], read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(write_buffer)));
+	ASSERT_EQ(false, block_store_get_cache_stats(bs, &stats));
+	block_store_destroy(bs);
+
+	ASSERT_EQ(nullptr, block_store_open_cached("test_cached.bs", 2048, 128, 0));
+	ASSERT_EQ(nullptr, block_store_open_cached("test_cached.bs", 4096, 128, 8));
+	ASSERT_EQ(nullptr, block_store_open_cached(NULL, 2048, 128, 8));
+	ASSERT_EQ(false, block_store_get_cache_stats(NULL, &stats));
+
+	score += 5;
+}
+
 TEST(block_store_deserialize, null_filename)
 {
 	// Try to call deserialize...
@@ -515,3 +2058,119 @@ TEST(block_store_deserialize, null_filename)
 	score += 2;
 }
 
+
+static uint64_t histogram_total(const block_store_stats_t &stats, const int op)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < BLOCK_STORE_LATENCY_BUCKETS; i++)
+	{
+		total += stats.latency[op][i];
+	}
+	return total;
+}
+
+TEST(block_store_stats, counters_and_histograms)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	block_store_stats_t stats;
+	ASSERT_EQ(false, block_store_get_stats(bs, &stats));
+
+	// Nothing before enabling counts
+	size_t first = block_store_allocate(bs);
+	ASSERT_EQ(true, block_store_enable_stats(bs));
+	ASSERT_EQ(false, block_store_enable_stats(bs));
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(0, stats.allocations);
+
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {7};
+	size_t id = block_store_allocate(bs);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+	ASSERT_EQ(0, block_store_read(bs, id + 1, buffer));
+	block_store_release(bs, first);
+	block_store_release(bs, first);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_stats.bs"));
+	unlink("test_stats.bs");
+
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(1, stats.allocations);
+	ASSERT_EQ(0, stats.allocation_failures);
+	// finding it only took loading the bitmap's first word
+	ASSERT_EQ(64, stats.scanned_bits);
+	ASSERT_EQ(1, stats.releases);
+	ASSERT_EQ(2, stats.reads);
+	ASSERT_EQ(2 * BLOCK_SIZE_BYTES, stats.read_bytes);
+	ASSERT_EQ(1, stats.writes);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, stats.written_bytes);
+	ASSERT_EQ(1, stats.serializes);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, stats.serialized_bytes);
+	ASSERT_EQ(1, histogram_total(stats, BLOCK_STORE_STAT_ALLOCATE));
+	ASSERT_EQ(1, histogram_total(stats, BLOCK_STORE_STAT_RELEASE));
+	ASSERT_EQ(2, histogram_total(stats, BLOCK_STORE_STAT_READ));
+	ASSERT_EQ(1, histogram_total(stats, BLOCK_STORE_STAT_WRITE));
+	ASSERT_EQ(1, histogram_total(stats, BLOCK_STORE_STAT_SERIALIZE));
+
+	// Extents, batches, ranges and vectored I/O count the blocks and bytes they moved, and are timed once per call
+	block_store_reset_stats(bs);
+	const size_t extent = block_store_allocate_extent(bs, 4);
+	ASSERT_NE(SIZE_MAX, extent);
+	size_t ids[3];
+	ASSERT_EQ(3, block_store_allocate_many(bs, 3, ids));
+	uint8_t pair[2 * BLOCK_SIZE_BYTES] = {0};
+	struct iovec vec = {pair, sizeof(pair)};
+	ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_writev(bs, ids, 2, &vec, 1));
+	ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_readv(bs, ids, 2, &vec, 1));
+	ASSERT_EQ(4, block_store_release_range(bs, extent, 4));
+	block_store_release_many(bs, ids, 3);
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(7, stats.allocations);
+	ASSERT_EQ(7, stats.releases);
+	ASSERT_EQ(1, stats.reads);
+	ASSERT_EQ(2 * BLOCK_SIZE_BYTES, stats.read_bytes);
+	ASSERT_EQ(1, stats.writes);
+	ASSERT_EQ(2 * BLOCK_SIZE_BYTES, stats.written_bytes);
+	ASSERT_EQ(2, histogram_total(stats, BLOCK_STORE_STAT_ALLOCATE));
+	ASSERT_EQ(2, histogram_total(stats, BLOCK_STORE_STAT_RELEASE));
+
+	// Filling up counts the failure, and the whole device as searched
+	block_store_reset_stats(bs);
+	size_t free_blocks = block_store_get_free_blocks(bs);
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(free_blocks, stats.allocations);
+	ASSERT_EQ(1, stats.allocation_failures);
+	ASSERT_EQ(free_blocks, histogram_total(stats, BLOCK_STORE_STAT_ALLOCATE));
+	ASSERT_EQ(0, stats.reads);
+
+	block_store_reset_stats(bs);
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(0, stats.allocation_failures);
+	ASSERT_EQ(0, stats.scanned_bits);
+	ASSERT_EQ(0, histogram_total(stats, BLOCK_STORE_STAT_ALLOCATE));
+
+	ASSERT_EQ(false, block_store_enable_stats(NULL));
+	ASSERT_EQ(false, block_store_get_stats(NULL, &stats));
+	ASSERT_EQ(false, block_store_get_stats(bs, NULL));
+	block_store_reset_stats(NULL);
+	block_store_destroy(bs);
+
+	// Only the allocate that finds its magazine empty searches the bitmap
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_enable_stats(bs));
+	ASSERT_EQ(true, block_store_enable_magazines(bs, 8));
+	for (int i = 0; i < 4; i++)
+	{
+		ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+	}
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(4, stats.allocations);
+	ASSERT_EQ(3, stats.magazine_hits);
+	block_store_destroy(bs);
+
+	score += 3;
+}